@@ -0,0 +1,600 @@
+#include "libraries/HelperLibrary.h"
+#include "libraries/Histogram.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Load generator for the server, in the spirit of redis-benchmark: a number of
+// connections are kept busy with pipelined GET / SET requests for a fixed
+// duration, then the throughput and the latency distribution are reported.
+// All the connections are driven by one poll() loop.
+
+const size_t k_max_msg = 32 << 20;
+
+enum {
+  SER_NIL = 0,
+  SER_ERR = 1,
+  SER_STR = 2,
+  SER_INT = 3,
+  SER_DBL = 4,
+  SER_ARR = 5,
+};
+
+enum {
+  MODE_OPS = 0,     // pipelined GET / SET requests
+  MODE_CONNECT = 1, // connect, one GET, close, again
+};
+
+enum {
+  OP_GET = 0,
+  OP_SET = 1,
+};
+
+static struct {
+  uint32_t mode = MODE_OPS;
+  const char *host = "127.0.0.1";
+  uint16_t port = 1234;
+  uint32_t clients = 50;
+  uint32_t pipeline = 1;
+  uint64_t keys = 100000;
+  // Value sizes are uniformly distributed in [value_min, value_max]
+  uint32_t value_min = 16;
+  uint32_t value_max = 16;
+  // GET:SET mix
+  uint32_t reads = 1;
+  uint32_t writes = 1;
+  double duration = 10;
+  bool populate = false;
+  bool json = false;
+  uint64_t seed = 1;
+} bench;
+
+// A request sent and not answered yet
+struct Pending {
+  uint64_t sent_us = 0;
+  uint32_t op = OP_GET;
+};
+
+struct BenchConn {
+  int fd = -1;
+  bool connecting = false;
+  std::string wbuf;
+  size_t wpos = 0;
+  std::string rbuf;
+  // Requests in flight, a ring of bench.pipeline items in the order they were
+  // sent
+  std::vector<Pending> pending;
+  size_t pending_head = 0;
+  size_t pending_count = 0;
+  // MODE_CONNECT: when connect() was called
+  uint64_t connect_us = 0;
+};
+
+static struct {
+  Histogram hist[2]; // by OP_*
+  Histogram connect_hist;
+  uint64_t errors = 0;
+  std::mt19937_64 rng;
+  std::string value; // value_max bytes, values are prefixes of it
+} stats;
+
+static bool parseArgs(int argc, char **argv);
+static void populate();
+static void runOps(std::vector<BenchConn> &conns, uint64_t end_us);
+static void runConnect(std::vector<BenchConn> &conns, uint64_t end_us);
+static void report(double secs);
+static uint64_t getMonotonicUsec();
+int main(int argc, char **argv) {
+  if (!parseArgs(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--host addr] [--port N] [--clients N] [--pipeline N]"
+                 " [--keys N] [--value-size N|MIN-MAX] [--ratio GET:SET]"
+                 " [--duration secs] [--populate] [--connect] [--json]"
+                 " [--seed N]\n";
+    return 1;
+  }
+  stats.rng.seed(bench.seed);
+  stats.value.assign(bench.value_max, 'x');
+  if (bench.populate) {
+    populate();
+  }
+
+  std::vector<BenchConn> conns(bench.clients);
+  uint64_t start_us = getMonotonicUsec();
+  uint64_t end_us = start_us + (uint64_t)(bench.duration * 1e6);
+  if (bench.mode == MODE_CONNECT) {
+    runConnect(conns, end_us);
+  } else {
+    runOps(conns, end_us);
+  }
+  report((double)(getMonotonicUsec() - start_us) / 1e6);
+  return 0;
+}
+
+static bool parseRange(const char *arg, uint32_t &lo, uint32_t &hi) {
+  char *end = NULL;
+  unsigned long a = strtoul(arg, &end, 10);
+  unsigned long b = a;
+  if (*end == '-') {
+    b = strtoul(end + 1, &end, 10);
+  }
+  if (end == arg || *end || a > b || b > k_max_msg / 2) {
+    return false;
+  }
+  lo = (uint32_t)a;
+  hi = (uint32_t)b;
+  return true;
+}
+
+// Options:
+//   --host addr           IPv4 address of the server (default: 127.0.0.1)
+//   --port N              (default: 1234)
+//   --clients N           number of connections (default: 50)
+//   --pipeline N          requests in flight per connection (default: 1)
+//   --keys N              keys are picked uniformly from key:0 .. key:N-1
+//   --value-size N|MIN-MAX
+//                         SET value size, or a uniform range (default: 16)
+//   --ratio GET:SET       mix of the requests (default: 1:1)
+//   --duration secs       (default: 10)
+//   --populate            SET every key before the run, so GETs hit
+//   --connect             measure connections instead: each client connects,
+//                         sends one GET, closes and starts again
+//   --json                print the results as one JSON object
+//   --seed N              seed of the key and value size choices
+static bool parseArgs(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+      bench.host = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 65535) {
+        return false;
+      }
+      bench.port = (uint16_t)n;
+    } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 100000) {
+        return false;
+      }
+      bench.clients = (uint32_t)n;
+    } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 100000) {
+        return false;
+      }
+      bench.pipeline = (uint32_t)n;
+    } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 1) {
+        return false;
+      }
+      bench.keys = (uint64_t)n;
+    } else if (strcmp(argv[i], "--value-size") == 0 && i + 1 < argc) {
+      if (!parseRange(argv[++i], bench.value_min, bench.value_max)) {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--ratio") == 0 && i + 1 < argc) {
+      unsigned reads = 0, writes = 0;
+      if (sscanf(argv[++i], "%u:%u", &reads, &writes) != 2 ||
+          reads + writes == 0) {
+        return false;
+      }
+      bench.reads = reads;
+      bench.writes = writes;
+    } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+      bench.duration = atof(argv[++i]);
+      if (!(bench.duration > 0)) {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--populate") == 0) {
+      bench.populate = true;
+    } else if (strcmp(argv[i], "--connect") == 0) {
+      bench.mode = MODE_CONNECT;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      bench.json = true;
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      bench.seed = strtoull(argv[++i], NULL, 10);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint64_t getMonotonicUsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static void appendU32(std::string &buf, uint32_t val) {
+  buf.append((const char *)&val, 4); // little-endian host, like the server
+}
+
+// | u32 total | u32 n | u32 len | arg | u32 len | arg | ...
+static void appendReq(std::string &buf, const std::string_view *args,
+                      size_t n) {
+  uint32_t total = 4;
+  for (size_t i = 0; i < n; i++) {
+    total += 4 + (uint32_t)args[i].size();
+  }
+  appendU32(buf, total);
+  appendU32(buf, (uint32_t)n);
+  for (size_t i = 0; i < n; i++) {
+    appendU32(buf, (uint32_t)args[i].size());
+    buf.append(args[i].data(), args[i].size());
+  }
+}
+
+// The keys are "key:<n>", the same ones as populate() creates
+static std::string_view keyName(char *buf, size_t size, uint64_t n) {
+  int len = snprintf(buf, size, "key:%llu", (unsigned long long)n);
+  return std::string_view(buf, (size_t)len);
+}
+
+static std::string_view pickValue() {
+  uint32_t len = bench.value_min;
+  if (bench.value_max > bench.value_min) {
+    len += (uint32_t)(stats.rng() % (bench.value_max - bench.value_min + 1));
+  }
+  return std::string_view(stats.value.data(), len);
+}
+
+// Append one random request and remember when it was sent
+static void connQueueReq(BenchConn *conn) {
+  char key[32];
+  std::string_view name = keyName(key, sizeof(key), stats.rng() % bench.keys);
+  Pending p;
+  p.op = (stats.rng() % (bench.reads + bench.writes)) < bench.reads ? OP_GET
+                                                                    : OP_SET;
+  if (p.op == OP_GET) {
+    std::string_view args[] = {"get", name};
+    appendReq(conn->wbuf, args, 2);
+  } else {
+    std::string_view args[] = {"set", name, pickValue()};
+    appendReq(conn->wbuf, args, 3);
+  }
+  p.sent_us = getMonotonicUsec();
+  size_t cap = conn->pending.size();
+  conn->pending[(conn->pending_head + conn->pending_count) % cap] = p;
+  conn->pending_count++;
+}
+
+static int connectServer(bool nonblock) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    HelperLibrary::MsgHelpers::die("Failed to create the client socket!");
+  }
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  if (nonblock) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(bench.port);
+  if (inet_pton(AF_INET, bench.host, &addr.sin_addr) != 1) {
+    HelperLibrary::MsgHelpers::die("Bad --host address!");
+  }
+  if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+      !(nonblock && errno == EINPROGRESS)) {
+    HelperLibrary::MsgHelpers::die("Failed to connect to the server!");
+  }
+  return fd;
+}
+
+// Blocking round trip, for populate()
+static void roundTrip(int fd, const std::string &req) {
+  if (HelperLibrary::IOHelpers::writeAll(fd, req.data(), req.size())) {
+    HelperLibrary::MsgHelpers::die("Failed to send a request!");
+  }
+  uint32_t len = 0;
+  std::string reply;
+  if (HelperLibrary::IOHelpers::readAll(fd, (char *)&len, 4) ||
+      len > k_max_msg) {
+    HelperLibrary::MsgHelpers::die("Failed to read a reply!");
+  }
+  reply.resize(len);
+  if (HelperLibrary::IOHelpers::readAll(fd, reply.data(), len)) {
+    HelperLibrary::MsgHelpers::die("Failed to read a reply!");
+  }
+  if (len > 0 && reply[0] == SER_ERR) {
+    HelperLibrary::MsgHelpers::die("The server replied with an error!");
+  }
+}
+
+// SET every key of the key space with MSET, k_populate_batch keys at a time
+const uint64_t k_populate_batch = 1000;
+
+static void populate() {
+  int fd = connectServer(false);
+  std::vector<std::string> names;
+  std::vector<std::string_view> args;
+  std::string req;
+  for (uint64_t base = 0; base < bench.keys; base += k_populate_batch) {
+    uint64_t end = base + k_populate_batch < bench.keys
+                       ? base + k_populate_batch
+                       : bench.keys;
+    names.clear();
+    for (uint64_t n = base; n < end; n++) {
+      names.push_back("key:" + std::to_string(n));
+    }
+    args.assign(1, "mset");
+    for (const std::string &name : names) {
+      args.push_back(name);
+      args.push_back(pickValue());
+    }
+    req.clear();
+    appendReq(req, args.data(), args.size());
+    roundTrip(fd, req);
+  }
+  close(fd);
+}
+
+// Write as much of wbuf as the socket takes. false if the connection is lost.
+static bool connFlush(BenchConn *conn) {
+  while (conn->wpos < conn->wbuf.size()) {
+    ssize_t rv = write(conn->fd, conn->wbuf.data() + conn->wpos,
+                       conn->wbuf.size() - conn->wpos);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      return true;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    conn->wpos += (size_t)rv;
+  }
+  conn->wbuf.clear();
+  conn->wpos = 0;
+  return true;
+}
+
+// Read what is available and call on_reply for every complete reply. false if
+// the connection is lost.
+template <class F> static bool connRead(BenchConn *conn, F on_reply) {
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    conn->rbuf.append(buf, (size_t)rv);
+    if ((size_t)rv < sizeof(buf)) {
+      break;
+    }
+  }
+  size_t pos = 0;
+  while (conn->rbuf.size() - pos >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[pos], 4);
+    if (len > k_max_msg) {
+      return false;
+    }
+    if (conn->rbuf.size() - pos < 4 + (size_t)len) {
+      break;
+    }
+    on_reply(len > 0 && conn->rbuf[pos + 4] == SER_ERR);
+    pos += 4 + len;
+  }
+  conn->rbuf.erase(0, pos);
+  return true;
+}
+
+// MODE_OPS: every connection keeps bench.pipeline requests in flight until
+// end_us, then the replies still expected are collected
+static void runOps(std::vector<BenchConn> &conns, uint64_t end_us) {
+  for (BenchConn &conn : conns) {
+    conn.fd = connectServer(false);
+    fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL, 0) | O_NONBLOCK);
+    conn.pending.resize(bench.pipeline);
+    for (uint32_t i = 0; i < bench.pipeline; i++) {
+      connQueueReq(&conn);
+    }
+  }
+  std::vector<struct pollfd> poll_args(conns.size());
+  size_t in_flight = conns.size();
+  while (in_flight > 0) {
+    for (size_t i = 0; i < conns.size(); i++) {
+      poll_args[i].fd = conns[i].fd;
+      poll_args[i].events = conns[i].wbuf.empty() ? POLLIN : POLLIN | POLLOUT;
+      poll_args[i].revents = 0;
+    }
+    if (poll(poll_args.data(), (nfds_t)poll_args.size(), 1000) < 0 &&
+        errno != EINTR) {
+      HelperLibrary::MsgHelpers::die("poll() failed!");
+    }
+    bool running = getMonotonicUsec() < end_us;
+    for (size_t i = 0; i < conns.size(); i++) {
+      BenchConn *conn = &conns[i];
+      if (!poll_args[i].revents || conn->fd < 0) {
+        continue;
+      }
+      bool ok = connRead(conn, [&](bool error) {
+        Pending &p = conn->pending[conn->pending_head];
+        conn->pending_head = (conn->pending_head + 1) % conn->pending.size();
+        conn->pending_count--;
+        HistRecord(&stats.hist[p.op], getMonotonicUsec() - p.sent_us);
+        stats.errors += error;
+        if (running) {
+          connQueueReq(conn);
+        }
+      });
+      if (!ok || !connFlush(conn)) {
+        HelperLibrary::MsgHelpers::die("The server closed a connection!");
+      }
+      if (conn->pending_count == 0) {
+        // Done, every reply is in
+        close(conn->fd);
+        conn->fd = -1;
+        poll_args[i].fd = -1;
+        in_flight--;
+      }
+    }
+  }
+}
+
+// MODE_CONNECT: each connection measures the time from connect() to the reply
+// of its first request, which includes the server accepting it
+static void connStart(BenchConn *conn) {
+  conn->fd = connectServer(true);
+  conn->connecting = true;
+  conn->connect_us = getMonotonicUsec();
+  conn->wbuf.clear();
+  conn->wpos = 0;
+  conn->rbuf.clear();
+  char key[32];
+  std::string_view args[] = {"get",
+                             keyName(key, sizeof(key),
+                                     stats.rng() % bench.keys)};
+  appendReq(conn->wbuf, args, 2);
+}
+
+// Reset instead of the usual close, so the client does not run out of ports
+// with connections in TIME_WAIT
+static void connAbort(BenchConn *conn) {
+  struct linger lin = {1, 0};
+  setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+  close(conn->fd);
+  conn->fd = -1;
+}
+
+static void runConnect(std::vector<BenchConn> &conns, uint64_t end_us) {
+  for (BenchConn &conn : conns) {
+    connStart(&conn);
+  }
+  std::vector<struct pollfd> poll_args(conns.size());
+  size_t active = conns.size();
+  while (active > 0) {
+    for (size_t i = 0; i < conns.size(); i++) {
+      poll_args[i].fd = conns[i].fd;
+      poll_args[i].events = conns[i].wbuf.empty() ? POLLIN : POLLOUT;
+      poll_args[i].revents = 0;
+    }
+    if (poll(poll_args.data(), (nfds_t)poll_args.size(), 1000) < 0 &&
+        errno != EINTR) {
+      HelperLibrary::MsgHelpers::die("poll() failed!");
+    }
+    bool running = getMonotonicUsec() < end_us;
+    for (size_t i = 0; i < conns.size(); i++) {
+      BenchConn *conn = &conns[i];
+      if (!poll_args[i].revents || conn->fd < 0) {
+        continue;
+      }
+      bool done = false;
+      bool ok = true;
+      if (conn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        ok = err == 0;
+        conn->connecting = false;
+      }
+      ok = ok && connFlush(conn) && connRead(conn, [&](bool error) {
+             HistRecord(&stats.connect_hist,
+                        getMonotonicUsec() - conn->connect_us);
+             stats.errors += error;
+             done = true;
+           });
+      if (!ok) {
+        stats.errors++;
+      }
+      if (!ok || done) {
+        connAbort(conn);
+        if (running) {
+          connStart(conn);
+        } else {
+          active--;
+        }
+      }
+    }
+  }
+}
+
+struct HistSummary {
+  const char *name;
+  const Histogram *hist;
+};
+
+static void report(double secs) {
+  Histogram all;
+  HistMerge(&all, &stats.hist[OP_GET]);
+  HistMerge(&all, &stats.hist[OP_SET]);
+  std::vector<HistSummary> rows;
+  const char *unit = "ops";
+  if (bench.mode == MODE_CONNECT) {
+    rows.push_back({"connect", &stats.connect_hist});
+    unit = "connects";
+  } else {
+    rows.push_back({"all", &all});
+    rows.push_back({"get", &stats.hist[OP_GET]});
+    rows.push_back({"set", &stats.hist[OP_SET]});
+  }
+  uint64_t total = rows[0].hist->total;
+  double rate = secs > 0 ? (double)total / secs : 0;
+
+  if (bench.json) {
+    printf("{\"mode\":\"%s\",\"clients\":%u,\"pipeline\":%u,\"keys\":%llu,"
+           "\"value_min\":%u,\"value_max\":%u,\"reads\":%u,\"writes\":%u,"
+           "\"seconds\":%.3f,\"%s\":%llu,\"%s_per_sec\":%.1f,\"errors\":%llu,"
+           "\"latency_us\":{",
+           bench.mode == MODE_CONNECT ? "connect" : "ops", bench.clients,
+           bench.pipeline, (unsigned long long)bench.keys, bench.value_min,
+           bench.value_max, bench.reads, bench.writes, secs, unit,
+           (unsigned long long)total, unit, rate,
+           (unsigned long long)stats.errors);
+    for (size_t i = 0; i < rows.size(); i++) {
+      const Histogram *h = rows[i].hist;
+      printf("%s\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,"
+             "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+             i ? "," : "", rows[i].name, (unsigned long long)h->total,
+             HistMean(h), (unsigned long long)HistPercentile(h, 0.5),
+             (unsigned long long)HistPercentile(h, 0.99),
+             (unsigned long long)HistPercentile(h, 0.999),
+             (unsigned long long)h->max);
+    }
+    printf("}}\n");
+    return;
+  }
+
+  printf("%u clients, pipeline %u, %llu keys, values %u-%u bytes, "
+         "GET:SET %u:%u\n",
+         bench.clients, bench.pipeline, (unsigned long long)bench.keys,
+         bench.value_min, bench.value_max, bench.reads, bench.writes);
+  printf("%llu %s in %.2f s: %.0f %s/s, %llu errors\n",
+         (unsigned long long)total, unit, secs, rate, unit,
+         (unsigned long long)stats.errors);
+  printf("%-12s %10s %10s %8s %8s %8s %8s\n", "latency(us)", "count", "mean",
+         "p50", "p99", "p99.9", "max");
+  for (const HistSummary &row : rows) {
+    const Histogram *h = row.hist;
+    printf("%-12s %10llu %10.1f %8llu %8llu %8llu %8llu\n", row.name,
+           (unsigned long long)h->total, HistMean(h),
+           (unsigned long long)HistPercentile(h, 0.5),
+           (unsigned long long)HistPercentile(h, 0.99),
+           (unsigned long long)HistPercentile(h, 0.999),
+           (unsigned long long)h->max);
+  }
+}
@@ -2,22 +2,23 @@
 #include <arpa/inet.h>
 #include <cassert>
 #include <iostream>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <vector>
 
 // global variables
-const size_t k_max_msg = 4096;
+const size_t k_max_msg = 32 << 20;
 
 enum {
   SER_NIL = 0,
   SER_ERR = 1,
   SER_STR = 2,
   SER_INT = 3,
-  SER_ARR = 4,
+  SER_DBL = 4,
+  SER_ARR = 5,
 };
 
-static int32_t query(int fd, const char *text);
 static int32_t sendReq(int client_fd, const std::vector<std::string> &cmd);
 static int32_t readRes(int client_fd);
 static uint32_t resHandler(const uint8_t *data, size_t size);
@@ -69,7 +70,7 @@ static int32_t sendReq(int client_fd, const std::vector<std::string> &cmd) {
     HelperLibrary::MsgHelpers::error("The query text length is too long!");
     return -1;
   }
-  char wbuf[4 + k_max_msg];
+  std::vector<char> wbuf(4 + textLen);
   memcpy(&wbuf[0], &textLen, 4);
   uint32_t n = cmd.size();
   memcpy(&wbuf[4], &n, 4);
@@ -83,7 +84,7 @@ static int32_t sendReq(int client_fd, const std::vector<std::string> &cmd) {
   }
 
   int32_t error =
-      HelperLibrary::IOHelpers::writeAll(client_fd, wbuf, 4 + textLen);
+      HelperLibrary::IOHelpers::writeAll(client_fd, wbuf.data(), 4 + textLen);
   if (error) {
     HelperLibrary::MsgHelpers::error(
         "Something wrong happens in the function writeAll().");
@@ -94,9 +95,10 @@ static int32_t sendReq(int client_fd, const std::vector<std::string> &cmd) {
 
 static int32_t readRes(int client_fd) {
   // 4 bytes header
-  char rbuf[4 + k_max_msg + 1];
+  std::vector<char> rbuf(4);
   errno = 0;
-  int32_t error = HelperLibrary::IOHelpers::readAll(client_fd, rbuf, 4);
+  int32_t error =
+      HelperLibrary::IOHelpers::readAll(client_fd, rbuf.data(), 4);
   if (error) {
     if (errno == 0) {
       HelperLibrary::MsgHelpers::error("EOF in the function query()!");
@@ -108,13 +110,14 @@ static int32_t readRes(int client_fd) {
   }
 
   uint32_t text_len = 0;
-  memcpy(&text_len, rbuf, 4);
+  memcpy(&text_len, rbuf.data(), 4);
   if (text_len > k_max_msg) {
     HelperLibrary::MsgHelpers::error("The request length is too long!");
     return -1;
   }
 
   // reply body
+  rbuf.resize(4 + text_len);
   error = HelperLibrary::IOHelpers::readAll(client_fd, &rbuf[4], text_len);
   if (error) {
     HelperLibrary::MsgHelpers::error(
@@ -157,9 +160,20 @@ static uint32_t resHandler(const uint8_t *data, size_t size) {
       return -1;
     }
     {
-      uint64_t value = 0;
+      int64_t value = 0;
+      memcpy(&value, &data[1], 8);
+      printf("(int) %lld\n", (long long)value);
+      return 1 + 8;
+    }
+  case SER_DBL:
+    if (size < 1 + 8) {
+      HelperLibrary::MsgHelpers::error("Bad response!");
+      return -1;
+    }
+    {
+      double value = 0;
       memcpy(&value, &data[1], 8);
-      printf("(int) %llu\n", value);
+      printf("(dbl) %g\n", value);
       return 1 + 8;
     }
   case SER_ARR:
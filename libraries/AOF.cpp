@@ -0,0 +1,120 @@
+#include "AOF.h"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static void appendU32(std::string &buf, uint32_t val) {
+  buf.append((const char *)&val, 4); // little-endian host, like the protocol
+}
+
+// One request: | u32 total | u32 n | u32 len | arg | u32 len | arg | ...
+void AOFEncode(std::string &buf, const std::string_view *args, size_t n) {
+  size_t total = 4;
+  for (size_t i = 0; i < n; i++) {
+    total += 4 + args[i].size();
+  }
+  buf.reserve(buf.size() + 4 + total);
+  appendU32(buf, (uint32_t)total);
+  appendU32(buf, (uint32_t)n);
+  for (size_t i = 0; i < n; i++) {
+    appendU32(buf, (uint32_t)args[i].size());
+    buf.append(args[i].data(), args[i].size());
+  }
+}
+
+// Group commit for everysec: the event loop only write()s, and this thread
+// issues at most one fdatasync() per second for everything written since the
+// last one. The fd is duplicated so a slow fsync does not hold fd_mu.
+static void fsyncMain(AOF *aof) {
+  std::unique_lock<std::mutex> lock(aof->fd_mu);
+  while (!aof->fsync_stop) {
+    aof->fsync_cv.wait_for(lock, std::chrono::seconds(1));
+    if (!aof->dirty.exchange(false, std::memory_order_acq_rel)) {
+      continue;
+    }
+    int fd = dup(aof->fd);
+    lock.unlock();
+    if (fd >= 0) {
+      (void)fdatasync(fd);
+      close(fd);
+    }
+    lock.lock();
+  }
+}
+
+bool AOFOpen(AOF *aof, const char *path, uint32_t fsync_policy) {
+  aof->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (aof->fd < 0) {
+    return false;
+  }
+  aof->fsync_policy = fsync_policy;
+  if (fsync_policy == AOF_FSYNC_EVERYSEC) {
+    aof->fsync_stop = false;
+    aof->fsync_thread = std::thread(fsyncMain, aof);
+  }
+  return true;
+}
+
+// Write the pending records, and fsync them with the always policy. On a
+// failed write() the unwritten part stays in buf for the next call.
+bool AOFFlush(AOF *aof) {
+  if (aof->buf.empty()) {
+    return true;
+  }
+  size_t off = 0;
+  while (off < aof->buf.size()) {
+    ssize_t rv = write(aof->fd, aof->buf.data() + off, aof->buf.size() - off);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      break;
+    }
+    off += (size_t)rv;
+  }
+  if (aof->rewriting) {
+    aof->rewrite_buf.append(aof->buf, 0, off);
+  }
+  aof->buf.erase(0, off);
+  if (!aof->buf.empty()) {
+    aof->write_error = true;
+    return false;
+  }
+  aof->write_error = false;
+  if (aof->fsync_policy == AOF_FSYNC_ALWAYS) {
+    return fdatasync(aof->fd) == 0;
+  }
+  if (aof->fsync_policy == AOF_FSYNC_EVERYSEC) {
+    aof->dirty.store(true, std::memory_order_release);
+  }
+  return true;
+}
+
+// Continue appending to another file (a rewritten log opened for appending)
+void AOFSwitch(AOF *aof, int fd) {
+  int old_fd = -1;
+  {
+    std::lock_guard<std::mutex> lock(aof->fd_mu);
+    old_fd = aof->fd;
+    aof->fd = fd;
+  }
+  close(old_fd);
+}
+
+void AOFClose(AOF *aof) {
+  if (aof->fsync_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(aof->fd_mu);
+      aof->fsync_stop = true;
+    }
+    aof->fsync_cv.notify_one();
+    aof->fsync_thread.join();
+  }
+  if (aof->fd >= 0) {
+    (void)fdatasync(aof->fd);
+    close(aof->fd);
+    aof->fd = -1;
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Append-only file: every write command is logged in the request format of
+// the wire protocol (u32 length, u32 argument count, then u32 length + bytes
+// per argument), so replaying the file is parsing requests.
+
+// When the appended data is forced to disk
+enum {
+  AOF_FSYNC_NO = 0,       // never, the kernel flushes it eventually
+  AOF_FSYNC_EVERYSEC = 1, // once per second, by a background thread
+  AOF_FSYNC_ALWAYS = 2,   // before the replies of the logged commands are sent
+};
+
+struct AOF {
+  int fd = -1;
+  uint32_t fsync_policy = AOF_FSYNC_EVERYSEC;
+  // Records not written yet, written by AOFFlush() once per event loop
+  // iteration
+  std::string buf;
+  // While a rewrite child runs, everything written is also kept here and
+  // appended to the rewritten file when the child is done
+  bool rewriting = false;
+  std::string rewrite_buf;
+  // Set on a failed write() so the error is only reported once
+  bool write_error = false;
+  // The everysec thread. fd_mu guards fd against the switch to a rewritten
+  // file, dirty is set by every write() and cleared by the next fsync.
+  std::thread fsync_thread;
+  std::mutex fd_mu;
+  std::condition_variable fsync_cv;
+  bool fsync_stop = false;
+  std::atomic<bool> dirty{false};
+};
+
+void AOFEncode(std::string &buf, const std::string_view *args, size_t n);
+bool AOFOpen(AOF *aof, const char *path, uint32_t fsync_policy);
+bool AOFFlush(AOF *aof);
+void AOFSwitch(AOF *aof, int fd);
+void AOFClose(AOF *aof);
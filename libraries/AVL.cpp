@@ -87,7 +87,7 @@ static AVLNode *AVLFixLeft(AVLNode *root) {
 // Bottom up.
 static void AVLNodeUpdate(AVLNode *node);
 static uint32_t AVLDepth(AVLNode *node);
-static AVLNode *AVLFix(AVLNode *node) {
+AVLNode *AVLFix(AVLNode *node) {
   while (true) {
     AVLNodeUpdate(node);
     uint32_t left_depth = AVLDepth(node->left);
@@ -116,7 +116,7 @@ static AVLNode *AVLFix(AVLNode *node) {
   }
 }
 
-static AVLNode *AVLDelete(AVLNode *node) {
+AVLNode *AVLDelete(AVLNode *node) {
   if (node->right == NULL) {
     // no right subtree, replaced with left subtree
     AVLNode *parent = node->parent;
@@ -157,3 +157,49 @@ static AVLNode *AVLDelete(AVLNode *node) {
     }
   }
 }
+
+// Jump to the node that is `offset` positions after (or before, if negative)
+// the given node in sorted order. Uses the subtree sizes, so it is O(log n)
+// instead of walking `offset` successors. Returns NULL if out of range.
+static uint32_t AVLSize(AVLNode *node);
+AVLNode *AVLOffset(AVLNode *node, int64_t offset) {
+  int64_t pos = 0; // the rank of node relative to the starting node
+  while (offset != pos) {
+    if (pos < offset && pos + AVLSize(node->right) >= offset) {
+      // The target is inside the right subtree
+      node = node->right;
+      pos += AVLSize(node->left) + 1;
+    } else if (pos > offset && pos - AVLSize(node->left) <= offset) {
+      // The target is inside the left subtree
+      node = node->left;
+      pos -= AVLSize(node->right) + 1;
+    } else {
+      // Go to the parent
+      AVLNode *parent = node->parent;
+      if (!parent) {
+        return NULL;
+      }
+      if (parent->right == node) {
+        pos -= AVLSize(node->left) + 1;
+      } else {
+        pos += AVLSize(node->right) + 1;
+      }
+      node = parent;
+    }
+  }
+  return node;
+}
+
+// The 0-based position of the node in sorted order, from the node to the
+// root, O(log n)
+static uint32_t AVLSize(AVLNode *node);
+int64_t AVLRank(AVLNode *node) {
+  int64_t rank = AVLSize(node->left);
+  for (; node->parent; node = node->parent) {
+    if (node->parent->right == node) {
+      // Everything in the parent's left subtree, plus the parent itself
+      rank += AVLSize(node->parent->left) + 1;
+    }
+  }
+  return rank;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 struct AVLNode {
   uint32_t st_depth = 0; // subtree depth
@@ -7,13 +9,15 @@ struct AVLNode {
   AVLNode *parent = nullptr;
 };
 
-static void AVLNodeInit(AVLNode *node) {
+inline void AVLNodeInit(AVLNode *node) {
   node->st_depth = 1;
   node->st_size = 1;
   node->left = nullptr;
   node->right = nullptr;
   node->parent = nullptr;
-};
+}
 
-static AVLNode *AVLFix(AVLNode *node);
-static AVLNode *AVLDelete(AVLNode *node);
+AVLNode *AVLFix(AVLNode *node);
+AVLNode *AVLDelete(AVLNode *node);
+AVLNode *AVLOffset(AVLNode *node, int64_t offset);
+int64_t AVLRank(AVLNode *node);
@@ -154,6 +154,32 @@ static void testRemove(uint32_t size) {
   }
 }
 
+static void testOffset(uint32_t size) {
+  Container c;
+  for (uint32_t i = 0; i < size; i++) {
+    add(c, i);
+  }
+
+  // Every (start, offset) pair must land on the right node
+  AVLNode *min = c.root;
+  while (min && min->left) {
+    min = min->left;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    AVLNode *node = AVLOffset(min, (int64_t)i);
+    assert(container_of(node, Data, node)->val == i);
+    assert(AVLRank(node) == (int64_t)i);
+    for (uint32_t j = 0; j < size; j++) {
+      int64_t offset = (int64_t)j - (int64_t)i;
+      AVLNode *target = AVLOffset(node, offset);
+      assert(container_of(target, Data, node)->val == j);
+    }
+    assert(!AVLOffset(node, -(int64_t)i - 1));
+    assert(!AVLOffset(node, (int64_t)(size - i)));
+  }
+  dispose(c);
+}
+
 int main() {
   Container c;
   // Simple test
@@ -199,6 +225,7 @@ int main() {
     testInsert(i);
     testInsertDuplicate(i);
     testRemove(i);
+    testOffset(i);
   }
   dispose(c);
   return 0;
@@ -0,0 +1,569 @@
+// Microbenchmarks for the keyspace data structures, not part of the server.
+//
+//   g++ -std=c++17 -O2 -o Bench libraries/Bench.cpp libraries/HashTable.cpp
+//     libraries/SwissTable.cpp libraries/Entry.cpp libraries/Slab.cpp
+//     libraries/AVL.cpp libraries/Histogram.cpp
+//   ./Bench [nkeys]
+//   ./Bench access [nkeys] [key length] [uniform|zipf[:theta]] [nops]
+//   ./Bench resize [nkeys]
+//   ./Bench avl [nnodes]
+//   ./Bench mem [nkeys] [value size]
+//
+// Cache misses are counted with perf_event_open() where the kernel allows it
+// (perf_event_paranoid <= 2, only user space is counted) and left out
+// otherwise.
+#include "AVL.h"
+#include "Common.h"
+#include "Entry.h"
+#include "HashTable.h"
+#include "Histogram.h"
+#include "SwissTable.h"
+#include <algorithm>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENT 1
+#endif
+
+struct Item {
+  hashTableNode HTNode;
+  std::string key;
+};
+
+static bool itemEQ(hashTableNode *node, hashTableNode *key) {
+  return container_of(node, Item, HTNode)->key ==
+         container_of(key, Item, HTNode)->key;
+}
+
+static uint64_t getMonotonicNsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// Keys are the prefix and the index, zero-padded to key_len bytes if given
+static std::vector<Item> makeItems(size_t n, const char *prefix,
+                                   size_t key_len = 0) {
+  std::vector<Item> items(n);
+  for (size_t i = 0; i < n; i++) {
+    std::string num = std::to_string(i);
+    size_t len = strlen(prefix) + num.size();
+    items[i].key = prefix;
+    if (key_len > len) {
+      items[i].key.append(key_len - len, '0');
+    }
+    items[i].key += num;
+    items[i].HTNode.hash_value =
+        strHash((uint8_t *)items[i].key.data(), items[i].key.size());
+  }
+  return items;
+}
+
+// Hardware events counted around each measured loop
+enum {
+  PERF_LLC_MISSES = 0, // last level cache, i.e. memory accesses
+  PERF_L1D_MISSES = 1, // L1 data cache read misses
+  k_perf_events = 2,
+};
+
+static int perf_fds[k_perf_events] = {-1, -1};
+
+#if HAVE_PERF_EVENT
+static int perfOpen(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Returns false if the counters are not available, e.g. in most VMs
+static bool perfInit() {
+#if HAVE_PERF_EVENT
+  perf_fds[PERF_LLC_MISSES] =
+      perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  perf_fds[PERF_L1D_MISSES] =
+      perfOpen(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+  return perf_fds[PERF_LLC_MISSES] >= 0;
+}
+
+// The clock and the counters at one point
+struct Sample {
+  uint64_t ns = 0;
+  uint64_t events[k_perf_events] = {};
+};
+
+static Sample sampleNow() {
+  Sample s;
+  for (int i = 0; i < k_perf_events; i++) {
+    if (perf_fds[i] < 0 ||
+        read(perf_fds[i], &s.events[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+      s.events[i] = 0;
+    }
+  }
+  s.ns = getMonotonicNsec();
+  return s;
+}
+
+static void report(const char *engine, const char *op, size_t n,
+                   const Sample &start) {
+  Sample end = sampleNow();
+  double ns = (double)(end.ns - start.ns) / (double)n;
+  printf("%-6s %-10s %8.1f ns/op", engine, op, ns);
+  if (perf_fds[PERF_LLC_MISSES] >= 0) {
+    printf(" %6.2f llc-miss/op", (double)(end.events[PERF_LLC_MISSES] -
+                                          start.events[PERF_LLC_MISSES]) /
+                                     (double)n);
+  }
+  if (perf_fds[PERF_L1D_MISSES] >= 0) {
+    printf(" %6.2f l1d-miss/op", (double)(end.events[PERF_L1D_MISSES] -
+                                          start.events[PERF_L1D_MISSES]) /
+                                     (double)n);
+  }
+  printf("\n");
+}
+
+// Distribution of single operation latencies, in ns
+static void reportHist(const char *engine, const char *op,
+                       const Histogram *hist) {
+  printf("%-6s %-10s %8.1f ns/op  p50 %6llu  p99 %6llu  p99.9 %7llu  "
+         "max %9llu ns\n",
+         engine, op, HistMean(hist),
+         (unsigned long long)HistPercentile(hist, 0.5),
+         (unsigned long long)HistPercentile(hist, 0.99),
+         (unsigned long long)HistPercentile(hist, 0.999),
+         (unsigned long long)hist->max);
+}
+
+// The same SET / GET / GET-miss / DEL sequence against one engine. Only the
+// hash table operations are timed, the items are created beforehand.
+template <typename Map>
+static void benchEngine(const char *engine, size_t n,
+                        void (*insert)(Map *, hashTableNode *),
+                        hashTableNode *(*lookup)(Map *, hashTableNode *,
+                                                 bool (*)(hashTableNode *,
+                                                          hashTableNode *)),
+                        hashTableNode *(*pop)(Map *, hashTableNode *,
+                                              bool (*)(hashTableNode *,
+                                                       hashTableNode *)),
+                        void (*destroy)(Map *)) {
+  std::vector<Item> items = makeItems(n, "key:");
+  std::vector<Item> misses = makeItems(n, "miss:");
+  Map map;
+
+  Sample start = sampleNow();
+  for (Item &item : items) {
+    insert(&map, &item.HTNode);
+  }
+  report(engine, "set", n, start);
+
+  start = sampleNow();
+  size_t found = 0;
+  for (Item &item : items) {
+    found += lookup(&map, &item.HTNode, &itemEQ) != NULL;
+  }
+  report(engine, "get", n, start);
+
+  start = sampleNow();
+  for (Item &item : misses) {
+    found += lookup(&map, &item.HTNode, &itemEQ) != NULL;
+  }
+  report(engine, "get-miss", n, start);
+
+  start = sampleNow();
+  for (Item &item : items) {
+    found += pop(&map, &item.HTNode, &itemEQ) != NULL;
+  }
+  report(engine, "del", n, start);
+
+  if (found != 2 * n) {
+    fprintf(stderr, "%s: lost keys (%zu of %zu)\n", engine, found, 2 * n);
+    exit(1);
+  }
+  destroy(&map);
+}
+
+// Zipfian ranks in [0, n) with parameter theta (0 < theta < 1), as in YCSB
+// (Gray et al., "Quickly Generating Billion-Record Synthetic Databases"):
+// rank 0 is the most popular, with theta = 0.99 about 20% of the accesses go
+// to 0.1% of 1M keys.
+struct Zipf {
+  uint64_t n = 0;
+  double theta = 0;
+  double alpha = 0;
+  double zetan = 0;
+  double eta = 0;
+};
+
+static double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= n; i++) {
+    sum += 1 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+static void ZipfInit(Zipf *z, uint64_t n, double theta) {
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1 / (1 - theta);
+  z->zetan = zeta(n, theta);
+  z->eta = (1 - pow(2.0 / (double)n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+}
+
+static uint64_t ZipfNext(const Zipf *z, double u) {
+  double uz = u * z->zetan;
+  if (uz < 1) {
+    return 0;
+  }
+  if (uz < 1 + pow(0.5, z->theta)) {
+    return 1;
+  }
+  uint64_t rank =
+      (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return rank < z->n ? rank : z->n - 1;
+}
+
+// Lookups over a map of n keys, in the order of idx. The ranks of a Zipfian
+// distribution are shuffled over the keys first, otherwise the hot keys would
+// be the first ones created and sit next to each other in memory.
+template <typename Map>
+static void benchAccess(const char *engine, const char *dist,
+                        std::vector<Item> &items,
+                        const std::vector<uint32_t> &idx,
+                        void (*insert)(Map *, hashTableNode *),
+                        hashTableNode *(*lookup)(Map *, hashTableNode *,
+                                                 bool (*)(hashTableNode *,
+                                                          hashTableNode *)),
+                        void (*destroy)(Map *)) {
+  Map map;
+  for (Item &item : items) {
+    insert(&map, &item.HTNode);
+  }
+  size_t found = 0;
+  Sample start = sampleNow();
+  for (uint32_t i : idx) {
+    found += lookup(&map, &items[i].HTNode, &itemEQ) != NULL;
+  }
+  report(engine, dist, idx.size(), start);
+  if (found != idx.size()) {
+    fprintf(stderr, "%s: lost keys\n", engine);
+    exit(1);
+  }
+  destroy(&map);
+}
+
+static void benchAccessAll(size_t n, size_t key_len, const char *dist,
+                           size_t nops) {
+  std::vector<Item> items = makeItems(n, "key:", key_len);
+  std::mt19937_64 rng(1);
+  std::vector<uint32_t> idx(nops);
+  if (strncmp(dist, "zipf", 4) == 0) {
+    double theta = dist[4] == ':' ? atof(dist + 5) : 0.99;
+    if (!(theta > 0 && theta < 1)) {
+      fprintf(stderr, "zipf theta must be in (0, 1)\n");
+      exit(1);
+    }
+    std::vector<uint32_t> perm(n);
+    for (size_t i = 0; i < n; i++) {
+      perm[i] = (uint32_t)i;
+    }
+    std::shuffle(perm.begin(), perm.end(), rng);
+    Zipf z;
+    ZipfInit(&z, n, theta);
+    std::uniform_real_distribution<double> u(0, 1);
+    for (uint32_t &i : idx) {
+      i = perm[ZipfNext(&z, u(rng))];
+    }
+  } else {
+    for (uint32_t &i : idx) {
+      i = (uint32_t)(rng() % n);
+    }
+  }
+  printf("%zu keys of %zu bytes, %zu lookups\n", n, items[0].key.size(), nops);
+  benchAccess<hashMap>("chain", dist, items, idx, &HMInsert, &HMLookup,
+                       &HMDestroy);
+  benchAccess<swissMap>("swiss", dist, items, idx, &SMInsert, &SMLookup,
+                        &SMDestroy);
+}
+
+// The latency of every single insert while the map grows from empty to n
+// keys, then of every delete while it shrinks back. With progressive resizing
+// an operation moves at most k_resizing_work nodes. With stop_world every
+// resize is finished by the operation that started it, as a table without
+// progressive resizing would, for comparison.
+template <typename Map>
+static void benchResize(const char *engine, const char *mode, size_t n,
+                        bool stop_world, void (*insert)(Map *, hashTableNode *),
+                        hashTableNode *(*pop)(Map *, hashTableNode *,
+                                              bool (*)(hashTableNode *,
+                                                       hashTableNode *)),
+                        bool (*rehash)(Map *, size_t), void (*destroy)(Map *)) {
+  std::vector<Item> items = makeItems(n, "key:");
+  Map map;
+  Histogram hist;
+  for (Item &item : items) {
+    uint64_t start = getMonotonicNsec();
+    insert(&map, &item.HTNode);
+    while (stop_world && rehash(&map, n)) {
+    }
+    HistRecord(&hist, getMonotonicNsec() - start);
+  }
+  std::string op = std::string(mode) + "-set";
+  reportHist(engine, op.c_str(), &hist);
+
+  HistReset(&hist);
+  for (Item &item : items) {
+    uint64_t start = getMonotonicNsec();
+    pop(&map, &item.HTNode, &itemEQ);
+    while (stop_world && rehash(&map, n)) {
+    }
+    HistRecord(&hist, getMonotonicNsec() - start);
+  }
+  op = std::string(mode) + "-del";
+  reportHist(engine, op.c_str(), &hist);
+  destroy(&map);
+}
+
+static void benchResizeAll(size_t n) {
+  printf("%zu keys, latency of single operations\n", n);
+  benchResize<hashMap>("chain", "prog", n, false, &HMInsert, &HMPop,
+                       &HMRehash, &HMDestroy);
+  benchResize<hashMap>("chain", "stw", n, true, &HMInsert, &HMPop, &HMRehash,
+                       &HMDestroy);
+  benchResize<swissMap>("swiss", "prog", n, false, &SMInsert, &SMPop,
+                        &SMRehash, &SMDestroy);
+  benchResize<swissMap>("swiss", "stw", n, true, &SMInsert, &SMPop,
+                        &SMRehash, &SMDestroy);
+}
+
+// AVL tree of random values, the way a sorted set uses it: insertion is a
+// descent and AVLFix(), then rank queries with AVLOffset() from the first
+// node, then AVLDelete() of every node in random order
+struct AVLItem {
+  AVLNode node;
+  uint32_t val = 0;
+};
+
+static void benchAVL(size_t n) {
+  std::mt19937_64 rng(1);
+  std::vector<AVLItem> items(n);
+  for (AVLItem &item : items) {
+    AVLNodeInit(&item.node);
+    item.val = (uint32_t)rng();
+  }
+  printf("%zu nodes\n", n);
+  AVLNode *root = NULL;
+  Sample start = sampleNow();
+  for (AVLItem &item : items) {
+    AVLNode *cur = NULL;
+    AVLNode **from = &root;
+    while (*from) {
+      cur = *from;
+      from = item.val < container_of(cur, AVLItem, node)->val ? &cur->left
+                                                              : &cur->right;
+    }
+    *from = &item.node;
+    item.node.parent = cur;
+    root = AVLFix(&item.node);
+  }
+  report("avl", "insert", n, start);
+
+  AVLNode *first = root;
+  while (first->left) {
+    first = first->left;
+  }
+  std::vector<int64_t> offsets(n);
+  for (int64_t &off : offsets) {
+    off = (int64_t)(rng() % n);
+  }
+  uint64_t sum = 0;
+  start = sampleNow();
+  for (int64_t off : offsets) {
+    sum += container_of(AVLOffset(first, off), AVLItem, node)->val;
+  }
+  report("avl", "offset", n, start);
+
+  std::vector<AVLItem *> order(n);
+  for (size_t i = 0; i < n; i++) {
+    order[i] = &items[i];
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  start = sampleNow();
+  for (AVLItem *item : order) {
+    root = AVLDelete(&item->node);
+  }
+  report("avl", "delete", n, start);
+  if (root) {
+    fprintf(stderr, "avl: tree not empty\n");
+    exit(1);
+  }
+  printf("(%llx)\n", (unsigned long long)sum);
+}
+
+// The strHash used before the 64-bit seeded one, kept for comparison
+static uint64_t strHashLegacy(const uint8_t *data, size_t length) {
+  uint32_t h = 0x811C9DC5;
+  for (size_t i = 0; i < length; i++) {
+    h = (h + data[i]) * 0x01000193;
+  }
+  return h;
+}
+
+// Throughput of a hash function on keys of one size. The result feeds into
+// the next input, so the calls cannot overlap and the latency is measured as
+// well.
+static void benchHash(const char *name, uint64_t (*hash)(const uint8_t *,
+                                                          size_t),
+                      size_t len) {
+  std::vector<uint8_t> buf(len + 8, 'x');
+  size_t rounds = (64 << 20) / (len + 16);
+  uint64_t h = 0;
+  uint64_t start = getMonotonicNsec();
+#if HAVE_RDTSC
+  uint64_t start_tsc = __rdtsc();
+#endif
+  for (size_t i = 0; i < rounds; i++) {
+    buf[0] = (uint8_t)h;
+    h += hash(buf.data(), len);
+  }
+#if HAVE_RDTSC
+  double cycles = (double)(__rdtsc() - start_tsc);
+#endif
+  double ns = (double)(getMonotonicNsec() - start);
+  double bytes = (double)rounds * len;
+  printf("%-8s %5zu bytes %7.2f ns/hash %6.2f bytes/ns", name, len,
+         ns / rounds, bytes / ns);
+#if HAVE_RDTSC
+  printf(" %6.2f bytes/cycle", bytes / cycles);
+#endif
+  printf(" (%016llx)\n", (unsigned long long)h);
+}
+
+// The Entry used before the slab layout, kept for comparison: a new'd struct
+// with two std::string, each with its own allocation past 15 bytes
+struct LegacyEntry {
+  hashTableNode HTNode;
+  std::string key;
+  uint32_t type = T_STR;
+  std::string value;
+  ZSet *zset = NULL;
+  size_t heap_idx = -1;
+};
+
+// Resident memory of this process
+static size_t getRssBytes() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) {
+    return 0;
+  }
+  size_t pages = 0, rss = 0;
+  if (fscanf(fp, "%zu %zu", &pages, &rss) != 2) {
+    rss = 0;
+  }
+  fclose(fp);
+  return rss * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Fill a hashMap with n keys like the server does and report the memory per
+// key, entries and hash table included. Each layout runs in its own process so
+// memory freed by one is not reused by the other.
+static void benchMemory(const char *layout, size_t n, size_t vlen, bool slab) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+  std::string val(vlen, 'v');
+  char key[32];
+  hashMap map;
+  Slab entries;
+  size_t start = getRssBytes();
+  for (size_t i = 0; i < n; i++) {
+    size_t klen = (size_t)snprintf(key, sizeof(key), "key:%012zu", i);
+    hashTableNode *node = NULL;
+    if (slab) {
+      Entry *ent = EntryNew(&entries, std::string_view(key, klen), T_STR, val);
+      node = &ent->HTNode;
+    } else {
+      LegacyEntry *ent = new LegacyEntry();
+      ent->key.assign(key, klen);
+      ent->value = val;
+      node = &ent->HTNode;
+    }
+    node->hash_value = strHash((uint8_t *)key, klen);
+    HMInsert(&map, node);
+  }
+  double bytes = (double)(getRssBytes() - start) / (double)n;
+  printf("%-7s %zu keys, %zu byte values: %6.1f bytes/key\n", layout, n, vlen,
+         bytes);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "mem") == 0) {
+    size_t n = argc > 2 ? (size_t)atol(argv[2]) : 10000000;
+    size_t vlen = argc > 3 ? (size_t)atol(argv[3]) : 16;
+    benchMemory("legacy", n, vlen, false);
+    benchMemory("slab", n, vlen, true);
+    return 0;
+  }
+
+  strHashSeed(0x5eed);
+  if (!perfInit()) {
+    printf("hardware counters are not available, no cache misses\n");
+  }
+  if (argc > 1 && strcmp(argv[1], "access") == 0) {
+    size_t n = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    size_t key_len = argc > 3 ? (size_t)atol(argv[3]) : 0;
+    const char *dist = argc > 4 ? argv[4] : "uniform";
+    size_t nops = argc > 5 ? (size_t)atol(argv[5]) : 10000000;
+    benchAccessAll(n, key_len, dist, nops);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "resize") == 0) {
+    benchResizeAll(argc > 2 ? (size_t)atol(argv[2]) : 1000000);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "avl") == 0) {
+    benchAVL(argc > 2 ? (size_t)atol(argv[2]) : 1000000);
+    return 0;
+  }
+
+  size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+
+  const size_t key_sizes[] = {4, 8, 16, 32, 64, 256, 1024};
+  for (size_t len : key_sizes) {
+    benchHash("legacy", &strHashLegacy, len);
+    benchHash("strHash", &strHash, len);
+  }
+
+  printf("%zu keys\n", n);
+  benchEngine<hashMap>("chain", n, &HMInsert, &HMLookup, &HMPop,
+                       &HMDestroy);
+  benchEngine<swissMap>("swiss", n, &SMInsert, &SMLookup, &SMPop,
+                        &SMDestroy);
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include "Buffer.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Smallest allocation, so tiny appends don't realloc one byte at a time
+const size_t k_min_buf_cap = 64;
+
+void BufInit(Buffer *buf) { *buf = Buffer(); }
+
+size_t BufSize(const Buffer *buf) { return buf->tail - buf->head; }
+
+uint8_t *BufHead(Buffer *buf) { return buf->data + buf->head; }
+
+uint8_t *BufTail(Buffer *buf) { return buf->data + buf->tail; }
+
+// Make sure there are at least n free bytes after the tail.
+// The unconsumed data is moved to the front only when the free space at the
+// end is not enough, the buffer is grown (doubling) only when that is still
+// not enough.
+void BufReserve(Buffer *buf, size_t n) {
+  if (buf->cap - buf->tail >= n) {
+    return;
+  }
+  size_t size = BufSize(buf);
+  if (buf->head > 0 && buf->cap - size >= n) {
+    memmove(buf->data, buf->data + buf->head, size);
+    buf->head = 0;
+    buf->tail = size;
+    return;
+  }
+  size_t new_cap = buf->cap ? buf->cap : k_min_buf_cap;
+  while (new_cap - size < n) {
+    new_cap *= 2;
+  }
+  uint8_t *data = (uint8_t *)malloc(new_cap);
+  assert(data);
+  if (size) {
+    memcpy(data, buf->data + buf->head, size);
+  }
+  free(buf->data);
+  buf->data = data;
+  buf->head = 0;
+  buf->tail = size;
+  buf->cap = new_cap;
+}
+
+void BufAppend(Buffer *buf, const void *data, size_t n) {
+  BufReserve(buf, n);
+  memcpy(buf->data + buf->tail, data, n);
+  buf->tail += n;
+}
+
+// Mark n bytes written directly at BufTail() (e.g. by read()) as data
+void BufCommit(Buffer *buf, size_t n) {
+  assert(buf->tail + n <= buf->cap);
+  buf->tail += n;
+}
+
+// Drop n bytes from the front by moving the head cursor, nothing is copied
+void BufConsume(Buffer *buf, size_t n) {
+  assert(n <= BufSize(buf));
+  buf->head += n;
+  if (buf->head == buf->tail) {
+    // Empty, rewind for free
+    buf->head = buf->tail = 0;
+  }
+}
+
+// Release the memory of an empty buffer that has grown past max_idle_cap
+void BufShrink(Buffer *buf, size_t max_idle_cap) {
+  if (BufSize(buf) == 0 && buf->cap > max_idle_cap) {
+    BufFree(buf);
+  }
+}
+
+void BufFree(Buffer *buf) {
+  free(buf->data);
+  *buf = Buffer();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Growable byte buffer with head/tail cursors
+/**
+  data:
+  +------------+---------------------+----------------+
+  |  consumed  |   unconsumed data   |   free space   |
+  +------------+---------------------+----------------+
+  0           head                  tail             cap
+**/
+struct Buffer {
+  uint8_t *data = NULL;
+  size_t head = 0;
+  size_t tail = 0;
+  size_t cap = 0;
+};
+
+void BufInit(Buffer *buf);
+size_t BufSize(const Buffer *buf);
+uint8_t *BufHead(Buffer *buf);
+uint8_t *BufTail(Buffer *buf);
+void BufReserve(Buffer *buf, size_t n);
+void BufAppend(Buffer *buf, const void *data, size_t n);
+void BufCommit(Buffer *buf, size_t n);
+void BufConsume(Buffer *buf, size_t n);
+void BufShrink(Buffer *buf, size_t max_idle_cap);
+void BufFree(Buffer *buf);
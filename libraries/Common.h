@@ -1,6 +1,7 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #define container_of(ptr, type, member)                                        \
   reinterpret_cast<type *>(reinterpret_cast<char *>(ptr) -                     \
@@ -15,11 +16,112 @@ enum {
   SER_ARR = 5, // Array
 };
 
-// FNV-1a Algorithm
-static uint64_t strHash(const uint8_t *data, size_t length) {
-  uint32_t h = 0x811C9DC5;
-  for (size_t i = 0; i < length; i++) {
-    h = (h + data[i]) * 0x01000193;
+// Reverse the bits of v, used by the scan cursors
+static inline uint64_t reverseBits(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+  v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+  v = ((v >> 8) & 0x00FF00FF00FF00FFull) | ((v & 0x00FF00FF00FF00FFull) << 8);
+  v = ((v >> 16) & 0x0000FFFF0000FFFFull) | ((v & 0x0000FFFF0000FFFFull) << 16);
+  return (v >> 32) | (v << 32);
+}
+
+// Next scan cursor for a table of mask + 1 slots. The cursor is incremented
+// from its highest slot bit down (reverse binary), so the slots visited so
+// far are still covered by the visited cursors after the table doubles or
+// halves.
+static inline uint64_t scanCursorNext(uint64_t cursor, uint64_t mask) {
+  cursor |= ~mask;
+  cursor = reverseBits(cursor);
+  cursor++;
+  return reverseBits(cursor);
+}
+
+// Seed of strHash, set once by strHashSeed() before any key is hashed. A
+// random seed per process means nobody can prepare a set of keys that collide
+// in our hash tables.
+inline uint64_t hash_seed = 0;
+
+// Constants of wyhash
+const uint64_t k_wyp[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+                           0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// Unaligned little-endian loads
+static inline uint64_t wyRead8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wyRead4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 1 to 3 bytes
+static inline uint64_t wyRead3(const uint8_t *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+// wyrand: a fast generator for sampling, the state can start from any seed
+static inline uint64_t wyRand(uint64_t *state) {
+  *state += k_wyp[0];
+  return wyMix(*state, *state ^ k_wyp[1]);
+}
+
+static inline void strHashSeed(uint64_t seed) {
+  hash_seed = seed ^ wyMix(seed ^ k_wyp[0], k_wyp[1]);
+}
+
+// wyhash: 16 bytes per step, keys longer than 48 bytes are consumed in three
+// independent lanes of 16 bytes so the multiplies can overlap
+static inline uint64_t strHash(const uint8_t *data, size_t length) {
+  const uint8_t *p = data;
+  uint64_t seed = hash_seed;
+  uint64_t a, b;
+  if (length <= 16) {
+    if (length >= 4) {
+      // Two overlapping 4 byte reads from each end cover 4 to 16 bytes
+      size_t mid = (length >> 3) << 2;
+      a = (wyRead4(p) << 32) | wyRead4(p + mid);
+      b = (wyRead4(p + length - 4) << 32) | wyRead4(p + length - 4 - mid);
+    } else if (length > 0) {
+      a = wyRead3(p, length);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = length;
+    if (i > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = wyMix(wyRead8(p) ^ k_wyp[1], wyRead8(p + 8) ^ seed);
+        seed1 = wyMix(wyRead8(p + 16) ^ k_wyp[2], wyRead8(p + 24) ^ seed1);
+        seed2 = wyMix(wyRead8(p + 32) ^ k_wyp[3], wyRead8(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = wyMix(wyRead8(p) ^ k_wyp[1], wyRead8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    // The last 16 bytes, overlapping the previous step
+    a = wyRead8(p + i - 16);
+    b = wyRead8(p + i - 8);
   }
-  return h;
+  __uint128_t r = (__uint128_t)(a ^ k_wyp[1]) * (b ^ seed);
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+  return wyMix(a ^ k_wyp[0] ^ length, b ^ k_wyp[1]);
 }
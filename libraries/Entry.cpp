@@ -0,0 +1,123 @@
+#include "Entry.h"
+#include <assert.h>
+#include <charconv>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+// Values that would make the block larger than this are not stored inline
+const size_t k_entry_inline_max = 512;
+
+// The integer val is the formatted form of. Anything else (leading zeros, a
+// '+' sign, "-0", ...) stays a string, so GET returns the same bytes as SET.
+bool EntryStrInt(std::string_view val, int64_t *out) {
+  if (val.empty() || val.size() > k_entry_int_len) {
+    return false;
+  }
+  int64_t n = 0;
+  const char *end = val.data() + val.size();
+  std::from_chars_result res = std::from_chars(val.data(), end, n);
+  if (res.ec != std::errc() || res.ptr != end) {
+    return false;
+  }
+  char buf[k_entry_int_len];
+  std::to_chars_result fmt = std::to_chars(buf, buf + sizeof(buf), n);
+  if ((size_t)(fmt.ptr - buf) != val.size() ||
+      memcmp(buf, val.data(), val.size()) != 0) {
+    return false;
+  }
+  *out = n;
+  return true;
+}
+
+Entry *EntryNew(Slab *slab, std::string_view key, uint8_t type,
+                std::string_view val) {
+  size_t size = sizeof(Entry) + key.size();
+  int64_t n = 0;
+  // An integer needs no room after the key
+  bool inline_val = size + val.size() <= k_entry_inline_max &&
+                    !(type == T_STR && EntryStrInt(val, &n));
+  if (inline_val) {
+    size += val.size();
+  }
+  uint8_t cls = SlabClass(size);
+  size_t bsize = SlabClassSize(cls, size);
+  Entry *ent = new (SlabAlloc(slab, cls, bsize)) Entry();
+  ent->type = type;
+  ent->slab_class = cls;
+  ent->klen = (uint32_t)key.size();
+  // The rounding slack of the size class is free room for the value
+  assert(bsize - sizeof(Entry) - key.size() <= UINT16_MAX);
+  ent->vcap = (uint16_t)(bsize - sizeof(Entry) - key.size());
+  memcpy(ent->data, key.data(), key.size());
+  EntrySetValue(ent, val);
+  return ent;
+}
+
+// The zset (if any) must be disposed of by the caller
+void EntryFree(Slab *slab, Entry *ent) {
+  if (ent->type == T_STR && ent->encoding == ENC_RAW) {
+    free(ent->ext);
+  }
+  SlabFree(slab, ent, ent->slab_class, sizeof(Entry) + ent->klen + ent->vcap);
+}
+
+std::string_view EntryKey(const Entry *ent) {
+  return std::string_view(ent->data, ent->klen);
+}
+
+std::string_view EntryValue(const Entry *ent, char *buf) {
+  if (ent->encoding == ENC_INT) {
+    std::to_chars_result res =
+        std::to_chars(buf, buf + k_entry_int_len, ent->ival);
+    return std::string_view(buf, (size_t)(res.ptr - buf));
+  }
+  const char *val = ent->ext ? ent->ext : ent->data + ent->klen;
+  return std::string_view(val, ent->vlen);
+}
+
+// Only for T_STR
+void EntrySetValue(Entry *ent, std::string_view val) {
+  int64_t n = 0;
+  if (EntryStrInt(val, &n)) {
+    return EntrySetInt(ent, n);
+  }
+  if (ent->encoding == ENC_INT) {
+    ent->encoding = ENC_RAW;
+    ent->ext = NULL;
+  }
+  if (val.size() <= ent->vcap) {
+    free(ent->ext);
+    ent->ext = NULL;
+    memcpy(ent->data + ent->klen, val.data(), val.size());
+  } else {
+    ent->ext = (char *)realloc(ent->ext, val.size());
+    assert(ent->ext);
+    memcpy(ent->ext, val.data(), val.size());
+  }
+  ent->vlen = (uint32_t)val.size();
+}
+
+// In place: the heap buffer of a long string is released, nothing is
+// allocated
+void EntrySetInt(Entry *ent, int64_t val) {
+  if (ent->encoding == ENC_RAW) {
+    free(ent->ext);
+  }
+  ent->encoding = ENC_INT;
+  ent->ival = val;
+  ent->vlen = 0;
+}
+
+// The slab block, plus the heap buffer of a long value (allocated to its exact
+// size) or the sorted set
+size_t EntryMemory(const Entry *ent) {
+  size_t size =
+      SlabClassSize(ent->slab_class, sizeof(Entry) + ent->klen + ent->vcap);
+  if (ent->type == T_STR && ent->encoding == ENC_RAW && ent->ext) {
+    size += ent->vlen;
+  } else if (ent->type == T_ZSET && ent->zset) {
+    size += ZSetMemory(ent->zset);
+  }
+  return size;
+}
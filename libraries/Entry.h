@@ -0,0 +1,72 @@
+#pragma once
+
+#include "HashTable.h"
+#include "Slab.h"
+#include "ZSet.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+// Value types
+enum {
+  T_STR = 0,
+  T_ZSET = 1,
+};
+
+// Encodings of a T_STR value
+enum {
+  ENC_RAW = 0, // the bytes, inline or in ext
+  ENC_INT = 1, // an int64_t in ival, formatted only when it is read
+};
+
+// Room for a formatted int64_t, e.g. "-9223372036854775808"
+const size_t k_entry_int_len = 20;
+
+// A key of the keyspace. The key and a short string value are stored right
+// after the header, in the same slab block:
+/**
+  +--------------+-----------+--------------------------+
+  | Entry header | key bytes | value bytes (up to vcap) |
+  +--------------+-----------+--------------------------+
+**/
+// A value longer than vcap is kept in its own heap buffer (ext). A value that
+// is an integer takes no room at all, it is kept in ival.
+struct Entry {
+  struct hashTableNode HTNode;
+  // position in the TTL heap, -1 if the key does not expire
+  size_t heap_idx = -1;
+  // Zeroed by EntryNew(): T_STR and ENC_RAW
+  uint8_t type : 4;
+  uint8_t encoding : 4;
+  uint8_t slab_class = 0;
+  // Bytes available for an inline value, at most the largest slab class
+  uint16_t vcap = 0;
+  uint32_t klen = 0;
+  uint32_t vlen = 0;
+  // Access metadata for eviction, packed into the padding of the header like
+  // Redis does: the LRU clock (s) of the last access, and a logarithmic
+  // access counter for LFU that decays with the time since that access
+  uint32_t lru : 24;
+  uint32_t lfu : 8;
+  union {
+    char *ext = NULL; // T_STR: the value if it does not fit inline
+    int64_t ival;     // T_STR with ENC_INT
+    ZSet *zset;       // T_ZSET
+  };
+  char data[0];
+};
+
+Entry *EntryNew(Slab *slab, std::string_view key, uint8_t type,
+                std::string_view val);
+void EntryFree(Slab *slab, Entry *ent);
+std::string_view EntryKey(const Entry *ent);
+// buf must have room for k_entry_int_len bytes, an ENC_INT value is formatted
+// into it
+std::string_view EntryValue(const Entry *ent, char *buf);
+// Whether val is exactly how an int64_t is formatted, such a string is
+// stored as ENC_INT
+bool EntryStrInt(std::string_view val, int64_t *out);
+void EntrySetValue(Entry *ent, std::string_view val);
+void EntrySetInt(Entry *ent, int64_t val);
+// Bytes used by a key and its value, as counted against maxmemory
+size_t EntryMemory(const Entry *ent);
@@ -1,4 +1,6 @@
 #include "HashTable.h"
+#include "Common.h"
+#include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
 
@@ -61,54 +63,86 @@ static hashTableNode *HTRemove(hashTable *HTable, hashTableNode **from) {
 
 // Average size of buckets in a table
 const size_t k_max_load_factor = 8;
+// The table is shrunk when there is less than one node per k_min_fill_ratio
+// buckets. The gap with k_max_load_factor keeps a map whose size goes up and
+// down around a threshold from being resized back and forth.
+const size_t k_min_fill_ratio = 8;
+// Smallest number of buckets
+const size_t k_min_slots = 4;
+
+// k_resizing_work ensures that hash table resizing operations are controlled
+// and incremental, thereby balancing performance with system responsiveness. It
+// allows the hash table to resize efficiently without monopolizing resources or
+// causing excessive delays in other system operations.
+const size_t k_resizing_work = 128;
+// A table being shrunk is mostly empty buckets, visiting them is bounded too
+const size_t k_resizing_empty_visits = 10;
 
 // Hashmap insertion
 static void HTInit(hashTable *HTable, size_t n);
 static void HTInsert(hashTable *HTable, hashTableNode *HTNode);
-static void HMResizeMove(hashMap *HMap);
-static void HMResizeCreate(hashMap *HMap);
+static void HMResizeMove(hashMap *HMap, size_t work);
+static void HMResizeCreate(hashMap *HMap, size_t nslots);
 void HMInsert(hashMap *HMap, hashTableNode *HTNode) {
   if (!(HMap->current_HT.table)) {
-    HTInit(&HMap->current_HT, 4);
+    HTInit(&HMap->current_HT, k_min_slots);
   }
   HTInsert(&HMap->current_HT, HTNode);
   if (!(HMap->previous_HT.table)) {
     size_t load_factor = (HMap->current_HT.size) / (HMap->current_HT.mask + 1);
     if (load_factor > k_max_load_factor) {
       // Create a new larger table
-      HMResizeCreate(HMap);
+      HMResizeCreate(HMap, (HMap->current_HT.mask + 1) * 2);
     }
-    // Move some key to the newer table
-    HMResizeMove(HMap);
   }
+  // Move some key to the newer table. This must also happen while a resize is
+  // in progress, otherwise a stream of inserts keeps growing the chains of the
+  // old-sized table until the next lookup.
+  HMResizeMove(HMap, k_resizing_work);
 }
 
 static void HTInit(hashTable *HTable, size_t n);
-static void HMResizeCreate(hashMap *HMap) {
+static void HMResizeCreate(hashMap *HMap, size_t nslots) {
   // Ensures that the previous_HT (previous hash table) is not already in use
   // before initiating a new resize operation because we are using progressive
   // resizing.
   assert(HMap->previous_HT.table == NULL);
   HMap->previous_HT = HMap->current_HT;
-  HTInit(&HMap->current_HT, (HMap->current_HT.mask + 1) * 2);
+  HTInit(&HMap->current_HT, nslots);
   HMap->resizing_pos = 0;
 }
 
-// k_resizing_work ensures that hash table resizing operations are controlled
-// and incremental, thereby balancing performance with system responsiveness. It
-// allows the hash table to resize efficiently without monopolizing resources or
-// causing excessive delays in other system operations.
-const size_t k_resizing_work = 128;
+// After mass deletions, move the nodes into a smaller table so the bucket
+// array does not keep its peak size. The new table holds about one node per
+// bucket, it is filled progressively like a larger one.
+static void HMResizeCreate(hashMap *HMap, size_t nslots);
+static void HMShrink(hashMap *HMap) {
+  hashTable *HTable = &HMap->current_HT;
+  if (HMap->previous_HT.table || !HTable->table ||
+      HTable->mask + 1 <= k_min_slots ||
+      HTable->size * k_min_fill_ratio >= HTable->mask + 1) {
+    return;
+  }
+  size_t nslots = k_min_slots;
+  while (nslots < HTable->size) {
+    nslots *= 2;
+  }
+  HMResizeCreate(HMap, nslots);
+}
 
 static void HTInsert(hashTable *HTable, hashTableNode *HTNode);
 static hashTableNode *HTRemove(hashTable *HTable, hashTableNode **from);
-static void HMResizeMove(hashMap *HMap) {
+static void HMResizeMove(hashMap *HMap, size_t work) {
   size_t n = 0;
-  while (n < k_resizing_work && HMap->previous_HT.size > 0) {
+  size_t empty_visits = work * k_resizing_empty_visits;
+  while (n < work && HMap->previous_HT.size > 0) {
     hashTableNode **from = &(HMap->previous_HT.table[HMap->resizing_pos]);
     // If the bucket is empty move to the next
     if (!*from) {
       HMap->resizing_pos++;
+      if (--empty_visits == 0) {
+        break;
+      }
       continue;
     }
     HTInsert(&HMap->current_HT, HTRemove(&HMap->previous_HT, from));
@@ -120,6 +154,15 @@ static void HMResizeMove(hashMap *HMap) {
   }
 }
 
+// Resize work done outside of the operations, e.g. when the event loop is
+// idle, so a map is not left half-migrated until the next burst of traffic.
+// Returns true while a resize is still in progress.
+static void HMResizeMove(hashMap *HMap, size_t work);
+bool HMRehash(hashMap *HMap, size_t work) {
+  HMResizeMove(HMap, work);
+  return HMap->previous_HT.table != NULL;
+}
+
 /*
  * The HTLookup function is designed to look up a key in a hash map (hashMap).
  * It takes care of progressive resizing and searches through both the new and
@@ -128,34 +171,222 @@ static void HMResizeMove(hashMap *HMap) {
 
 static hashTableNode **HTLookup(hashTable *HTable, hashTableNode *HTNode,
                                 bool (*eq)(hashTableNode *, hashTableNode *));
-static void HMResizeMove(hashMap *HMap);
+static void HMResizeMove(hashMap *HMap, size_t work);
 hashTableNode *HMLookup(hashMap *HMap, hashTableNode *key,
                         bool (*eq)(hashTableNode *, hashTableNode *)) {
   // If there are still some nodes in old hashmap, move it to the newer one
-  HMResizeMove(HMap);
+  HMResizeMove(HMap, k_resizing_work);
   hashTableNode **from = HTLookup(&HMap->current_HT, key, eq);
   from = from ? from : HTLookup(&HMap->previous_HT, key, eq);
   return from ? *from : NULL;
 }
 
-static void HMResizeMove(hashMap *HMap);
+// Keys handled per round of prefetches. Enough misses in flight to cover the
+// memory latency, few enough that the first prefetched lines are still in the
+// cache when the chains are walked.
+const size_t k_lookup_batch = 16;
+
+/*
+ * Lookups of several keys at once. A single lookup is a chain of dependent
+ * cache misses (the bucket, then the node), so instead of walking one chain
+ * after the other the buckets of a whole batch are prefetched first, then the
+ * heads of their chains, and only then the chains are walked. The misses of
+ * the different keys overlap. out[i] is the node of keys[i], NULL if none.
+ */
+static hashTableNode **HTLookup(hashTable *HTable, hashTableNode *HTNode,
+                                bool (*eq)(hashTableNode *, hashTableNode *));
+static void HMResizeMove(hashMap *HMap, size_t work);
+void HMLookupBatch(hashMap *HMap, hashTableNode *const *keys, size_t n,
+                   hashTableNode **out,
+                   bool (*eq)(hashTableNode *, hashTableNode *)) {
+  HMResizeMove(HMap, k_resizing_work);
+  hashTable *HTable = &HMap->current_HT;
+  for (size_t base = 0; base < n; base += k_lookup_batch) {
+    size_t end = base + k_lookup_batch < n ? base + k_lookup_batch : n;
+    if (HTable->table) {
+      for (size_t i = base; i < end; i++) {
+        __builtin_prefetch(&HTable->table[keys[i]->hash_value & HTable->mask]);
+      }
+      for (size_t i = base; i < end; i++) {
+        hashTableNode *head =
+            HTable->table[keys[i]->hash_value & HTable->mask];
+        if (head) {
+          __builtin_prefetch(head);
+        }
+      }
+    }
+    for (size_t i = base; i < end; i++) {
+      hashTableNode **from = HTLookup(HTable, keys[i], eq);
+      from = from ? from : HTLookup(&HMap->previous_HT, keys[i], eq);
+      out[i] = from ? *from : NULL;
+    }
+  }
+}
+
+static void HMResizeMove(hashMap *HMap, size_t work);
 static hashTableNode *HTRemove(hashTable *HTable, hashTableNode **from);
+static void HMShrink(hashMap *HMap);
 hashTableNode *HMPop(hashMap *HMap, hashTableNode *key,
                      bool (*eq)(hashTableNode *, hashTableNode *)) {
-  HMResizeMove(HMap);
+  HMResizeMove(HMap, k_resizing_work);
+  hashTableNode *node = NULL;
   if (hashTableNode **from = HTLookup(&HMap->current_HT, key, eq)) {
-    return HTRemove(&HMap->current_HT, from);
+    node = HTRemove(&HMap->current_HT, from);
+  } else if (hashTableNode **from = HTLookup(&HMap->previous_HT, key, eq)) {
+    node = HTRemove(&HMap->previous_HT, from);
+  }
+  if (node) {
+    HMShrink(HMap);
+  }
+  return node;
+}
+
+// Make room for n nodes in total, so that inserting them does not trigger a
+// chain of progressive resizes, e.g. before loading a snapshot
+void HMReserve(hashMap *HMap, size_t n) {
+  size_t nslots = k_min_slots;
+  while (nslots < n) {
+    nslots *= 2;
+  }
+  if (HMap->current_HT.table && HMap->current_HT.mask + 1 >= nslots) {
+    return;
   }
-  if (hashTableNode **from = HTLookup(&HMap->previous_HT, key, eq)) {
-    return HTRemove(&HMap->previous_HT, from);
+  // Finish the resize in progress, there is a single previous_HT
+  while (HMap->previous_HT.table) {
+    HMResizeMove(HMap, k_resizing_work);
+  }
+  if (HMap->current_HT.size == 0) {
+    free(HMap->current_HT.table);
+    HTInit(&HMap->current_HT, nslots);
+    return;
+  }
+  HMap->previous_HT = HMap->current_HT;
+  HTInit(&HMap->current_HT, nslots);
+  HMap->resizing_pos = 0;
+}
+
+size_t HMBuckets(hashMap *HMap) {
+  return HMap->current_HT.table ? HMap->current_HT.mask + 1 : 0;
+}
+
+size_t HMBucket(hashMap *HMap, uint64_t hash_value) {
+  return hash_value & HMap->current_HT.mask;
+}
+
+hashTableNode *HMBulkLink(hashMap *HMap, hashTableNode *const *nodes, size_t n,
+                          bool (*eq)(hashTableNode *, hashTableNode *)) {
+  assert(HMap->current_HT.table && !HMap->previous_HT.table);
+  hashTable *HTable = &HMap->current_HT;
+  for (size_t i = 0; i < n; i++) {
+    hashTableNode *node = nodes[i];
+    hashTableNode **head = &HTable->table[node->hash_value & HTable->mask];
+    for (hashTableNode *cur = *head; cur; cur = cur->next) {
+      if (cur->hash_value == node->hash_value && eq(cur, node)) {
+        return node;
+      }
+    }
+    node->next = *head;
+    *head = node;
   }
   return NULL;
 }
 
+void HMBulkAdd(hashMap *HMap, size_t n) { HMap->current_HT.size += n; }
+
 size_t HMSize(hashMap *HMap) {
   return HMap->current_HT.size + HMap->previous_HT.size;
 }
 
+static void HTScanBucket(hashTable *HTable, size_t pos,
+                         void (*f)(hashTableNode *, void *), void *arg) {
+  for (hashTableNode *node = HTable->table[pos]; node; node = node->next) {
+    f(node, arg);
+  }
+}
+
+/*
+ * One step of an incremental scan: calls f on the nodes of the bucket(s) the
+ * cursor points to and returns the next cursor, 0 when the scan is done.
+ * A key present for the whole scan is reported at least once, even when the
+ * map is resized between the steps. While a resize is in progress a bucket of
+ * the smaller table is visited together with all the buckets of the larger
+ * table it splits into, the two tables together hold every key.
+ */
+static void HTScanBucket(hashTable *HTable, size_t pos,
+                         void (*f)(hashTableNode *, void *), void *arg);
+size_t HMScan(hashMap *HMap, size_t cursor,
+              void (*f)(hashTableNode *, void *), void *arg) {
+  hashTable *small = &HMap->current_HT;
+  hashTable *large = &HMap->previous_HT;
+  if (!large->table) {
+    if (!small->table) {
+      return 0;
+    }
+    HTScanBucket(small, cursor & small->mask, f, arg);
+    return scanCursorNext(cursor, small->mask);
+  }
+  if (small->mask > large->mask) {
+    hashTable *t = small;
+    small = large;
+    large = t;
+  }
+  HTScanBucket(small, cursor & small->mask, f, arg);
+  do {
+    HTScanBucket(large, cursor & large->mask, f, arg);
+    cursor = scanCursorNext(cursor, large->mask);
+  } while (cursor & (small->mask ^ large->mask));
+  return cursor;
+}
+
+// Buckets visited per requested node at most, and empty buckets in a row
+// before jumping to another random bucket
+const size_t k_sample_visits = 10;
+const size_t k_sample_empty_run = 5;
+
+// Like Redis' dictGetSomeKeys(): walk consecutive buckets of both tables from
+// a random position, jumping elsewhere after a run of empty ones as long as
+// nothing was found. Once a node is found the walk only goes forward, for
+// fewer steps than there are buckets, so no node is returned twice.
+size_t HMSample(hashMap *HMap, uint64_t *rnd, hashTableNode **out, size_t n) {
+  hashTable *tables[2] = {&HMap->current_HT, &HMap->previous_HT};
+  size_t mask = 0;
+  for (hashTable *HTable : tables) {
+    if (HTable->table && HTable->mask > mask) {
+      mask = HTable->mask;
+    }
+  }
+  if (HMSize(HMap) == 0 || n == 0) {
+    return 0;
+  }
+  size_t steps = std::min(n * k_sample_visits, mask + 1);
+  size_t pos = wyRand(rnd) & mask;
+  size_t count = 0;
+  size_t empty = 0;
+  for (size_t step = 0; step < steps; step++) {
+    bool found = false;
+    for (hashTable *HTable : tables) {
+      if (!HTable->table || pos > HTable->mask) {
+        continue;
+      }
+      for (hashTableNode *node = HTable->table[pos]; node; node = node->next) {
+        out[count++] = node;
+        found = true;
+        if (count == n) {
+          return count;
+        }
+      }
+    }
+    empty = found ? 0 : empty + 1;
+    if (empty >= k_sample_empty_run && count == 0) {
+      pos = wyRand(rnd) & mask;
+      empty = 0;
+    } else {
+      pos = (pos + 1) & mask;
+    }
+  }
+  return count;
+}
+
 void HMDestroy(hashMap *HMap) {
   free(HMap->current_HT.table);
   free(HMap->previous_HT.table);
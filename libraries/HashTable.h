@@ -26,8 +26,32 @@ struct hashMap {
 
 hashTableNode *HMLookup(hashMap *HMap, hashTableNode *key,
                         bool (*eq)(hashTableNode *, hashTableNode *));
+// out[i] is set to the node of keys[i] (NULL if none), with the memory
+// accesses of the keys overlapped
+void HMLookupBatch(hashMap *HMap, hashTableNode *const *keys, size_t n,
+                   hashTableNode **out,
+                   bool (*eq)(hashTableNode *, hashTableNode *));
 void HMInsert(hashMap *HMap, hashTableNode *HTNode);
 hashTableNode *HMPop(hashMap *HMap, hashTableNode *key,
                      bool (*eq)(hashTableNode *, hashTableNode *));
 size_t HMSize(hashMap *HMap);
+// Move up to `work` nodes of a resize in progress, true if it is not done yet
+bool HMRehash(hashMap *HMap, size_t work);
+void HMReserve(hashMap *HMap, size_t n);
+// Bulk loading into a map sized by HMReserve, with no resize in progress.
+// HMBulkLink pushes the nodes onto their buckets without the load factor
+// check and the resize step of HMInsert, and returns a node whose key is
+// already in the map (NULL if none). Several threads may link at once if
+// their nodes fall into disjoint buckets (see HMBucket), the total is added
+// afterwards with HMBulkAdd.
+size_t HMBuckets(hashMap *HMap);
+size_t HMBucket(hashMap *HMap, uint64_t hash_value);
+hashTableNode *HMBulkLink(hashMap *HMap, hashTableNode *const *nodes, size_t n,
+                          bool (*eq)(hashTableNode *, hashTableNode *));
+void HMBulkAdd(hashMap *HMap, size_t n);
+size_t HMScan(hashMap *HMap, size_t cursor,
+              void (*f)(hashTableNode *, void *), void *arg);
+// Up to n distinct nodes from random buckets, e.g. eviction candidates. May
+// return fewer for a sparse map. rnd is the state of wyRand().
+size_t HMSample(hashMap *HMap, uint64_t *rnd, hashTableNode **out, size_t n);
 void HMDestroy(hashMap *HMap);
@@ -0,0 +1,63 @@
+#include "Heap.h"
+
+static size_t heapParent(size_t i) { return (i + 1) / 2 - 1; }
+
+static size_t heapLeft(size_t i) { return i * 2 + 1; }
+
+static size_t heapRight(size_t i) { return i * 2 + 2; }
+
+// Move the item towards the root while it is smaller than its parent
+static size_t heapParent(size_t i);
+static void heapUp(HeapItem *heap, size_t pos) {
+  HeapItem t = heap[pos];
+  while (pos > 0 && heap[heapParent(pos)].val > t.val) {
+    // Swap with the parent
+    heap[pos] = heap[heapParent(pos)];
+    *heap[pos].ref = pos;
+    pos = heapParent(pos);
+  }
+  heap[pos] = t;
+  *heap[pos].ref = pos;
+}
+
+// Move the item towards the leaves while it is larger than a child
+static size_t heapLeft(size_t i);
+static size_t heapRight(size_t i);
+static void heapDown(HeapItem *heap, size_t pos, size_t len) {
+  HeapItem t = heap[pos];
+  while (true) {
+    // Find the smallest one among the parent and its children
+    size_t l = heapLeft(pos);
+    size_t r = heapRight(pos);
+    size_t min_pos = pos;
+    uint64_t min_val = t.val;
+    if (l < len && heap[l].val < min_val) {
+      min_pos = l;
+      min_val = heap[l].val;
+    }
+    if (r < len && heap[r].val < min_val) {
+      min_pos = r;
+    }
+    if (min_pos == pos) {
+      break;
+    }
+    // Swap with the smaller child
+    heap[pos] = heap[min_pos];
+    *heap[pos].ref = pos;
+    pos = min_pos;
+  }
+  heap[pos] = t;
+  *heap[pos].ref = pos;
+}
+
+// Restore the heap order after the item at pos was added or changed.
+// O(log n), the ref of every moved item is updated.
+static void heapUp(HeapItem *heap, size_t pos);
+static void heapDown(HeapItem *heap, size_t pos, size_t len);
+void HeapUpdate(HeapItem *heap, size_t pos, size_t len) {
+  if (pos > 0 && heap[heapParent(pos)].val > heap[pos].val) {
+    heapUp(heap, pos);
+  } else {
+    heapDown(heap, pos, len);
+  }
+}
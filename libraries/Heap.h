@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary min-heap item
+struct HeapItem {
+  uint64_t val = 0;   // the key of the heap, e.g. an expiration time
+  size_t *ref = NULL; // the owner's copy of this item's position
+};
+
+void HeapUpdate(HeapItem *heap, size_t pos, size_t len);
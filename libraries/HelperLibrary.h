@@ -1,4 +1,6 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 namespace HelperLibrary {
   class IOHelpers {
@@ -0,0 +1,64 @@
+#include "Histogram.h"
+
+// Values below 2 * k_hist_sub_buckets get a bucket each. Above, the bucket is
+// found from the position of the highest bit (the power of two) and the next
+// k_hist_sub_bits bits (the linear part).
+static uint32_t histBucket(uint64_t val) {
+  if (val < 2 * k_hist_sub_buckets) {
+    return (uint32_t)val;
+  }
+  uint32_t shift = 63 - __builtin_clzll(val) - k_hist_sub_bits;
+  return shift * k_hist_sub_buckets + (uint32_t)(val >> shift);
+}
+
+// The largest value that falls into a bucket
+static uint64_t histBucketMax(uint32_t idx) {
+  if (idx < 2 * k_hist_sub_buckets) {
+    return idx;
+  }
+  uint32_t shift = idx / k_hist_sub_buckets - 1;
+  uint64_t sub = idx - shift * k_hist_sub_buckets;
+  return ((sub + 1) << shift) - 1;
+}
+
+void HistRecord(Histogram *hist, uint64_t val) {
+  hist->counts[histBucket(val)]++;
+  hist->total++;
+  hist->sum += val;
+  hist->min = val < hist->min ? val : hist->min;
+  hist->max = val > hist->max ? val : hist->max;
+}
+
+uint64_t HistPercentile(const Histogram *hist, double q) {
+  if (hist->total == 0) {
+    return 0;
+  }
+  // The rank of the value, 1-based
+  uint64_t rank = (uint64_t)(q * (double)hist->total + 0.5);
+  rank = rank < 1 ? 1 : rank;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < k_hist_buckets; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      uint64_t val = histBucketMax(i);
+      return val < hist->max ? val : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+double HistMean(const Histogram *hist) {
+  return hist->total ? (double)hist->sum / (double)hist->total : 0;
+}
+
+void HistMerge(Histogram *dst, const Histogram *src) {
+  for (uint32_t i = 0; i < k_hist_buckets; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  dst->sum += src->sum;
+  dst->min = src->min < dst->min ? src->min : dst->min;
+  dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+void HistReset(Histogram *hist) { *hist = Histogram(); }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram, in the style of HdrHistogram: every power of two is
+// split into k_hist_sub_buckets linear buckets, so a recorded value is known
+// within 1/k_hist_sub_buckets (about 3%) no matter its magnitude, and values
+// below 2 * k_hist_sub_buckets are exact. The unit is up to the caller, e.g.
+// microseconds.
+const uint32_t k_hist_sub_bits = 5;
+const uint32_t k_hist_sub_buckets = 1 << k_hist_sub_bits;
+// Enough buckets for any uint64_t
+const uint32_t k_hist_buckets = (64 - k_hist_sub_bits + 1) * k_hist_sub_buckets;
+
+struct Histogram {
+  uint64_t counts[k_hist_buckets] = {};
+  uint64_t total = 0; // number of values
+  uint64_t sum = 0;   // sum of the values, for the mean
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+};
+
+void HistRecord(Histogram *hist, uint64_t val);
+// The value below which a fraction q (0..1) of the recorded values fall,
+// rounded up to the end of its bucket. 0 if nothing was recorded.
+uint64_t HistPercentile(const Histogram *hist, double q);
+double HistMean(const Histogram *hist);
+void HistMerge(Histogram *dst, const Histogram *src);
+void HistReset(Histogram *hist);
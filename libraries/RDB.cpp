@@ -0,0 +1,552 @@
+#include "RDB.h"
+#include <charconv>
+#include <stdlib.h>
+#include <string.h>
+
+// CRC-64/Jones (reflected), as used by Redis. Slicing by 8: table[k][b] is
+// the CRC of byte b followed by k zero bytes, so 8 input bytes are folded in
+// with 8 independent lookups.
+struct CRCTables {
+  uint64_t t[8][256];
+};
+
+static constexpr CRCTables buildCRCTables() {
+  const uint64_t poly = 0x95AC9329AC4BC9B5ull;
+  CRCTables tables = {};
+  for (uint64_t i = 0; i < 256; i++) {
+    uint64_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+    }
+    tables.t[0][i] = crc;
+  }
+  for (size_t k = 1; k < 8; k++) {
+    for (size_t i = 0; i < 256; i++) {
+      uint64_t prev = tables.t[k - 1][i];
+      tables.t[k][i] = tables.t[0][prev & 0xFF] ^ (prev >> 8);
+    }
+  }
+  return tables;
+}
+
+static constexpr CRCTables k_crc = buildCRCTables();
+
+uint64_t CRC64(uint64_t crc, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8); // little-endian host
+    v ^= crc;
+    crc = k_crc.t[7][v & 0xFF] ^ k_crc.t[6][(v >> 8) & 0xFF] ^
+          k_crc.t[5][(v >> 16) & 0xFF] ^ k_crc.t[4][(v >> 24) & 0xFF] ^
+          k_crc.t[3][(v >> 32) & 0xFF] ^ k_crc.t[2][(v >> 40) & 0xFF] ^
+          k_crc.t[1][(v >> 48) & 0xFF] ^ k_crc.t[0][v >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = k_crc.t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+// CRC-64 is linear, so the CRC of A + B is the CRC of A followed by len(B)
+// zero bytes, xored with the CRC of B. Appending zeros is a linear map over
+// GF(2) that is built by squaring (as in zlib's crc32_combine), which lets
+// chunks of a file be checksummed in parallel.
+static uint64_t gf2Times(const uint64_t *mat, uint64_t vec) {
+  uint64_t sum = 0;
+  for (size_t i = 0; vec; vec >>= 1, i++) {
+    if (vec & 1) {
+      sum ^= mat[i];
+    }
+  }
+  return sum;
+}
+
+static void gf2Square(uint64_t *square, const uint64_t *mat) {
+  for (size_t i = 0; i < 64; i++) {
+    square[i] = gf2Times(mat, mat[i]);
+  }
+}
+
+uint64_t CRC64Combine(uint64_t crc1, uint64_t crc2, size_t len2) {
+  if (len2 == 0) {
+    return crc1;
+  }
+  uint64_t even[64], odd[64];
+  // One zero bit
+  odd[0] = 0x95AC9329AC4BC9B5ull;
+  for (size_t i = 1; i < 64; i++) {
+    odd[i] = 1ull << (i - 1);
+  }
+  gf2Square(even, odd); // two zero bits
+  gf2Square(odd, even); // four zero bits
+  // The first squaring below gives one zero byte
+  while (true) {
+    gf2Square(even, odd);
+    if (len2 & 1) {
+      crc1 = gf2Times(even, crc1);
+    }
+    len2 >>= 1;
+    if (!len2) {
+      break;
+    }
+    gf2Square(odd, even);
+    if (len2 & 1) {
+      crc1 = gf2Times(odd, crc1);
+    }
+    len2 >>= 1;
+    if (!len2) {
+      break;
+    }
+  }
+  return crc1 ^ crc2;
+}
+
+void RDBWriteRaw(RDBWriter *w, const void *data, size_t len) {
+  if (w->failed) {
+    return;
+  }
+  if (fwrite(data, 1, len, w->fp) != len) {
+    w->failed = true;
+    return;
+  }
+  w->crc = CRC64(w->crc, data, len);
+  w->bytes += len;
+}
+
+void RDBWriteByte(RDBWriter *w, uint8_t val) { RDBWriteRaw(w, &val, 1); }
+
+// 00|6 bits, 01|14 bits, 0x80 + 32 bits or 0x81 + 64 bits, big-endian
+void RDBWriteLen(RDBWriter *w, uint64_t len) {
+  uint8_t buf[9];
+  if (len < (1 << 6)) {
+    buf[0] = (uint8_t)len;
+    return RDBWriteRaw(w, buf, 1);
+  }
+  if (len < (1 << 14)) {
+    buf[0] = (uint8_t)(0x40 | (len >> 8));
+    buf[1] = (uint8_t)len;
+    return RDBWriteRaw(w, buf, 2);
+  }
+  size_t n = len <= UINT32_MAX ? 4 : 8;
+  buf[0] = n == 4 ? 0x80 : 0x81;
+  for (size_t i = 0; i < n; i++) {
+    buf[1 + i] = (uint8_t)(len >> (8 * (n - 1 - i)));
+  }
+  RDBWriteRaw(w, buf, 1 + n);
+}
+
+// Strings holding a small integer in canonical form are stored as the integer
+static bool rdbWriteIntString(RDBWriter *w, std::string_view str) {
+  if (str.empty() || str.size() > 11) {
+    return false;
+  }
+  int64_t val = 0;
+  const char *end = str.data() + str.size();
+  std::from_chars_result res = std::from_chars(str.data(), end, val);
+  if (res.ec != std::errc() || res.ptr != end || val < INT32_MIN ||
+      val > INT32_MAX) {
+    return false;
+  }
+  // Reject "007", "-0" and the like, they would not load back the same
+  char canonical[16];
+  std::to_chars_result out = std::to_chars(canonical, canonical + 16, val);
+  if (std::string_view(canonical, out.ptr - canonical) != str) {
+    return false;
+  }
+  uint8_t buf[5];
+  size_t n = 4;
+  buf[0] = 0xC2;
+  if (val >= INT8_MIN && val <= INT8_MAX) {
+    n = 1;
+    buf[0] = 0xC0;
+  } else if (val >= INT16_MIN && val <= INT16_MAX) {
+    n = 2;
+    buf[0] = 0xC1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    buf[1 + i] = (uint8_t)((uint64_t)val >> (8 * i));
+  }
+  RDBWriteRaw(w, buf, 1 + n);
+  return true;
+}
+
+void RDBWriteString(RDBWriter *w, std::string_view str) {
+  if (rdbWriteIntString(w, str)) {
+    return;
+  }
+  RDBWriteLen(w, str.size());
+  RDBWriteRaw(w, str.data(), str.size());
+}
+
+void RDBWriteDouble(RDBWriter *w, double val) { RDBWriteRaw(w, &val, 8); }
+
+void RDBWriteMillis(RDBWriter *w, int64_t ms) { RDBWriteRaw(w, &ms, 8); }
+
+void RDBWriteHeader(RDBWriter *w) {
+  char header[16];
+  snprintf(header, sizeof(header), "%s%04u", k_rdb_magic, k_rdb_version);
+  RDBWriteRaw(w, header, 9);
+}
+
+void RDBWriteAux(RDBWriter *w, std::string_view key, std::string_view val) {
+  RDBWriteByte(w, RDB_OPCODE_AUX);
+  RDBWriteString(w, key);
+  RDBWriteString(w, val);
+}
+
+// The EOF opcode and the checksum of everything before it
+void RDBWriteEnd(RDBWriter *w) {
+  RDBWriteByte(w, RDB_OPCODE_EOF);
+  uint64_t crc = w->crc;
+  RDBWriteRaw(w, &crc, 8);
+}
+
+static const uint8_t *rdbRead(RDBReader *r, size_t n) {
+  if (r->failed || r->size - r->pos < n) {
+    r->failed = true;
+    return NULL;
+  }
+  const uint8_t *p = r->data + r->pos;
+  r->pos += n;
+  return p;
+}
+
+bool RDBReadHeader(RDBReader *r) {
+  const uint8_t *p = rdbRead(r, 9);
+  if (!p || memcmp(p, k_rdb_magic, 5) != 0) {
+    return false;
+  }
+  uint32_t version = 0;
+  for (size_t i = 5; i < 9; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return false;
+    }
+    version = version * 10 + (p[i] - '0');
+  }
+  return version >= 1 && version <= 12;
+}
+
+uint8_t RDBReadByte(RDBReader *r) {
+  const uint8_t *p = rdbRead(r, 1);
+  return p ? *p : 0;
+}
+
+static uint64_t rdbReadBE(RDBReader *r, size_t n) {
+  const uint8_t *p = rdbRead(r, n);
+  uint64_t val = 0;
+  for (size_t i = 0; p && i < n; i++) {
+    val = (val << 8) | p[i];
+  }
+  return val;
+}
+
+static int64_t rdbReadLE(RDBReader *r, size_t n) {
+  const uint8_t *p = rdbRead(r, n);
+  uint64_t val = 0;
+  for (size_t i = 0; p && i < n; i++) {
+    val |= (uint64_t)p[i] << (8 * i);
+  }
+  // Sign extension
+  size_t shift = 64 - 8 * n;
+  return (int64_t)(val << shift) >> shift;
+}
+
+// A length, or with *encoded set the format (0xC0 | format) of a string
+static uint64_t rdbReadLen(RDBReader *r, bool *encoded) {
+  *encoded = false;
+  uint8_t b = RDBReadByte(r);
+  switch (b >> 6) {
+  case 0:
+    return b & 0x3F;
+  case 1:
+    return ((uint64_t)(b & 0x3F) << 8) | RDBReadByte(r);
+  case 2:
+    if (b == 0x80) {
+      return rdbReadBE(r, 4);
+    }
+    if (b == 0x81) {
+      return rdbReadBE(r, 8);
+    }
+    r->failed = true;
+    return 0;
+  default:
+    *encoded = true;
+    return b & 0x3F;
+  }
+}
+
+uint64_t RDBReadLen(RDBReader *r) {
+  bool encoded = false;
+  uint64_t len = rdbReadLen(r, &encoded);
+  if (encoded) {
+    r->failed = true;
+  }
+  return len;
+}
+
+// The most output 1 byte of LZF input can give: a back reference of 3 bytes
+// copies at most 264 bytes
+const uint64_t k_lzf_max_ratio = 88;
+
+// LZF: runs of literals and back references into the output
+static bool lzfDecompress(const uint8_t *in, size_t in_len, uint8_t *out,
+                          size_t out_len) {
+  size_t ip = 0, op = 0;
+  while (ip < in_len) {
+    size_t ctrl = in[ip++];
+    if (ctrl < 32) {
+      size_t n = ctrl + 1;
+      if (n > in_len - ip || n > out_len - op) {
+        return false;
+      }
+      memcpy(out + op, in + ip, n);
+      ip += n;
+      op += n;
+      continue;
+    }
+    size_t n = ctrl >> 5;
+    if (n == 7) {
+      if (ip >= in_len) {
+        return false;
+      }
+      n += in[ip++];
+    }
+    if (ip >= in_len) {
+      return false;
+    }
+    size_t back = ((ctrl & 0x1F) << 8) + in[ip++] + 1;
+    n += 2;
+    if (back > op || n > out_len - op) {
+      return false;
+    }
+    // May overlap the bytes being written, copy one by one
+    for (size_t i = 0; i < n; i++, op++) {
+      out[op] = out[op - back];
+    }
+  }
+  return op == out_len;
+}
+
+void RDBReadString(RDBReader *r, std::string &out) {
+  bool encoded = false;
+  uint64_t len = rdbReadLen(r, &encoded);
+  if (!encoded) {
+    const uint8_t *p = rdbRead(r, len);
+    if (p) {
+      out.assign((const char *)p, len);
+    }
+    return;
+  }
+  if (len <= 2) {
+    // int8, int16 or int32
+    int64_t val = rdbReadLE(r, (size_t)1 << len);
+    out = std::to_string(val);
+    return;
+  }
+  if (len != 3) {
+    r->failed = true;
+    return;
+  }
+  uint64_t clen = RDBReadLen(r);
+  uint64_t ulen = RDBReadLen(r);
+  const uint8_t *p = rdbRead(r, clen);
+  if (!p) {
+    return;
+  }
+  // The length comes from the file, do not allocate more than the data can
+  // decompress to
+  if (ulen > clen * k_lzf_max_ratio) {
+    r->failed = true;
+    return;
+  }
+  out.resize(ulen);
+  if (!lzfDecompress(p, clen, (uint8_t *)out.data(), ulen)) {
+    r->failed = true;
+  }
+}
+
+// Like RDBReadString, but a string stored as is comes back as a view into the
+// input instead of a copy. Integer and LZF strings are decoded into scratch.
+std::string_view RDBReadStringView(RDBReader *r, std::string &scratch) {
+  size_t start = r->pos;
+  bool encoded = false;
+  uint64_t len = rdbReadLen(r, &encoded);
+  if (!encoded) {
+    const uint8_t *p = rdbRead(r, len);
+    return p ? std::string_view((const char *)p, len) : std::string_view();
+  }
+  r->pos = start;
+  RDBReadString(r, scratch);
+  return scratch;
+}
+
+void RDBSkipString(RDBReader *r) {
+  bool encoded = false;
+  uint64_t len = rdbReadLen(r, &encoded);
+  if (!encoded) {
+    rdbRead(r, len);
+  } else if (len <= 2) {
+    rdbRead(r, (size_t)1 << len);
+  } else if (len == 3) {
+    uint64_t clen = RDBReadLen(r);
+    (void)RDBReadLen(r);
+    rdbRead(r, clen);
+  } else {
+    r->failed = true;
+  }
+}
+
+// Step over the key and value of an entry whose type byte has been read,
+// without decoding them. Returns false for a type that cannot be loaded.
+bool RDBSkipEntry(RDBReader *r, uint8_t type) {
+  RDBSkipString(r);
+  switch (type) {
+  case RDB_TYPE_STRING:
+  case RDB_TYPE_ZSET_LISTPACK:
+    RDBSkipString(r);
+    return true;
+  case RDB_TYPE_ZSET:
+  case RDB_TYPE_ZSET_2:
+    for (uint64_t n = RDBReadLen(r); n > 0 && !r->failed; n--) {
+      RDBSkipString(r);
+      if (type == RDB_TYPE_ZSET_2) {
+        rdbRead(r, 8);
+      } else if (uint8_t len = RDBReadByte(r); len < 253) {
+        rdbRead(r, len);
+      }
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+double RDBReadDouble(RDBReader *r) {
+  const uint8_t *p = rdbRead(r, 8);
+  double val = 0;
+  if (p) {
+    memcpy(&val, p, 8);
+  }
+  return val;
+}
+
+// The old format: a length byte then ASCII, 253-255 for nan, +inf and -inf
+double RDBReadStrDouble(RDBReader *r) {
+  uint8_t len = RDBReadByte(r);
+  switch (len) {
+  case 253:
+    r->failed = true; // not a valid score
+    return 0;
+  case 254:
+    return __builtin_inf();
+  case 255:
+    return -__builtin_inf();
+  }
+  const uint8_t *p = rdbRead(r, len);
+  double val = 0;
+  if (p) {
+    std::string buf((const char *)p, len);
+    char *end = NULL;
+    val = strtod(buf.c_str(), &end);
+    r->failed = r->failed || end != buf.c_str() + len;
+  }
+  return val;
+}
+
+int64_t RDBReadMillis(RDBReader *r) { return rdbReadLE(r, 8); }
+
+int64_t RDBReadSeconds(RDBReader *r) { return rdbReadLE(r, 4); }
+
+// After the EOF opcode: verify the checksum against crc, the CRC64 of the
+// file up to here. 0 in the file means it was not computed.
+bool RDBReadEnd(RDBReader *r, uint64_t crc) {
+  const uint8_t *p = rdbRead(r, 8);
+  if (!p) {
+    return false;
+  }
+  uint64_t expect = 0;
+  memcpy(&expect, p, 8);
+  return expect == 0 || expect == crc;
+}
+
+// Size of the backlen field that ends a listpack entry of n bytes
+static size_t lpBacklenSize(size_t n) {
+  return n < 128 ? 1 : n < 16384 ? 2 : n < 2097152 ? 3 : n < 268435456 ? 4 : 5;
+}
+
+// Split a listpack (the compact encoding of small collections) into its
+// elements, integers are converted to their decimal string
+bool RDBListpackParse(std::string_view lp, std::vector<std::string> &items) {
+  const uint8_t *p = (const uint8_t *)lp.data();
+  size_t size = lp.size();
+  // Total bytes (32 bits) and number of elements (16 bits)
+  if (size < 7) {
+    return false;
+  }
+  size_t pos = 6;
+  while (pos < size && p[pos] != 0xFF) {
+    uint8_t b = p[pos];
+    size_t hdr = 1, len = 0;
+    int64_t ival = 0;
+    bool is_int = true;
+    size_t avail = size - pos;
+    if ((b & 0x80) == 0) {
+      ival = b & 0x7F;
+    } else if ((b & 0xC0) == 0x80) {
+      is_int = false;
+      len = b & 0x3F;
+    } else if ((b & 0xE0) == 0xC0) {
+      if (avail < 2) {
+        return false;
+      }
+      hdr = 2;
+      ival = ((int64_t)(b & 0x1F) << 8) | p[pos + 1];
+      ival = ival >= (1 << 12) ? ival - (1 << 13) : ival;
+    } else if ((b & 0xF0) == 0xE0) {
+      if (avail < 2) {
+        return false;
+      }
+      hdr = 2;
+      is_int = false;
+      len = ((size_t)(b & 0x0F) << 8) | p[pos + 1];
+    } else if (b == 0xF0) {
+      if (avail < 5) {
+        return false;
+      }
+      hdr = 5;
+      is_int = false;
+      len = (size_t)p[pos + 1] | ((size_t)p[pos + 2] << 8) |
+            ((size_t)p[pos + 3] << 16) | ((size_t)p[pos + 4] << 24);
+    } else if (b >= 0xF1 && b <= 0xF4) {
+      // int16, int24, int32, int64, little-endian
+      const size_t widths[] = {2, 3, 4, 8};
+      size_t n = widths[b - 0xF1];
+      if (avail < 1 + n) {
+        return false;
+      }
+      uint64_t val = 0;
+      for (size_t i = 0; i < n; i++) {
+        val |= (uint64_t)p[pos + 1 + i] << (8 * i);
+      }
+      size_t shift = 64 - 8 * n;
+      ival = shift ? (int64_t)(val << shift) >> shift : (int64_t)val;
+      hdr = 1 + n;
+    } else {
+      return false;
+    }
+    if (len > avail - hdr) {
+      return false;
+    }
+    if (is_int) {
+      items.push_back(std::to_string(ival));
+    } else {
+      items.emplace_back((const char *)p + pos + hdr, len);
+    }
+    size_t entry = hdr + len;
+    pos += entry + lpBacklenSize(entry);
+  }
+  return pos < size;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Encoding of Redis RDB snapshot files, the parts this server can produce and
+// load: strings and sorted sets, key expiration and the file framing.
+const char k_rdb_magic[] = "REDIS";
+const uint32_t k_rdb_version = 11;
+
+// Opcodes, in place of a value type
+enum {
+  RDB_OPCODE_FUNCTION2 = 245,
+  RDB_OPCODE_MODULE_AUX = 247,
+  RDB_OPCODE_IDLE = 248,
+  RDB_OPCODE_FREQ = 249,
+  RDB_OPCODE_AUX = 250,
+  RDB_OPCODE_RESIZEDB = 251,
+  RDB_OPCODE_EXPIRETIME_MS = 252,
+  RDB_OPCODE_EXPIRETIME = 253,
+  RDB_OPCODE_SELECTDB = 254,
+  RDB_OPCODE_EOF = 255,
+};
+
+// Value types
+enum {
+  RDB_TYPE_STRING = 0,
+  RDB_TYPE_ZSET = 3,   // scores as strings
+  RDB_TYPE_ZSET_2 = 5, // scores as binary doubles
+  RDB_TYPE_ZSET_LISTPACK = 17,
+};
+
+uint64_t CRC64(uint64_t crc, const void *data, size_t len);
+uint64_t CRC64Combine(uint64_t crc1, uint64_t crc2, size_t len2);
+
+// Buffered file output, the CRC64 of everything written is kept up to date
+struct RDBWriter {
+  FILE *fp = NULL;
+  uint64_t crc = 0;
+  size_t bytes = 0;
+  bool failed = false;
+};
+
+void RDBWriteRaw(RDBWriter *w, const void *data, size_t len);
+void RDBWriteByte(RDBWriter *w, uint8_t val);
+void RDBWriteLen(RDBWriter *w, uint64_t len);
+void RDBWriteString(RDBWriter *w, std::string_view str);
+void RDBWriteDouble(RDBWriter *w, double val);
+void RDBWriteMillis(RDBWriter *w, int64_t ms);
+void RDBWriteHeader(RDBWriter *w);
+void RDBWriteAux(RDBWriter *w, std::string_view key, std::string_view val);
+void RDBWriteEnd(RDBWriter *w);
+
+// Parses a snapshot held in memory. Every read sets failed on truncated or
+// malformed input, so callers check it once per key.
+struct RDBReader {
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  size_t pos = 0;
+  bool failed = false;
+};
+
+bool RDBReadHeader(RDBReader *r);
+uint8_t RDBReadByte(RDBReader *r);
+uint64_t RDBReadLen(RDBReader *r);
+void RDBReadString(RDBReader *r, std::string &out);
+std::string_view RDBReadStringView(RDBReader *r, std::string &scratch);
+void RDBSkipString(RDBReader *r);
+bool RDBSkipEntry(RDBReader *r, uint8_t type);
+double RDBReadDouble(RDBReader *r);
+double RDBReadStrDouble(RDBReader *r);
+int64_t RDBReadMillis(RDBReader *r);
+int64_t RDBReadSeconds(RDBReader *r);
+bool RDBReadEnd(RDBReader *r, uint64_t crc);
+bool RDBListpackParse(std::string_view lp, std::vector<std::string> &items);
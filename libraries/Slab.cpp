@@ -0,0 +1,93 @@
+#include "Slab.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// Block sizes, multiples of 16 so every block stays 16-byte aligned. Steps
+// grow with the size to keep the rounding waste around 20% at most.
+const size_t k_slab_sizes[k_slab_nclasses] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640,
+};
+
+const size_t k_slab_page = 64 << 10;
+
+// The smallest class that fits size bytes, k_slab_large if none does
+uint8_t SlabClass(size_t size) {
+  for (uint8_t cls = 0; cls < k_slab_nclasses; cls++) {
+    if (size <= k_slab_sizes[cls]) {
+      return cls;
+    }
+  }
+  return k_slab_large;
+}
+
+// Usable bytes of a block, size is the requested size for a large block
+size_t SlabClassSize(uint8_t cls, size_t size) {
+  return cls == k_slab_large ? size : k_slab_sizes[cls];
+}
+
+// Cut a new page into blocks of one class
+static void slabRefill(Slab *slab, uint8_t cls) {
+  size_t bsize = k_slab_sizes[cls];
+  char *page = (char *)aligned_alloc(16, k_slab_page);
+  assert(page);
+  slab->reserved += k_slab_page;
+  // Pushed in reverse so the blocks are handed out in address order
+  for (size_t off = k_slab_page / bsize * bsize; off >= bsize; off -= bsize) {
+    SlabBlock *block = (SlabBlock *)(page + off - bsize);
+    block->next = slab->free_list[cls];
+    slab->free_list[cls] = block;
+  }
+}
+
+void *SlabAlloc(Slab *slab, uint8_t cls, size_t size) {
+  if (cls == k_slab_large) {
+    slab->used += size;
+    slab->reserved += size;
+    void *ptr = malloc(size);
+    assert(ptr);
+    return ptr;
+  }
+  if (!slab->free_list[cls]) {
+    slabRefill(slab, cls);
+  }
+  SlabBlock *block = slab->free_list[cls];
+  slab->free_list[cls] = block->next;
+  slab->used += k_slab_sizes[cls];
+  return block;
+}
+
+void SlabFree(Slab *slab, void *ptr, uint8_t cls, size_t size) {
+  if (cls == k_slab_large) {
+    slab->used -= size;
+    slab->reserved -= size;
+    free(ptr);
+    return;
+  }
+  SlabBlock *block = (SlabBlock *)ptr;
+  block->next = slab->free_list[cls];
+  slab->free_list[cls] = block;
+  slab->used -= k_slab_sizes[cls];
+}
+
+// Take over the free blocks and the accounting of another slab, e.g. one a
+// loader thread allocated from. Pages are never returned, so nothing else
+// needs to move.
+void SlabMerge(Slab *dst, Slab *src) {
+  for (size_t cls = 0; cls < k_slab_nclasses; cls++) {
+    SlabBlock *head = src->free_list[cls];
+    if (!head) {
+      continue;
+    }
+    SlabBlock *tail = head;
+    while (tail->next) {
+      tail = tail->next;
+    }
+    tail->next = dst->free_list[cls];
+    dst->free_list[cls] = head;
+    src->free_list[cls] = NULL;
+  }
+  dst->used += src->used;
+  dst->reserved += src->reserved;
+  src->used = 0;
+  src->reserved = 0;
+}
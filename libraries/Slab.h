@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-class allocator for small objects. Blocks of one class are carved out
+// of 64 KB pages and recycled through a free list, so there is no per-block
+// malloc header and objects of the same class sit next to each other. Pages
+// are never returned, a freed block is reused by the next allocation of its
+// class. Not thread safe, every shard has its own.
+const size_t k_slab_nclasses = 16;
+// Marks a block that is too large for the slabs and came from malloc()
+const uint8_t k_slab_large = 0xFF;
+
+struct SlabBlock {
+  SlabBlock *next = NULL;
+};
+
+struct Slab {
+  SlabBlock *free_list[k_slab_nclasses] = {};
+  size_t used = 0;     // bytes handed out, including large blocks
+  size_t reserved = 0; // bytes of pages, plus the large blocks
+};
+
+uint8_t SlabClass(size_t size);
+size_t SlabClassSize(uint8_t cls, size_t size);
+void *SlabAlloc(Slab *slab, uint8_t cls, size_t size);
+void SlabFree(Slab *slab, void *ptr, uint8_t cls, size_t size);
+void SlabMerge(Slab *dst, Slab *src);
@@ -0,0 +1,431 @@
+#include "SwissTable.h"
+#include "Common.h"
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const size_t k_group_width = 16;
+
+// Control bytes. A full slot stores h2 (0..0x7F), the high bit marks a free
+// slot.
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xFE;
+
+// h1 picks the first group to probe, h2 is the fingerprint
+static size_t h1(uint64_t hash) { return (size_t)(hash >> 7); }
+
+static uint8_t h2(uint64_t hash) { return (uint8_t)(hash & 0x7F); }
+
+// Bit i is set if ctrl[i] == b
+static uint32_t groupMatch(const uint8_t *ctrl, uint8_t b) {
+#if defined(__SSE2__)
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  __m128i match = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)b));
+  return (uint32_t)_mm_movemask_epi8(match);
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < k_group_width; i++) {
+    mask |= (uint32_t)(ctrl[i] == b) << i;
+  }
+  return mask;
+#endif
+}
+
+// Bit i is set if ctrl[i] is EMPTY or DELETED
+static uint32_t groupMatchFree(const uint8_t *ctrl) {
+#if defined(__SSE2__)
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(group);
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < k_group_width; i++) {
+    mask |= (uint32_t)(ctrl[i] >> 7) << i;
+  }
+  return mask;
+#endif
+}
+
+static void STInit(swissTable *STable, size_t ngroups) {
+  // ngroups must be power of 2, so the triangular probe sequence visits every
+  // group
+  assert(ngroups > 0 && ((ngroups & (ngroups - 1)) == 0));
+  size_t nslots = ngroups * k_group_width;
+  STable->ctrl = (uint8_t *)aligned_alloc(k_group_width, nslots);
+  assert(STable->ctrl);
+  memset(STable->ctrl, k_ctrl_empty, nslots);
+  STable->slots = (hashTableNode **)calloc(sizeof(hashTableNode *), nslots);
+  STable->mask = ngroups - 1;
+  STable->size = 0;
+  STable->used = 0;
+}
+
+static size_t STCapacity(swissTable *STable) {
+  return STable->ctrl ? (STable->mask + 1) * k_group_width : 0;
+}
+
+// Returns the slot index of the key, or -1
+static size_t STFind(swissTable *STable, hashTableNode *key,
+                     bool (*eq)(hashTableNode *, hashTableNode *)) {
+  if (!STable->ctrl) {
+    return (size_t)-1;
+  }
+  uint8_t tag = h2(key->hash_value);
+  size_t group = h1(key->hash_value) & STable->mask;
+  for (size_t step = 1; step <= STable->mask + 1; step++) {
+    const uint8_t *ctrl = &STable->ctrl[group * k_group_width];
+    for (uint32_t m = groupMatch(ctrl, tag); m; m &= m - 1) {
+      size_t idx = group * k_group_width + __builtin_ctz(m);
+      hashTableNode *cur = STable->slots[idx];
+      if (cur->hash_value == key->hash_value && eq(cur, key)) {
+        return idx;
+      }
+    }
+    // An EMPTY slot ends the probe sequence: the key would have been put here
+    if (groupMatch(ctrl, k_ctrl_empty)) {
+      return (size_t)-1;
+    }
+    group = (group + step) & STable->mask;
+  }
+  return (size_t)-1;
+}
+
+// The caller makes sure there is a free slot
+static void STInsert(swissTable *STable, hashTableNode *HTNode) {
+  size_t group = h1(HTNode->hash_value) & STable->mask;
+  for (size_t step = 1;; step++) {
+    uint32_t m = groupMatchFree(&STable->ctrl[group * k_group_width]);
+    if (m) {
+      size_t idx = group * k_group_width + __builtin_ctz(m);
+      if (STable->ctrl[idx] == k_ctrl_empty) {
+        STable->used++;
+      }
+      STable->ctrl[idx] = h2(HTNode->hash_value);
+      STable->slots[idx] = HTNode;
+      STable->size++;
+      return;
+    }
+    group = (group + step) & STable->mask;
+  }
+}
+
+static hashTableNode *STRemove(swissTable *STable, size_t idx) {
+  hashTableNode *node = STable->slots[idx];
+  STable->slots[idx] = NULL;
+  STable->size--;
+  // Groups are aligned, so a probe sequence never went past a group with an
+  // EMPTY slot and the slot can become EMPTY again instead of a tombstone
+  const uint8_t *ctrl = &STable->ctrl[idx & ~(k_group_width - 1)];
+  if (groupMatch(ctrl, k_ctrl_empty)) {
+    STable->ctrl[idx] = k_ctrl_empty;
+    STable->used--;
+  } else {
+    STable->ctrl[idx] = k_ctrl_deleted;
+  }
+  return node;
+}
+
+static void STFree(swissTable *STable) {
+  free(STable->ctrl);
+  free(STable->slots);
+  *STable = swissTable();
+}
+
+// Same amount of work per operation as the chained hashMap
+const size_t k_resizing_work = 128;
+// Bound on the empty groups visited per node moved, like the hashMap
+const size_t k_resizing_empty_visits = 10;
+
+static void SMResizeMove(swissMap *SMap, size_t work) {
+  swissTable *prev = &SMap->previous_ST;
+  size_t n = 0;
+  size_t empty_visits = work * k_resizing_empty_visits;
+  while (n < work && prev->size > 0) {
+    size_t group = SMap->resizing_pos;
+    uint32_t m = ~groupMatchFree(&prev->ctrl[group * k_group_width]) & 0xFFFF;
+    if (!m) {
+      // Nothing left in this group, move to the next
+      SMap->resizing_pos++;
+      if (--empty_visits == 0) {
+        break;
+      }
+      continue;
+    }
+    size_t idx = group * k_group_width + __builtin_ctz(m);
+    STInsert(&SMap->current_ST, STRemove(prev, idx));
+    n++;
+  }
+  if (prev->size == 0 && prev->ctrl) {
+    STFree(prev);
+  }
+}
+
+bool SMRehash(swissMap *SMap, size_t work) {
+  SMResizeMove(SMap, work);
+  return SMap->previous_ST.ctrl != NULL;
+}
+
+// Number of groups holding n nodes without going over the maximum load factor
+static size_t STGroupsFor(size_t n) {
+  size_t ngroups = 1;
+  while (ngroups * k_group_width * 7 < n * 8) {
+    ngroups *= 2;
+  }
+  return ngroups;
+}
+
+// Maximum load factor of current_ST (nodes + tombstones), 7/8
+static bool STOverloaded(swissTable *STable, size_t extra) {
+  return (STable->used + extra) * 8 > STCapacity(STable) * 7;
+}
+
+static void SMResizeCreate(swissMap *SMap) {
+  if (SMap->previous_ST.ctrl) {
+    // current_ST filled up before the last resize finished, finish it now
+    while (SMap->previous_ST.size > 0) {
+      SMResizeMove(SMap, k_resizing_work);
+    }
+  }
+  swissTable *cur = &SMap->current_ST;
+  // Mostly tombstones: rehash into a table of the same size to clean them up
+  size_t ngroups = cur->mask + 1;
+  if (cur->size * 2 > STCapacity(cur)) {
+    ngroups *= 2;
+  }
+  SMap->previous_ST = *cur;
+  STInit(cur, ngroups);
+  SMap->resizing_pos = 0;
+}
+
+void SMInsert(swissMap *SMap, hashTableNode *HTNode) {
+  if (!SMap->current_ST.ctrl) {
+    STInit(&SMap->current_ST, 1);
+  }
+  if (STOverloaded(&SMap->current_ST, 1)) {
+    SMResizeCreate(SMap);
+  }
+  STInsert(&SMap->current_ST, HTNode);
+  SMResizeMove(SMap, k_resizing_work);
+}
+
+hashTableNode *SMLookup(swissMap *SMap, hashTableNode *key,
+                        bool (*eq)(hashTableNode *, hashTableNode *)) {
+  SMResizeMove(SMap, k_resizing_work);
+  size_t idx = STFind(&SMap->current_ST, key, eq);
+  if (idx != (size_t)-1) {
+    return SMap->current_ST.slots[idx];
+  }
+  idx = STFind(&SMap->previous_ST, key, eq);
+  return idx != (size_t)-1 ? SMap->previous_ST.slots[idx] : NULL;
+}
+
+// Keys handled per round of prefetches, as in the hashMap
+const size_t k_lookup_batch = 16;
+
+// The control group of every key of a batch is prefetched, then the node of
+// its first fingerprint match, then the keys are looked up
+void SMLookupBatch(swissMap *SMap, hashTableNode *const *keys, size_t n,
+                   hashTableNode **out,
+                   bool (*eq)(hashTableNode *, hashTableNode *)) {
+  SMResizeMove(SMap, k_resizing_work);
+  swissTable *cur = &SMap->current_ST;
+  for (size_t base = 0; base < n; base += k_lookup_batch) {
+    size_t end = base + k_lookup_batch < n ? base + k_lookup_batch : n;
+    if (cur->ctrl) {
+      for (size_t i = base; i < end; i++) {
+        size_t group = h1(keys[i]->hash_value) & cur->mask;
+        __builtin_prefetch(&cur->ctrl[group * k_group_width]);
+        __builtin_prefetch(&cur->slots[group * k_group_width]);
+      }
+      for (size_t i = base; i < end; i++) {
+        size_t group = h1(keys[i]->hash_value) & cur->mask;
+        uint32_t m = groupMatch(&cur->ctrl[group * k_group_width],
+                                h2(keys[i]->hash_value));
+        if (m) {
+          __builtin_prefetch(cur->slots[group * k_group_width +
+                                        __builtin_ctz(m)]);
+        }
+      }
+    }
+    for (size_t i = base; i < end; i++) {
+      size_t idx = STFind(cur, keys[i], eq);
+      if (idx != (size_t)-1) {
+        out[i] = cur->slots[idx];
+        continue;
+      }
+      idx = STFind(&SMap->previous_ST, keys[i], eq);
+      out[i] = idx != (size_t)-1 ? SMap->previous_ST.slots[idx] : NULL;
+    }
+  }
+}
+
+// Shrink once less than 1/8 of the slots are used, into a table at about
+// half of the maximum load factor so it does not grow again right away
+static void SMShrink(swissMap *SMap) {
+  swissTable *cur = &SMap->current_ST;
+  if (SMap->previous_ST.ctrl || cur->mask == 0 ||
+      cur->size * 8 >= STCapacity(cur)) {
+    return;
+  }
+  SMap->previous_ST = *cur;
+  STInit(cur, STGroupsFor(SMap->previous_ST.size * 2));
+  SMap->resizing_pos = 0;
+}
+
+hashTableNode *SMPop(swissMap *SMap, hashTableNode *key,
+                     bool (*eq)(hashTableNode *, hashTableNode *)) {
+  SMResizeMove(SMap, k_resizing_work);
+  hashTableNode *node = NULL;
+  size_t idx = STFind(&SMap->current_ST, key, eq);
+  if (idx != (size_t)-1) {
+    node = STRemove(&SMap->current_ST, idx);
+  } else if ((idx = STFind(&SMap->previous_ST, key, eq)) != (size_t)-1) {
+    node = STRemove(&SMap->previous_ST, idx);
+  }
+  if (node) {
+    SMShrink(SMap);
+  }
+  return node;
+}
+
+// Make room for n nodes in total without going over the maximum load factor
+void SMReserve(swissMap *SMap, size_t n) {
+  size_t ngroups = STGroupsFor(n);
+  swissTable *cur = &SMap->current_ST;
+  if (cur->ctrl && cur->mask + 1 >= ngroups) {
+    return;
+  }
+  while (SMap->previous_ST.ctrl) {
+    SMResizeMove(SMap, k_resizing_work);
+  }
+  if (cur->size == 0) {
+    STFree(cur);
+    STInit(cur, ngroups);
+    return;
+  }
+  SMap->previous_ST = *cur;
+  STInit(cur, ngroups);
+  SMap->resizing_pos = 0;
+}
+
+size_t SMSize(swissMap *SMap) {
+  return SMap->current_ST.size + SMap->previous_ST.size;
+}
+
+static void STForEach(swissTable *STable, void (*f)(hashTableNode *, void *),
+                      void *arg) {
+  for (size_t i = 0; i < STCapacity(STable); i++) {
+    if (!(STable->ctrl[i] & 0x80)) {
+      f(STable->slots[i], arg);
+    }
+  }
+}
+
+void SMForEach(swissMap *SMap, void (*f)(hashTableNode *, void *), void *arg) {
+  STForEach(&SMap->current_ST, f, arg);
+  STForEach(&SMap->previous_ST, f, arg);
+}
+
+// Call f on the nodes whose home is the given group. They all sit on the probe
+// sequence of the group, before the first group with an EMPTY slot.
+static void STScanGroup(swissTable *STable, size_t home,
+                        void (*f)(hashTableNode *, void *), void *arg) {
+  size_t group = home;
+  for (size_t step = 1; step <= STable->mask + 1; step++) {
+    const uint8_t *ctrl = &STable->ctrl[group * k_group_width];
+    for (uint32_t m = ~groupMatchFree(ctrl) & 0xFFFF; m; m &= m - 1) {
+      hashTableNode *node =
+          STable->slots[group * k_group_width + __builtin_ctz(m)];
+      if ((h1(node->hash_value) & STable->mask) == home) {
+        f(node, arg);
+      }
+    }
+    if (groupMatch(ctrl, k_ctrl_empty)) {
+      return;
+    }
+    group = (group + step) & STable->mask;
+  }
+}
+
+// Same as HMScan(), the cursor walks the home groups in reverse binary order.
+// Slots are not stable in an open addressing table, but the home group of a
+// key only depends on its hash.
+size_t SMScan(swissMap *SMap, size_t cursor,
+              void (*f)(hashTableNode *, void *), void *arg) {
+  swissTable *small = &SMap->current_ST;
+  swissTable *large = &SMap->previous_ST;
+  if (!large->ctrl) {
+    if (!small->ctrl) {
+      return 0;
+    }
+    STScanGroup(small, cursor & small->mask, f, arg);
+    return scanCursorNext(cursor, small->mask);
+  }
+  if (small->mask > large->mask) {
+    swissTable *t = small;
+    small = large;
+    large = t;
+  }
+  STScanGroup(small, cursor & small->mask, f, arg);
+  do {
+    STScanGroup(large, cursor & large->mask, f, arg);
+    cursor = scanCursorNext(cursor, large->mask);
+  } while (cursor & (small->mask ^ large->mask));
+  return cursor;
+}
+
+// Groups visited per requested node at most, and empty groups in a row
+// before jumping to another random group
+const size_t k_sample_visits = 10;
+const size_t k_sample_empty_run = 5;
+
+// Same walk as HMSample(), over the groups of both tables
+size_t SMSample(swissMap *SMap, uint64_t *rnd, hashTableNode **out, size_t n) {
+  swissTable *tables[2] = {&SMap->current_ST, &SMap->previous_ST};
+  size_t mask = 0;
+  for (swissTable *STable : tables) {
+    if (STable->ctrl && STable->mask > mask) {
+      mask = STable->mask;
+    }
+  }
+  if (SMSize(SMap) == 0 || n == 0) {
+    return 0;
+  }
+  size_t steps = std::min(n * k_sample_visits, mask + 1);
+  size_t group = wyRand(rnd) & mask;
+  size_t count = 0;
+  size_t empty = 0;
+  for (size_t step = 0; step < steps; step++) {
+    bool found = false;
+    for (swissTable *STable : tables) {
+      if (!STable->ctrl || group > STable->mask) {
+        continue;
+      }
+      const uint8_t *ctrl = &STable->ctrl[group * k_group_width];
+      for (uint32_t m = ~groupMatchFree(ctrl) & 0xFFFF; m; m &= m - 1) {
+        out[count++] = STable->slots[group * k_group_width + __builtin_ctz(m)];
+        found = true;
+        if (count == n) {
+          return count;
+        }
+      }
+    }
+    empty = found ? 0 : empty + 1;
+    if (empty >= k_sample_empty_run && count == 0) {
+      group = wyRand(rnd) & mask;
+      empty = 0;
+    } else {
+      group = (group + 1) & mask;
+    }
+  }
+  return count;
+}
+
+void SMDestroy(swissMap *SMap) {
+  STFree(&SMap->current_ST);
+  STFree(&SMap->previous_ST);
+  *SMap = swissMap();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "HashTable.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Open addressing hash table, an alternative to the chained hashTable.
+// Slots are grouped by 16, each slot has a control byte that is either EMPTY,
+// DELETED or 7 bits of the hash (the fingerprint). A probe compares the
+// fingerprint against a whole group with one SIMD instruction, so most
+// lookups touch one control group and one node.
+struct swissTable {
+  uint8_t *ctrl = NULL;          // control bytes, 16 per group
+  hashTableNode **slots = NULL;  // the nodes
+  size_t mask = 0;               // number of groups - 1
+  size_t size = 0;               // number of nodes
+  size_t used = 0;               // number of nodes + DELETED slots
+};
+
+// Resized progressively like hashMap, nodes are moved from previous_ST to
+// current_ST a few at a time. Shrunk the same way after mass deletions.
+struct swissMap {
+  swissTable current_ST;
+  swissTable previous_ST;
+  size_t resizing_pos = 0; // the next group of previous_ST to move
+};
+
+hashTableNode *SMLookup(swissMap *SMap, hashTableNode *key,
+                        bool (*eq)(hashTableNode *, hashTableNode *));
+// Same as HMLookupBatch()
+void SMLookupBatch(swissMap *SMap, hashTableNode *const *keys, size_t n,
+                   hashTableNode **out,
+                   bool (*eq)(hashTableNode *, hashTableNode *));
+void SMInsert(swissMap *SMap, hashTableNode *HTNode);
+hashTableNode *SMPop(swissMap *SMap, hashTableNode *key,
+                     bool (*eq)(hashTableNode *, hashTableNode *));
+size_t SMSize(swissMap *SMap);
+bool SMRehash(swissMap *SMap, size_t work);
+void SMReserve(swissMap *SMap, size_t n);
+size_t SMScan(swissMap *SMap, size_t cursor,
+              void (*f)(hashTableNode *, void *), void *arg);
+void SMForEach(swissMap *SMap, void (*f)(hashTableNode *, void *), void *arg);
+// Same as HMSample()
+size_t SMSample(swissMap *SMap, uint64_t *rnd, hashTableNode **out, size_t n);
+void SMDestroy(swissMap *SMap);
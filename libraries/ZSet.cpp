@@ -0,0 +1,221 @@
+#include "ZSet.h"
+#include "Common.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ZNode *ZNodeNew(const char *name, size_t len, double score) {
+  // The name is stored right after the node, in the same allocation
+  ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
+  assert(node);
+  AVLNodeInit(&node->tree);
+  node->HTNode.next = NULL;
+  node->HTNode.hash_value = strHash((uint8_t *)name, len);
+  node->score = score;
+  node->len = len;
+  memcpy(&node->name[0], name, len);
+  return node;
+}
+
+void ZNodeDel(ZNode *node) { free(node); }
+
+static size_t min(size_t lhs, size_t rhs) { return lhs < rhs ? lhs : rhs; }
+
+// Compare (score, name) of the node with the given tuple
+static bool zless(AVLNode *lhs, double score, const char *name, size_t len) {
+  ZNode *zl = container_of(lhs, ZNode, tree);
+  if (zl->score != score) {
+    return zl->score < score;
+  }
+  int rv = memcmp(zl->name, name, min(zl->len, len));
+  if (rv != 0) {
+    return rv < 0;
+  }
+  return zl->len < len;
+}
+
+static bool zless(AVLNode *lhs, AVLNode *rhs) {
+  ZNode *zr = container_of(rhs, ZNode, tree);
+  return zless(lhs, zr->score, zr->name, zr->len);
+}
+
+// Insert into the AVL tree, O(log n)
+static void treeAdd(ZSet *zset, ZNode *node) {
+  AVLNode *cur = NULL;
+  AVLNode **from = &zset->tree;
+  while (*from) {
+    cur = *from;
+    from = zless(&node->tree, cur) ? &cur->left : &cur->right;
+  }
+  *from = &node->tree;
+  node->tree.parent = cur;
+  zset->tree = AVLFix(&node->tree);
+}
+
+// Update the score of an existing node: detach, then insert again
+static void zsetUpdate(ZSet *zset, ZNode *node, double score) {
+  if (node->score == score) {
+    return;
+  }
+  zset->tree = AVLDelete(&node->tree);
+  node->score = score;
+  AVLNodeInit(&node->tree);
+  treeAdd(zset, node);
+}
+
+// Add a new (score, name) tuple, or update the score of an existing name.
+// Returns true if the name is new.
+bool ZSetInsert(ZSet *zset, const char *name, size_t len, double score) {
+  ZNode *node = ZSetLookup(zset, name, len);
+  if (node) {
+    zsetUpdate(zset, node, score);
+    return false;
+  }
+  node = ZNodeNew(name, len, score);
+  HMInsert(&zset->HMap, &node->HTNode);
+  treeAdd(zset, node);
+  zset->bytes += sizeof(ZNode) + len;
+  return true;
+}
+
+// A helper structure for the hashtable lookup
+struct HKey {
+  hashTableNode HTNode;
+  const char *name = NULL;
+  size_t len = 0;
+};
+
+static bool hcmp(hashTableNode *node, hashTableNode *key) {
+  ZNode *znode = container_of(node, ZNode, HTNode);
+  HKey *hkey = container_of(key, HKey, HTNode);
+  if (znode->len != hkey->len) {
+    return false;
+  }
+  return 0 == memcmp(znode->name, hkey->name, znode->len);
+}
+
+// Lookup by name, O(1)
+ZNode *ZSetLookup(ZSet *zset, const char *name, size_t len) {
+  if (!zset->tree) {
+    return NULL;
+  }
+  HKey key;
+  key.HTNode.hash_value = strHash((uint8_t *)name, len);
+  key.name = name;
+  key.len = len;
+  hashTableNode *found = HMLookup(&zset->HMap, &key.HTNode, &hcmp);
+  return found ? container_of(found, ZNode, HTNode) : NULL;
+}
+
+// Detach a node by name, the caller frees it with ZNodeDel()
+ZNode *ZSetPop(ZSet *zset, const char *name, size_t len) {
+  if (!zset->tree) {
+    return NULL;
+  }
+  HKey key;
+  key.HTNode.hash_value = strHash((uint8_t *)name, len);
+  key.name = name;
+  key.len = len;
+  hashTableNode *found = HMPop(&zset->HMap, &key.HTNode, &hcmp);
+  if (!found) {
+    return NULL;
+  }
+  ZNode *node = container_of(found, ZNode, HTNode);
+  zset->tree = AVLDelete(&node->tree);
+  zset->bytes -= sizeof(ZNode) + node->len;
+  return node;
+}
+
+// Find the first node that is >= (score, name), O(log n)
+ZNode *ZSetQuery(ZSet *zset, double score, const char *name, size_t len) {
+  AVLNode *found = NULL;
+  for (AVLNode *cur = zset->tree; cur;) {
+    if (zless(cur, score, name, len)) {
+      cur = cur->right;
+    } else {
+      // candidate
+      found = cur;
+      cur = cur->left;
+    }
+  }
+  return found ? container_of(found, ZNode, tree) : NULL;
+}
+
+// Find the first node with a score >= score (> score if exclusive)
+ZNode *ZSetSeek(ZSet *zset, double score, bool exclusive) {
+  AVLNode *found = NULL;
+  for (AVLNode *cur = zset->tree; cur;) {
+    double cur_score = container_of(cur, ZNode, tree)->score;
+    if (cur_score < score || (exclusive && cur_score == score)) {
+      cur = cur->right;
+    } else {
+      // candidate
+      found = cur;
+      cur = cur->left;
+    }
+  }
+  return found ? container_of(found, ZNode, tree) : NULL;
+}
+
+size_t ZSetSize(ZSet *zset) { return zset->tree ? zset->tree->st_size : 0; }
+
+// The node at a 0-based rank, O(log n)
+ZNode *ZSetAt(ZSet *zset, int64_t rank) {
+  AVLNode *root = zset->tree;
+  if (!root) {
+    return NULL;
+  }
+  int64_t root_rank = root->left ? root->left->st_size : 0;
+  AVLNode *found = AVLOffset(root, rank - root_rank);
+  return found ? container_of(found, ZNode, tree) : NULL;
+}
+
+// Jump forward or backward in sorted order, O(log n)
+ZNode *ZNodeOffset(ZNode *node, int64_t offset) {
+  AVLNode *found = node ? AVLOffset(&node->tree, offset) : NULL;
+  return found ? container_of(found, ZNode, tree) : NULL;
+}
+
+int64_t ZNodeRank(ZNode *node) { return AVLRank(&node->tree); }
+
+// The in-order successor
+ZNode *ZNodeNext(ZNode *node) {
+  AVLNode *cur = &node->tree;
+  if (cur->right) {
+    // The leftmost node of the right subtree
+    cur = cur->right;
+    while (cur->left) {
+      cur = cur->left;
+    }
+    return container_of(cur, ZNode, tree);
+  }
+  // The first ancestor whose left subtree contains the node
+  while (cur->parent && cur->parent->right == cur) {
+    cur = cur->parent;
+  }
+  return cur->parent ? container_of(cur->parent, ZNode, tree) : NULL;
+}
+
+static void treeDispose(AVLNode *node) {
+  if (!node) {
+    return;
+  }
+  treeDispose(node->left);
+  treeDispose(node->right);
+  ZNodeDel(container_of(node, ZNode, tree));
+}
+
+// Destroy the sorted set and free every node
+void ZSetDispose(ZSet *zset) {
+  treeDispose(zset->tree);
+  HMDestroy(&zset->HMap);
+  zset->tree = NULL;
+  zset->bytes = 0;
+}
+
+size_t ZSetMemory(const ZSet *zset) {
+  const hashMap &HMap = zset->HMap;
+  size_t slots = (HMap.current_HT.table ? HMap.current_HT.mask + 1 : 0) +
+                 (HMap.previous_HT.table ? HMap.previous_HT.mask + 1 : 0);
+  return sizeof(ZSet) + zset->bytes + slots * sizeof(hashTableNode *);
+}
@@ -3,9 +3,12 @@
 #include "AVL.h"
 #include "HashTable.h"
 
+// Sorted set: the AVL tree orders the nodes by (score, name), the hash map
+// finds a node by name
 struct ZSet {
   AVLNode *tree = NULL;
-  HashMap HMap;
+  hashMap HMap;
+  size_t bytes = 0; // memory of the nodes
 };
 
 struct ZNode {
@@ -14,4 +17,19 @@ struct ZNode {
   double score = 0;
   size_t len = 0;
   char name[0];
-}
+};
+
+bool ZSetInsert(ZSet *zset, const char *name, size_t len, double score);
+ZNode *ZSetLookup(ZSet *zset, const char *name, size_t len);
+ZNode *ZSetPop(ZSet *zset, const char *name, size_t len);
+ZNode *ZSetQuery(ZSet *zset, double score, const char *name, size_t len);
+ZNode *ZSetSeek(ZSet *zset, double score, bool exclusive);
+ZNode *ZSetAt(ZSet *zset, int64_t rank);
+size_t ZSetSize(ZSet *zset);
+// Bytes used by the sorted set, its nodes and its hash table
+size_t ZSetMemory(const ZSet *zset);
+ZNode *ZNodeNext(ZNode *node);
+ZNode *ZNodeOffset(ZNode *node, int64_t offset);
+int64_t ZNodeRank(ZNode *node);
+void ZNodeDel(ZNode *node);
+void ZSetDispose(ZSet *zset);
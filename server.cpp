@@ -1,31 +1,78 @@
+#include "libraries/AOF.h"
+#include "libraries/Buffer.h"
 #include "libraries/Common.h"
+#include "libraries/Entry.h"
 #include "libraries/HashTable.h"
+#include "libraries/Heap.h"
 #include "libraries/HelperLibrary.h"
+#include "libraries/Histogram.h"
+#include "libraries/RDB.h"
+#include "libraries/SwissTable.h"
+#include "libraries/ZSet.h"
 #include <arpa/inet.h>
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <charconv>
+#include <cmath>
 #include <cstddef>
 #include <errno.h>
 #include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <netinet/ip.h>
+#include <new>
 #include <poll.h>
+#include <random>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define HAVE_EPOLL 1
+#endif
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
 
-const size_t k_max_msg = 4096;
+const size_t k_max_msg = 32 << 20;
+// Free space reserved in rbuf before each read()
+const size_t k_read_chunk = 4096;
+// Buffers of an idle connection larger than this are released
+const size_t k_idle_buf_cap = 4096;
+// A batch stops taking requests once its responses reach this size, the rest
+// of rbuf is handled after the batch is sent
+const size_t k_wbuf_high_water = 1 << 20;
+// Closed connections kept per shard for reuse, so a reconnect storm does not
+// allocate a Conn (and its buffers) for every accept
+const size_t k_conn_pool_max = 1024;
+// Connections accepted per event loop iteration at most, so a reconnect storm
+// cannot starve the established connections
+const size_t k_accept_budget = 128;
 
 // Conn preparation for state machine
 enum {
   STATE_REQ = 0,
   STATE_RES = 1,
   STATE_END = 2, // deletion for a connection
+  // Parked until other shards have run its command, no IO meanwhile
+  STATE_WAIT = 3,
 };
 
 enum {
@@ -37,52 +84,416 @@ enum {
 enum {
   ERR_UNKNOWN = 1,
   ERR_2BIG = 2,
+  ERR_ARG = 3,  // wrong number of arguments
+  ERR_TYPE = 4, // the key holds another type
+  ERR_OOM = 5,  // over maxmemory, and nothing can be evicted
 };
 
+struct Pending;
+
 struct Conn {
   int fd = -1;
-  uint32_t state = 0; // STATE_REQ or STATE_RES
-  // buffer for reading
-  // rbuf_size: the current amount of data already in the buffer
-  size_t rbuf_size = 0;
-  uint8_t rbuf[4 + k_max_msg];
-  // buffer for writing
-  // wbuf_size: the current amount of data already in the buffer
-  size_t wbuf_size = 0;
-  size_t wbuf_sent = 0;
-  uint8_t wbuf[4 + k_max_msg];
+  uint32_t state = 0; // STATE_REQ, STATE_RES or STATE_WAIT
+  // buffer for reading, requests are parsed from its head
+  Buffer rbuf;
+  // buffer for writing, the batched responses are sent from its head
+  Buffer wbuf;
+  // Reused for every request: the arguments are views into rbuf, and the
+  // response is serialized into out before it is copied into wbuf
+  std::vector<std::string_view> args;
+  std::string out;
+  // The forwarded command of STATE_WAIT, allocated on the first one and kept
+  Pending *pending = NULL;
+  // In local_data->ready, see stateReq()
+  bool ready = false;
 };
 
-// Structure for the key
-struct Entry {
-  struct hashTableNode HTNode;
+// Event loop backends, chosen at startup
+enum {
+  LOOP_POLL = 0,     // poll(), the fd set is rebuilt on every iteration
+  LOOP_EPOLL_LT = 1, // epoll, level-triggered
+  LOOP_EPOLL_ET = 2, // epoll, edge-triggered
+};
+
+// Keyspace hash table engines, chosen at startup
+enum {
+  ENGINE_CHAIN = 0, // hashMap, chaining with a linked list per slot
+  ENGINE_SWISS = 1, // swissMap, open addressing probed with SIMD
+};
+
+// What to do when a write needs memory over maxmemory, like Redis'
+// maxmemory-policy with the allkeys-* policies
+enum {
+  EVICT_NONE = 0,   // noeviction: the write fails with ERR_OOM
+  EVICT_LRU = 1,    // the least recently used of the sampled keys
+  EVICT_LFU = 2,    // the least frequently used of the sampled keys
+  EVICT_RANDOM = 3, // any key
+};
+
+// Entry::lru is a 24-bit clock in seconds, it wraps after 194 days
+const uint32_t k_lru_clock_max = (1 << 24) - 1;
+// The LFU counter of a new key, so it is not the first one evicted
+const uint8_t k_lfu_init_val = 5;
+// How fast the LFU counter saturates: with 10, 255 takes about a million hits
+const uint32_t k_lfu_log_factor = 10;
+// The LFU counter is decremented once per period without an access
+const uint32_t k_lfu_decay_s = 60;
+
+// Power of two latency buckets per command: bucket i counts the calls that
+// took less than 2^i ns (and at least 2^(i-1)), the last one everything above
+const size_t k_latency_buckets = 40;
+
+// Per-command counters, indexed by the position in k_commands
+struct CommandStats {
+  uint64_t calls = 0;
+  uint64_t ns = 0; // total time spent in the command
+  uint64_t latency[k_latency_buckets] = {};
+};
+
+// Upper bound on the number of registered commands (checked against
+// k_commands), so the per-command slots can live in global_data
+const size_t k_max_commands = 64;
+
+struct Command;
+
+// Counters of one shard. They are plain increments by the shard's own thread,
+// INFO gets a copy of them through the shard's inbox instead of reading them
+// from another thread.
+struct ShardStats {
+  uint64_t connections_received = 0;
+  uint64_t connected_clients = 0;
+  uint64_t net_input_bytes = 0;
+  uint64_t net_output_bytes = 0;
+  uint64_t commands = 0;
+  uint64_t evicted_keys = 0;
+  // Latency of every command, in ns
+  Histogram latency;
+  CommandStats cmds[k_max_commands];
+  // Commands per second, sampled about once per k_ops_sample_ms
+  uint64_t sample_ms = 0;
+  uint64_t sample_commands = 0;
+  uint64_t ops_per_sec = 0;
+};
+
+struct Shard;
+
+// A command handed over to the shard that owns its key. The sender parks the
+// connection instead of waiting, so the argument views into its rbuf stay
+// valid and nothing has to be copied. Once the command has run, the Forward is
+// posted back to the sender's inbox.
+struct Forward {
+  const Command *c = NULL;
+  std::vector<std::string_view> *cmd = NULL;
+  std::string *out = NULL;
+  Shard *from = NULL;
+  Pending *pending = NULL;
+  bool done = false; // posted back with the reply in out
+};
+
+// The command of a parked connection: a Forward per shard it went to, and how
+// the replies are merged once the last one is back
+struct Pending {
+  Conn *conn = NULL;
+  const Command *c = NULL;
+  uint64_t start_ns = 0;
+  size_t waiting = 0; // Forwards not back yet
+  std::vector<Forward> forwards;
+  std::vector<std::string> parts; // the reply of every shard
+  // Multi-key commands: the arguments for each shard, and where their keys
+  // are in the command
+  std::vector<std::vector<std::string_view>> subs;
+  std::vector<std::vector<uint32_t>> positions;
+  void (*finish)(Pending *p, std::vector<std::string_view> &cmd,
+                 std::string &out) = NULL;
+};
+
+// Arguments kept per slow log entry at most, and bytes kept per argument
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+
+// A command that took at least global_data.slowlog_slower_than_us
+struct SlowlogEntry {
+  uint64_t id = 0;
+  int64_t time = 0; // unix seconds
+  uint64_t duration_us = 0;
+  int client_fd = -1;
+  // The truncated arguments, including the command name
+  std::vector<std::string> args;
+};
+
+// Eviction candidates kept between evictions, the best of all the samples
+const size_t k_evict_pool_size = 16;
+
+// A key that may be evicted next, kept by name since it can be deleted or
+// modified before it is picked
+struct EvictCandidate {
+  uint64_t idle = 0; // the larger the better: idle time, or 255 - LFU counter
   std::string key;
-  std::string value;
 };
 
-static struct {
+// Everything owned by one event loop thread. The keyspace is only accessed by
+// its own thread, other threads can only push to the inbox.
+struct Shard {
+  uint32_t id = 0;
+  // The keyspace, only one of them is used depending on global_data.engine
   hashMap HMap;
+  swissMap SMap;
+  // Memory of the entries
+  Slab slab;
+  // Closed connections ready for reuse, see k_conn_pool_max
+  std::vector<Conn *> conn_pool;
+  // Expiration times (monotonic ms) of the keys with a TTL
+  std::vector<HeapItem> heap;
+  ShardStats stats;
+  // EntryMemory() of all the keys, this shard's part of maxmemory
+  size_t used_memory = 0;
+  // The LRU clock (s) of the accesses, read once per event loop iteration
+  uint32_t lru_clock = 0;
+  // Eviction candidates sorted by idle, the best one last
+  std::vector<EvictCandidate> evict_pool;
+  uint64_t rand_state = 0; // wyRand()
+  int epoll_fd = -1;
+  // Commands forwarded by other shards, and the replies to the ones this
+  // shard forwarded. Writing to wake_fds[1] wakes up the event loop when the
+  // inbox becomes non-empty.
+  std::mutex inbox_mu;
+  std::vector<Forward *> inbox;
+  int wake_fds[2] = {-1, -1};
+  // Parked connections whose replies are all back, resumed by the event loop
+  std::vector<Conn *> resumed;
+  // Edge-triggered epoll: connections that may have more to read
+  std::vector<Conn *> ready;
+};
+
+static struct {
+  uint32_t loop_mode = LOOP_POLL;
+  uint32_t engine = ENGINE_CHAIN;
+  // Snapshot file, loaded at startup and written by SAVE / BGSAVE
+  std::string rdb_path = "dump.rdb";
+  // Threads loading the snapshot, 0 for one per core
+  uint32_t load_threads = 0;
+  // The BGSAVE child, -1 if none is running
+  pid_t bgsave_pid = -1;
+  // Append-only file, replayed at startup instead of the snapshot when enabled
+  bool appendonly = false;
+  std::string aof_path = "appendonly.aof";
+  uint32_t aof_fsync = AOF_FSYNC_EVERYSEC;
+  AOF aof;
+  // Replaying the append-only file: the log already has the DELs of the
+  // evictions, so the writes must not evict keys of their own
+  bool aof_loading = false;
+  // The BGREWRITEAOF child, -1 if none is running
+  pid_t aof_rewrite_pid = -1;
+  // One shard (and event loop thread) per core in the shared-nothing mode
+  uint32_t nthreads = 1;
+  std::vector<Shard *> shards;
+  // Monotonic ms at startup, for the uptime
+  uint64_t start_ms = 0;
+  // Memory limit of the keys in bytes, 0 for none. Every shard gets an equal
+  // share, and evicts its own keys when a write puts it over.
+  size_t maxmemory = 0;
+  uint32_t maxmemory_policy = EVICT_NONE;
+  // Keys sampled per eviction
+  size_t maxmemory_samples = 5;
+  // Commands taking at least this long (us) are kept in the slow log, a
+  // negative value disables it
+  int64_t slowlog_slower_than_us = 10000;
+  // The slow log, a ring of the last slowlog_max_len slow commands shared by
+  // the shards. Only a slow command takes the lock.
+  size_t slowlog_max_len = 128;
+  std::mutex slowlog_mu;
+  std::vector<SlowlogEntry> slowlog;
+  uint64_t slowlog_next_id = 0;
+  uint64_t slowlog_first_id = 0; // entries before it were reset
 } global_data;
 
-static bool entryEQ(hashTableNode *lhs, hashTableNode *rhs) {
-  struct Entry *le = container_of(lhs, struct Entry, HTNode);
-  struct Entry *re = container_of(rhs, struct Entry, HTNode);
-  return le->key == re->key;
+// The shard of the current thread
+static thread_local Shard *local_data = NULL;
+
+// A borrowed key for lookups, so the request bytes don't need to be copied
+struct LookupKey {
+  struct hashTableNode HTNode;
+  std::string_view key;
+};
+
+static bool entryEQ(hashTableNode *node, hashTableNode *key) {
+  struct Entry *ent = container_of(node, struct Entry, HTNode);
+  struct LookupKey *lookup = container_of(key, struct LookupKey, HTNode);
+  return EntryKey(ent) == lookup->key;
+}
+
+// Removes a node we already hold a pointer to
+static bool hashNodeSame(hashTableNode *node, hashTableNode *key) {
+  return node == key;
+}
+
+// The keyspace of the current shard, dispatched to the engine chosen at startup
+static hashTableNode *keyspaceLookup(hashTableNode *key,
+                                     bool (*eq)(hashTableNode *,
+                                                hashTableNode *)) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMLookup(&local_data->SMap, key, eq);
+  }
+  return HMLookup(&local_data->HMap, key, eq);
+}
+
+static void keyspaceLookupBatch(hashTableNode *const *keys, size_t n,
+                                hashTableNode **out,
+                                bool (*eq)(hashTableNode *, hashTableNode *)) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMLookupBatch(&local_data->SMap, keys, n, out, eq);
+  }
+  HMLookupBatch(&local_data->HMap, keys, n, out, eq);
+}
+
+static void keyspaceInsert(hashTableNode *HTNode) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMInsert(&local_data->SMap, HTNode);
+  }
+  HMInsert(&local_data->HMap, HTNode);
+}
+
+static hashTableNode *keyspacePop(hashTableNode *key,
+                                  bool (*eq)(hashTableNode *,
+                                             hashTableNode *)) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMPop(&local_data->SMap, key, eq);
+  }
+  return HMPop(&local_data->HMap, key, eq);
+}
+
+static void keyScan(hashTable *HTable, void (*f)(hashTableNode *, void *),
+                    void *arg);
+static void keyspaceForEach(void (*f)(hashTableNode *, void *), void *arg) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMForEach(&local_data->SMap, f, arg);
+  }
+  keyScan(&local_data->HMap.current_HT, f, arg);
+  keyScan(&local_data->HMap.previous_HT, f, arg);
+}
+
+static size_t keyspaceSize() {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMSize(&local_data->SMap);
+  }
+  return HMSize(&local_data->HMap);
+}
+
+static void keyspaceReserve(size_t n) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMReserve(&local_data->SMap, n);
+  }
+  HMReserve(&local_data->HMap, n);
+}
+
+static bool keyspaceRehash(size_t work) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMRehash(&local_data->SMap, work);
+  }
+  return HMRehash(&local_data->HMap, work);
+}
+
+static size_t keyspaceSample(hashTableNode **out, size_t n) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMSample(&local_data->SMap, &local_data->rand_state, out, n);
+  }
+  return HMSample(&local_data->HMap, &local_data->rand_state, out, n);
 }
 
+static size_t keyspaceScan(size_t cursor, void (*f)(hashTableNode *, void *),
+                           void *arg) {
+  if (global_data.engine == ENGINE_SWISS) {
+    return SMScan(&local_data->SMap, cursor, f, arg);
+  }
+  return HMScan(&local_data->HMap, cursor, f, arg);
+}
+
+struct KeysArg {
+  std::string *out = NULL;
+  uint32_t n = 0;
+  uint64_t now_ms = 0;
+  // SCAN MATCH pattern, empty for all keys
+  std::string_view pattern;
+};
+
 // static void serverDo(int client_fd);
 static void setFdToNonblock(int fd);
 static int32_t newConnection(std::vector<Conn *> &fd2conn, int server_fd);
 static void connectionIO(Conn *conn);
-int main() {
+static bool parseArgs(int argc, char **argv);
+static void pollLoop(std::vector<Conn *> &fd2conn, int server_fd);
+static void epollLoop(std::vector<Conn *> &fd2conn, int server_fd);
+static void shardMain(Shard *shard);
+static bool rdbLoad(const char *path);
+static bool aofStart();
+static uint64_t getMonotonicMsec();
+int main(int argc, char **argv) {
   // Flush after every std::cout / std::cerr
   std::cout << std::unitbuf;
   std::cerr << std::unitbuf;
 
+  if (!parseArgs(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--loop poll|epoll|epoll-et] [--threads N]"
+                 " [--engine chain|swiss] [--dbfilename path]"
+                 " [--load-threads N]"
+                 " [--appendonly yes|no] [--appendfilename path]"
+                 " [--appendfsync always|everysec|no]"
+                 " [--slowlog-log-slower-than us] [--slowlog-max-len N]"
+                 " [--maxmemory bytes[kb|mb|gb]]"
+                 " [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|"
+                 "allkeys-random] [--maxmemory-samples N]\n";
+    return 1;
+  }
+  global_data.start_ms = getMonotonicMsec();
+  if (global_data.appendonly && global_data.nthreads > 1) {
+    HelperLibrary::MsgHelpers::die(
+        "--appendonly is not supported with --threads!");
+  }
+
+  // Before any key is hashed
+  std::random_device rd;
+  strHashSeed(((uint64_t)rd() << 32) | rd());
+
+  for (uint32_t i = 0; i < global_data.nthreads; i++) {
+    Shard *shard = new Shard();
+    shard->id = i;
+    shard->rand_state = ((uint64_t)rd() << 32) | rd();
+    shard->lru_clock =
+        (uint32_t)(global_data.start_ms / 1000) & k_lru_clock_max;
+    if (pipe(shard->wake_fds) != 0) {
+      HelperLibrary::MsgHelpers::die("Failed to create the wake up pipe!");
+    }
+    setFdToNonblock(shard->wake_fds[0]);
+    setFdToNonblock(shard->wake_fds[1]);
+    global_data.shards.push_back(shard);
+  }
+
+  // The shards are filled before their threads start
+  if (global_data.appendonly) {
+    if (!aofStart()) {
+      HelperLibrary::MsgHelpers::die("Failed to load the append-only file!");
+    }
+  } else if (!rdbLoad(global_data.rdb_path.c_str())) {
+    HelperLibrary::MsgHelpers::die("Failed to load the snapshot!");
+  }
+
+  // Shard 0 runs on the main thread
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < global_data.nthreads; i++) {
+    threads.emplace_back(shardMain, global_data.shards[i]);
+  }
+  shardMain(global_data.shards[0]);
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  return 0;
+}
+
+static int createListener() {
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
     HelperLibrary::MsgHelpers::die("Fail to create socket object!");
-    return 1;
   }
 
   // Configure the socket
@@ -90,7 +501,13 @@ int main() {
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) <
       0) {
     HelperLibrary::MsgHelpers::die("setsockopt failed!");
-    return 1;
+  }
+  // Every shard binds its own listener to the same port, the kernel spreads
+  // the incoming connections between them
+  if (global_data.nthreads > 1 &&
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) <
+          0) {
+    HelperLibrary::MsgHelpers::die("setsockopt(SO_REUSEPORT) failed!");
   }
 
   struct sockaddr_in server_addr = {};
@@ -101,22 +518,263 @@ int main() {
   if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) !=
       0) {
     HelperLibrary::MsgHelpers::die("Failed to bind to port 1234");
-    return 1;
   }
 
   if (listen(server_fd, SOMAXCONN) != 0) {
     HelperLibrary::MsgHelpers::die("Failed to bind to port 1234");
-    return 1;
   }
 
+  // Set the listening fd to nonblocking mode
+  setFdToNonblock(server_fd);
+  return server_fd;
+}
+
+static int createListener();
+static void shardMain(Shard *shard) {
+  local_data = shard;
+  int server_fd = createListener();
+
   // A map of all client connection, index is the fd.
   // If there is no enough idex for the fd in new connection, should resize the
   // vector;
   std::vector<Conn *> fd2conn;
 
-  // Set the listening fd to nonblocking mode
-  setFdToNonblock(server_fd);
+  if (global_data.loop_mode == LOOP_POLL) {
+    pollLoop(fd2conn, server_fd);
+  } else {
+    epollLoop(fd2conn, server_fd);
+  }
+}
+
+// A byte count with an optional kb / mb / gb suffix (powers of 1024)
+static bool parseMemory(const char *arg, size_t *out) {
+  // strtoull() would take "-1" as the largest value
+  if (arg[0] < '0' || arg[0] > '9') {
+    return false;
+  }
+  char *end = NULL;
+  errno = 0;
+  unsigned long long n = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg) {
+    return false;
+  }
+  unsigned long long unit = 1;
+  if (strcasecmp(end, "kb") == 0) {
+    unit = 1ull << 10;
+  } else if (strcasecmp(end, "mb") == 0) {
+    unit = 1ull << 20;
+  } else if (strcasecmp(end, "gb") == 0) {
+    unit = 1ull << 30;
+  } else if (*end != '\0') {
+    return false;
+  }
+  if (n > SIZE_MAX / unit) {
+    return false;
+  }
+  *out = (size_t)(n * unit);
+  return true;
+}
+
+// Command line options:
+//   --loop poll|epoll|epoll-et  event loop backend (default: epoll on Linux)
+//   --threads N                 number of shards / event loop threads
+//   --engine chain|swiss        keyspace hash table (default: chain)
+//   --dbfilename path           snapshot file (default: dump.rdb)
+//   --load-threads N            threads loading the snapshot (default: cores)
+//   --appendonly yes|no         log the write commands (default: no)
+//   --appendfilename path       append-only file (default: appendonly.aof)
+//   --appendfsync always|everysec|no
+//                               when the log is fsynced (default: everysec)
+//   --slowlog-log-slower-than us
+//                               slow log threshold, negative to disable
+//                               (default: 10000)
+//   --slowlog-max-len N         slow log entries kept (default: 128)
+//   --maxmemory bytes[kb|mb|gb] memory limit of the keys (default: 0, none)
+//   --maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|allkeys-random
+//                               what a write over the limit does
+//                               (default: noeviction)
+//   --maxmemory-samples N       keys sampled per eviction (default: 5)
+static bool parseArgs(int argc, char **argv) {
+#if HAVE_EPOLL
+  global_data.loop_mode = LOOP_EPOLL_LT;
+#endif
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc) {
+      const char *mode = argv[++i];
+      if (strcmp(mode, "poll") == 0) {
+        global_data.loop_mode = LOOP_POLL;
+      } else if (strcmp(mode, "epoll") == 0) {
+        global_data.loop_mode = LOOP_EPOLL_LT;
+      } else if (strcmp(mode, "epoll-et") == 0) {
+        global_data.loop_mode = LOOP_EPOLL_ET;
+      } else {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 256) {
+        return false;
+      }
+      global_data.nthreads = (uint32_t)n;
+    } else if (strcmp(argv[i], "--dbfilename") == 0 && i + 1 < argc) {
+      global_data.rdb_path = argv[++i];
+    } else if (strcmp(argv[i], "--load-threads") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 256) {
+        return false;
+      }
+      global_data.load_threads = (uint32_t)n;
+    } else if (strcmp(argv[i], "--appendonly") == 0 && i + 1 < argc) {
+      const char *on = argv[++i];
+      if (strcmp(on, "yes") == 0) {
+        global_data.appendonly = true;
+      } else if (strcmp(on, "no") == 0) {
+        global_data.appendonly = false;
+      } else {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--appendfilename") == 0 && i + 1 < argc) {
+      global_data.aof_path = argv[++i];
+    } else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc) {
+      const char *policy = argv[++i];
+      if (strcmp(policy, "always") == 0) {
+        global_data.aof_fsync = AOF_FSYNC_ALWAYS;
+      } else if (strcmp(policy, "everysec") == 0) {
+        global_data.aof_fsync = AOF_FSYNC_EVERYSEC;
+      } else if (strcmp(policy, "no") == 0) {
+        global_data.aof_fsync = AOF_FSYNC_NO;
+      } else {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      const char *engine = argv[++i];
+      if (strcmp(engine, "chain") == 0) {
+        global_data.engine = ENGINE_CHAIN;
+      } else if (strcmp(engine, "swiss") == 0) {
+        global_data.engine = ENGINE_SWISS;
+      } else {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--slowlog-log-slower-than") == 0 &&
+               i + 1 < argc) {
+      global_data.slowlog_slower_than_us = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--slowlog-max-len") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 0) {
+        return false;
+      }
+      global_data.slowlog_max_len = (size_t)n;
+    } else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+      if (!parseMemory(argv[++i], &global_data.maxmemory)) {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc) {
+      const char *policy = argv[++i];
+      if (strcmp(policy, "noeviction") == 0) {
+        global_data.maxmemory_policy = EVICT_NONE;
+      } else if (strcmp(policy, "allkeys-lru") == 0) {
+        global_data.maxmemory_policy = EVICT_LRU;
+      } else if (strcmp(policy, "allkeys-lfu") == 0) {
+        global_data.maxmemory_policy = EVICT_LFU;
+      } else if (strcmp(policy, "allkeys-random") == 0) {
+        global_data.maxmemory_policy = EVICT_RANDOM;
+      } else {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--maxmemory-samples") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > (int)k_evict_pool_size) {
+        return false;
+      }
+      global_data.maxmemory_samples = (size_t)n;
+    } else {
+      return false;
+    }
+  }
+#if !HAVE_EPOLL
+  if (global_data.loop_mode != LOOP_POLL) {
+    HelperLibrary::MsgHelpers::error(
+        "epoll is not available on this platform, falling back to poll().");
+    global_data.loop_mode = LOOP_POLL;
+  }
+#endif
+  return true;
+}
+
+static void connDestroy(std::vector<Conn *> &fd2conn, Conn *conn) {
+  // Other shards still read the arguments in rbuf
+  assert(!conn->pending || conn->pending->waiting == 0);
+  fd2conn[conn->fd] = NULL;
+  local_data->stats.connected_clients--;
+#if HAVE_EPOLL
+  // Closing the fd is not enough while a BGSAVE child holds a copy of it, the
+  // open file would stay in the epoll interest list
+  if (global_data.loop_mode != LOOP_POLL) {
+    (void)epoll_ctl(local_data->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  }
+#endif
+  close(conn->fd);
+  conn->fd = -1;
+  if (conn->ready) {
+    std::vector<Conn *> &ready = local_data->ready;
+    ready.erase(std::find(ready.begin(), ready.end(), conn));
+    conn->ready = false;
+  }
+  std::vector<Conn *> &pool = local_data->conn_pool;
+  if (pool.size() >= k_conn_pool_max) {
+    BufFree(&conn->rbuf);
+    BufFree(&conn->wbuf);
+    delete conn->pending;
+    delete conn;
+    return;
+  }
+  // Keep small buffers, the next connection starts with them
+  BufConsume(&conn->rbuf, BufSize(&conn->rbuf));
+  BufConsume(&conn->wbuf, BufSize(&conn->wbuf));
+  BufShrink(&conn->rbuf, k_idle_buf_cap);
+  BufShrink(&conn->wbuf, k_idle_buf_cap);
+  conn->args.clear();
+  conn->out.clear();
+  if (conn->out.capacity() > k_idle_buf_cap) {
+    std::string().swap(conn->out);
+  }
+  pool.push_back(conn);
+}
+
+// A Conn from the pool, or a new one
+static Conn *connAlloc() {
+  std::vector<Conn *> &pool = local_data->conn_pool;
+  if (pool.empty()) {
+    return new (std::nothrow) Conn();
+  }
+  Conn *conn = pool.back();
+  pool.pop_back();
+  return conn;
+}
+
+// Accept at most k_accept_budget connections. Returns true if the budget ran
+// out before the backlog was drained.
+static int32_t newConnection(std::vector<Conn *> &fd2conn, int server_fd);
+static bool acceptConnections(std::vector<Conn *> &fd2conn, int server_fd) {
+  for (size_t i = 0; i < k_accept_budget; i++) {
+    if (newConnection(fd2conn, server_fd) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
 
+static void connDestroy(std::vector<Conn *> &fd2conn, Conn *conn);
+static bool acceptConnections(std::vector<Conn *> &fd2conn, int server_fd);
+static void shardWakeUp(Shard *shard);
+static int32_t nextTimerMs();
+static void processTimers();
+static bool processRehash();
+static void statsSample();
+static void childCheck();
+static void aofFlush();
+static void connResume(Conn *conn);
+static void pollLoop(std::vector<Conn *> &fd2conn, int server_fd) {
   // The event loop using poll()
   /*
    * struct pollfd {
@@ -126,6 +784,9 @@ int main() {
    * }
    */
   std::vector<struct pollfd> poll_args;
+  // While the keyspace is being resized the loop does not sleep, the idle
+  // iterations finish the resize
+  bool rehash_pending = false;
   while (true) {
     poll_args.clear();
     // put the server fd in the first one
@@ -133,9 +794,14 @@ int main() {
         server_fd, POLLIN,
         0}; // event: if there is data to read on this one (connection request)
     poll_args.push_back(server_pollfd);
+    // the second one wakes up the loop for commands forwarded by other shards
+    struct pollfd wake_pollfd = {local_data->wake_fds[0], POLLIN, 0};
+    poll_args.push_back(wake_pollfd);
 
     for (Conn *conn : fd2conn) {
-      if (!conn) {
+      // A parked connection is left out, a hang up would be reported on
+      // every iteration until it is resumed
+      if (!conn || conn->state == STATE_WAIT) {
         continue;
       }
       struct pollfd pfd = {};
@@ -148,35 +814,220 @@ int main() {
     // arg1: gets a pointer to the underlying array of pollfd structures stored
     // in the poll_args vector. nfds_t: unsigned long int, it's the size of
     // poll_args
-    int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
+    // The timeout wakes up the loop for the nearest key expiration
+    int rv = poll(poll_args.data(), (nfds_t)poll_args.size(),
+                  rehash_pending ? 0 : nextTimerMs());
     if (rv < 0) {
       HelperLibrary::MsgHelpers::die(
           "There is something wrong in the function poll()!");
     }
 
-    // start from 1 cuz the first one is server_fd
-    for (size_t i = 1; i < poll_args.size(); i++) {
+    if (poll_args[1].revents) {
+      shardWakeUp(local_data);
+    }
+
+    // start from 2 cuz the first two are server_fd and the wake up pipe
+    for (size_t i = 2; i < poll_args.size(); i++) {
       if (poll_args[i].revents) {
         Conn *conn = fd2conn[poll_args[i].fd];
         connectionIO(conn);
         if (conn->state == STATE_END) {
           // Destroy this connection
-          fd2conn[conn->fd] = NULL;
-          close(conn->fd);
-          free(conn);
+          connDestroy(fd2conn, conn);
         }
       }
     }
 
-    // Try to accept a new connection
+    // The parked connections whose commands are done
+    std::vector<Conn *> resumed;
+    resumed.swap(local_data->resumed);
+    for (Conn *conn : resumed) {
+      connResume(conn);
+      if (conn->state == STATE_END) {
+        connDestroy(fd2conn, conn);
+      }
+    }
+
+    // Accept new connections, poll() reports the rest of the backlog again
+    // if the budget runs out
     if (poll_args[0].revents) {
-      (void)newConnection(fd2conn, server_fd);
+      (void)acceptConnections(fd2conn, server_fd);
+    }
+
+    processTimers();
+    // Nothing happened, spend the time on the resize. Under load the
+    // operations themselves move the nodes.
+    if (rv == 0) {
+      rehash_pending = processRehash();
     }
+    statsSample();
+    childCheck();
+    // Group commit: one write() for the commands of the whole iteration
+    aofFlush();
   }
+}
 
+#if HAVE_EPOLL
+// Register the connection in the epoll set, or switch its interest between
+// reading and writing. Only called when conn->state changes.
+static int32_t epollWatch(Conn *conn, int op) {
+  struct epoll_event ev = {};
+  ev.events = (conn->state == STATE_REQ) ? EPOLLIN : EPOLLOUT;
+  if (global_data.loop_mode == LOOP_EPOLL_ET) {
+    ev.events |= EPOLLET;
+  }
+  ev.data.ptr = conn;
+  if (epoll_ctl(local_data->epoll_fd, op, conn->fd, &ev) < 0) {
+    HelperLibrary::MsgHelpers::error(
+        "epollWatch(): Failed to update the epoll interest list.");
+    return -1;
+  }
   return 0;
 }
 
+// Maximum number of ready events handled in one epoll_wait() call
+const int k_max_events = 1024;
+
+// After connectionIO(): destroy the connection, or follow its new state.
+// state is the one before the IO. A parked connection is taken out of the
+// epoll set, as a hang up cannot be masked and would be reported on every
+// iteration. Adding it back reports the data received meanwhile, even in
+// edge-triggered mode. A parked connection that fails here is only destroyed
+// by the resume, once its Forwards are back.
+static void epollUpdate(std::vector<Conn *> &fd2conn, Conn *conn,
+                        uint32_t state) {
+  if (conn->state != STATE_END && conn->state != state) {
+    int op = EPOLL_CTL_MOD;
+    if (conn->state == STATE_WAIT) {
+      op = EPOLL_CTL_DEL;
+    } else if (state == STATE_WAIT) {
+      op = EPOLL_CTL_ADD;
+    }
+    if (epollWatch(conn, op) != 0) {
+      conn->state = STATE_END;
+    }
+  }
+  if (conn->state == STATE_END &&
+      (!conn->pending || conn->pending->waiting == 0)) {
+    connDestroy(fd2conn, conn);
+  }
+}
+
+static int32_t epollWatch(Conn *conn, int op);
+static void connDestroy(std::vector<Conn *> &fd2conn, Conn *conn);
+static bool acceptConnections(std::vector<Conn *> &fd2conn, int server_fd);
+static void shardWakeUp(Shard *shard);
+static int32_t nextTimerMs();
+static void processTimers();
+static bool processRehash();
+static void statsSample();
+static void childCheck();
+static void aofFlush();
+static void connResume(Conn *conn);
+static void epollLoop(std::vector<Conn *> &fd2conn, int server_fd) {
+  local_data->epoll_fd = epoll_create1(0);
+  if (local_data->epoll_fd < 0) {
+    HelperLibrary::MsgHelpers::die("Failed to create the epoll instance!");
+  }
+  bool edge = (global_data.loop_mode == LOOP_EPOLL_ET);
+
+  // The listening socket is registered with a NULL data pointer so it can be
+  // told apart from the client connections
+  struct epoll_event server_ev = {};
+  server_ev.events = EPOLLIN;
+  if (edge) {
+    server_ev.events |= EPOLLET;
+  }
+  server_ev.data.ptr = NULL;
+  if (epoll_ctl(local_data->epoll_fd, EPOLL_CTL_ADD, server_fd, &server_ev) <
+      0) {
+    HelperLibrary::MsgHelpers::die("Failed to add the server fd to epoll!");
+  }
+  // The wake up pipe is tagged with the shard itself
+  struct epoll_event wake_ev = {};
+  wake_ev.events = EPOLLIN;
+  wake_ev.data.ptr = local_data;
+  if (epoll_ctl(local_data->epoll_fd, EPOLL_CTL_ADD, local_data->wake_fds[0],
+                &wake_ev) < 0) {
+    HelperLibrary::MsgHelpers::die("Failed to add the wake up pipe to epoll!");
+  }
+
+  // Unlike poll(), each connection is registered once in newConnection() and
+  // only the ready ones are returned, so an iteration costs O(ready events)
+  // instead of O(connections)
+  std::vector<struct epoll_event> events(k_max_events);
+  // Edge-triggered mode does not report the listening socket again while
+  // connections are left in the backlog, so a backlog that outlasted the
+  // accept budget is remembered here
+  bool accept_pending = false;
+  // Same as in pollLoop()
+  bool rehash_pending = false;
+  while (true) {
+    bool busy =
+        accept_pending || rehash_pending || !local_data->ready.empty();
+    int rv = epoll_wait(local_data->epoll_fd, events.data(), k_max_events,
+                        busy ? 0 : nextTimerMs());
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      HelperLibrary::MsgHelpers::die(
+          "There is something wrong in the function epoll_wait()!");
+    }
+
+    for (int i = 0; i < rv; i++) {
+      if (events[i].data.ptr == local_data) {
+        shardWakeUp(local_data);
+        continue;
+      }
+      Conn *conn = (Conn *)events[i].data.ptr;
+      if (!conn) {
+        // Accepted after the IO events, below
+        accept_pending = true;
+        continue;
+      }
+
+      uint32_t state = conn->state;
+      connectionIO(conn);
+      epollUpdate(fd2conn, conn, state);
+    }
+
+    // The parked connections whose commands are done
+    std::vector<Conn *> resumed;
+    resumed.swap(local_data->resumed);
+    for (Conn *conn : resumed) {
+      connResume(conn);
+      epollUpdate(fd2conn, conn, STATE_WAIT);
+    }
+    // Edge-triggered: the connections that stopped reading with data left
+    std::vector<Conn *> ready;
+    ready.swap(local_data->ready);
+    for (Conn *conn : ready) {
+      conn->ready = false;
+      uint32_t state = conn->state;
+      connectionIO(conn);
+      epollUpdate(fd2conn, conn, state);
+    }
+
+    if (accept_pending) {
+      accept_pending = acceptConnections(fd2conn, server_fd) && edge;
+    }
+    processTimers();
+    if (rv == 0) {
+      rehash_pending = processRehash();
+    }
+    statsSample();
+    childCheck();
+    // Group commit: one write() for the commands of the whole iteration
+    aofFlush();
+  }
+}
+#else
+static void epollLoop(std::vector<Conn *> &fd2conn, int server_fd) {
+  pollLoop(fd2conn, server_fd);
+}
+#endif
+
 static void setFdToNonblock(int fd) {
   errno = 0;
   // Flags are bit mask
@@ -199,20 +1050,36 @@ static void setFdToNonblock(int fd) {
 
 static void setFdToNonblock(int fd);
 static void connPut(std::vector<Conn *> &fd2conn, struct Conn *conn);
+#if HAVE_EPOLL
+static int32_t epollWatch(Conn *conn, int op);
+#endif
+static void connDestroy(std::vector<Conn *> &fd2conn, Conn *conn);
+static Conn *connAlloc();
 static int32_t newConnection(std::vector<Conn *> &fd2conn, int server_fd) {
   struct sockaddr_in client_addr = {};
   socklen_t sock_len = sizeof(client_addr);
+#if defined(__linux__)
+  // The new fd is made nonblocking by the same syscall
+  int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr,
+                          &sock_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
   int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &sock_len);
+#endif
   if (client_fd < 0) {
-    HelperLibrary::MsgHelpers::error(
-        "Error: Failed to connect to the server fd.");
+    // EAGAIN: the backlog is drained, nothing to report
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      HelperLibrary::MsgHelpers::error(
+          "Error: Failed to connect to the server fd.");
+    }
     return -1;
   }
+#if !defined(__linux__)
   // Set the client fd to nonBlocking mode;
   setFdToNonblock(client_fd);
+#endif
 
   // Create the Conn struct for the client_fd
-  struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
+  struct Conn *conn = connAlloc();
   if (!conn) {
     close(client_fd);
     HelperLibrary::MsgHelpers::error("Error: Failed to create the conn struct "
@@ -222,10 +1089,16 @@ static int32_t newConnection(std::vector<Conn *> &fd2conn, int server_fd) {
 
   conn->fd = client_fd;
   conn->state = STATE_REQ;
-  conn->rbuf_size = 0;
-  conn->wbuf_size = 0;
-  conn->wbuf_sent = 0;
   (void)connPut(fd2conn, conn);
+  local_data->stats.connections_received++;
+  local_data->stats.connected_clients++;
+#if HAVE_EPOLL
+  if (global_data.loop_mode != LOOP_POLL &&
+      epollWatch(conn, EPOLL_CTL_ADD) != 0) {
+    connDestroy(fd2conn, conn);
+    return -1;
+  }
+#endif
   return 0;
 }
 
@@ -246,6 +1119,10 @@ static void connectionIO(Conn *conn) {
     stateReq(conn);
   } else if (conn->state == STATE_RES) {
     stateRes(conn);
+  } else if (conn->state == STATE_WAIT || conn->state == STATE_END) {
+    // Parked after it was queued, nothing to do until connResume(). A parked
+    // connection that is closing can still get events if it failed to leave
+    // the epoll set.
   } else {
     HelperLibrary::MsgHelpers::error(
         "Unexpected error happend in the function connectionIO()!");
@@ -253,22 +1130,43 @@ static void connectionIO(Conn *conn) {
   }
 }
 
+// One read per readiness event, so a client that keeps its socket full cannot
+// keep the loop away from the other connections. poll() and level-triggered
+// epoll report the rest of the data again, with edge-triggered epoll the
+// connection is queued for the next iteration.
 static bool fillBuffer(Conn *conn);
 static void stateReq(Conn *conn) {
-  while (fillBuffer(conn)) {
+  if (fillBuffer(conn) && global_data.loop_mode == LOOP_EPOLL_ET &&
+      !conn->ready) {
+    conn->ready = true;
+    local_data->ready.push_back(conn);
   }
 }
 
-static bool oneRequest(Conn *conn);
+// Returns true if the read filled the buffer, so more data may be waiting
+static bool batchRequests(Conn *conn);
+static bool aofDeferReplies();
 static bool fillBuffer(Conn *conn) {
-  assert(conn->rbuf_size < sizeof(conn->rbuf));
+  // Room for the rest of a partially received request is reserved at once, so
+  // large values don't grow the buffer chunk by chunk
+  size_t want = k_read_chunk;
+  size_t have = BufSize(&conn->rbuf);
+  if (have >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, BufHead(&conn->rbuf), 4);
+    if (len <= k_max_msg && 4 + len > have + want) {
+      want = 4 + len - have;
+    }
+  }
+  // Compacts or grows rbuf at most once per read
+  BufReserve(&conn->rbuf, want);
   ssize_t rv = 0;
+  size_t cap = conn->rbuf.cap - conn->rbuf.tail; // available space left
   // This loop ensure read behavior to be save if there is signal interruption.
   // For non-block mode.
   do {
-    size_t cap = sizeof(conn->rbuf) - conn->rbuf_size; // available space left
     // Read cap bytes of data from fd and store in the rbuf
-    rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+    rv = read(conn->fd, BufTail(&conn->rbuf), cap);
     // EINTR: the read call was interrupted by a signal before it could read any
     // data.
   } while (rv < 0 && errno == EINTR);
@@ -289,7 +1187,7 @@ static bool fillBuffer(Conn *conn) {
   }
 
   if (rv == 0) {
-    if (conn->rbuf_size > 0) {
+    if (BufSize(&conn->rbuf) > 0) {
       HelperLibrary::MsgHelpers::error("Unexpected EOF!");
     } else {
       HelperLibrary::MsgHelpers::error("EOF!");
@@ -298,33 +1196,53 @@ static bool fillBuffer(Conn *conn) {
     return false;
   }
 
-  conn->rbuf_size += (size_t)rv;
-  assert(conn->rbuf_size <= sizeof(conn->rbuf));
+  BufCommit(&conn->rbuf, (size_t)rv);
+  local_data->stats.net_input_bytes += (uint64_t)rv;
+
+  // Pipelining: The read buffer may contain multiple requests, their responses
+  // are sent together by a single write()
+  if (batchRequests(conn) && !aofDeferReplies()) {
+    stateRes(conn);
+  }
+  return conn->state == STATE_REQ && (size_t)rv == cap;
+}
 
-  // Pipelining: The read buffer may contain multiple requests
-  while (oneRequest(conn)) {
+// Parse every complete request in rbuf and queue the responses in wbuf, up to
+// one that parks the connection or until wbuf reaches k_wbuf_high_water.
+// Returns true if there are responses to send.
+static bool oneRequest(Conn *conn);
+static bool batchRequests(Conn *conn) {
+  while (BufSize(&conn->wbuf) < k_wbuf_high_water && oneRequest(conn)) {
+  }
+  if (conn->state != STATE_REQ || BufSize(&conn->wbuf) == 0) {
+    return false;
   }
-  return (conn->state == STATE_REQ);
+  conn->state = STATE_RES;
+  return true;
 }
 
 static void stateRes(Conn *conn);
-static void parseRequest(std::vector<std::string> &cmd, std::string &out);
+static bool parseRequest(Conn *conn, std::vector<std::string_view> &cmd,
+                         std::string &out);
 static int32_t parseHelper(const uint8_t *data, size_t req_len,
-                           std::vector<std::string> &cmd);
+                           std::vector<std::string_view> &cmd);
 static void outErr(std::string &out, int32_t error_code,
                    const std::string &msg);
-// parse the request from the buffer
+static void oneReply(Conn *conn);
+// parse the request from the buffer, false if there is no complete request or
+// the connection was parked
 static bool oneRequest(Conn *conn) {
   // Not enough data in the buffer
-  if (conn->rbuf_size < 4) {
+  if (BufSize(&conn->rbuf) < 4) {
     HelperLibrary::MsgHelpers::error(
         "oneRequest() failed: not enough data in the buffer, will try again in "
         "the next iteration!");
     return false;
   }
 
+  const uint8_t *req = BufHead(&conn->rbuf);
   uint32_t len = 0;
-  memcpy(&len, &conn->rbuf[0], 4);
+  memcpy(&len, req, 4);
   if (len > k_max_msg) {
     HelperLibrary::MsgHelpers::error(
         "oneRequest() failed: the request length is too long!");
@@ -332,7 +1250,7 @@ static bool oneRequest(Conn *conn) {
     return false;
   }
 
-  if (4 + len > conn->rbuf_size) {
+  if (4 + len > BufSize(&conn->rbuf)) {
     HelperLibrary::MsgHelpers::error(
         "oneRequest() failed: not enough data in the buffer, will try again in "
         "the next iteration!");
@@ -362,38 +1280,67 @@ static bool oneRequest(Conn *conn) {
   // memcpy(&conn->wbuf[4], &rescode, 4);
   // conn->wbuf_size = 4 + wlen;
 
-  // Parse the request
-  std::vector<std::string> cmd;
-  if (parseHelper(&conn->rbuf[4], len, cmd) != 0) {
+  // Parse the request, the arguments point into rbuf and stay valid until the
+  // request is consumed
+  std::vector<std::string_view> &cmd = conn->args;
+  cmd.clear();
+  if (parseHelper(&req[4], len, cmd) != 0) {
     HelperLibrary::MsgHelpers::error("Bad Request");
     conn->state = STATE_END;
     return false;
   }
   // Generate one response after got one request
-  std::string out;
-  parseRequest(cmd, out);
+  std::string &out = conn->out;
+  out.clear();
+  if (!parseRequest(conn, cmd, out)) {
+    // Forwarded, the request stays in rbuf until connResume()
+    conn->state = STATE_WAIT;
+    return false;
+  }
+  oneReply(conn);
+  return true;
+}
 
+// Queue conn->out in wbuf after the responses already queued by this batch,
+// and remove its request from rbuf
+static void oneReply(Conn *conn) {
+  std::string &out = conn->out;
+  uint32_t len = 0;
+  memcpy(&len, BufHead(&conn->rbuf), 4);
   // Pack the response into the buffer
   if (4 + out.size() > k_max_msg) {
     out.clear();
     outErr(out, ERR_2BIG, "response is too big");
   }
+  // Append to the responses already queued by this batch
   uint32_t wlen = (uint32_t)out.size();
-  memcpy(&conn->wbuf[0], &wlen, 4);
-  memcpy(&conn->wbuf[4], out.data(), out.size());
-  conn->wbuf_size = 4 + wlen;
+  BufAppend(&conn->wbuf, &wlen, 4);
+  BufAppend(&conn->wbuf, out.data(), out.size());
 
-  // If there is remaining data, move to the start of the buffer and remove the
-  // current request
-  size_t remain = conn->rbuf_size - 4 - len;
-  if (remain) {
-    memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
-  }
-  conn->rbuf_size = remain;
+  // Remove the current request by moving the head cursor, the remaining data
+  // is compacted by the next read if needed
+  BufConsume(&conn->rbuf, 4 + len);
+}
 
-  conn->state = STATE_RES;
-  stateRes(conn);
-  return (conn->state == STATE_REQ);
+// Finish the command a parked connection was waiting for, then go on with the
+// rest of its requests
+static void commandDone(int client_fd, const Command *c,
+                        std::vector<std::string_view> &cmd, uint64_t start_ns);
+static void connResume(Conn *conn) {
+  if (conn->state == STATE_END) {
+    // Failed while parked, the caller destroys it now that nothing is left
+    return;
+  }
+  Pending *p = conn->pending;
+  std::string &out = conn->out;
+  out.clear();
+  p->finish(p, conn->args, out);
+  commandDone(conn->fd, p->c, conn->args, p->start_ns);
+  oneReply(conn);
+  conn->state = STATE_REQ;
+  if (batchRequests(conn) && !aofDeferReplies()) {
+    stateRes(conn);
+  }
 }
 
 static bool flushBuffer(Conn *conn);
@@ -405,8 +1352,8 @@ static void stateRes(Conn *conn) {
 static bool flushBuffer(Conn *conn) {
   ssize_t rv = 0;
   do {
-    size_t remain = conn->wbuf_size - conn->wbuf_sent;
-    rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+    size_t remain = BufSize(&conn->wbuf);
+    rv = write(conn->fd, BufHead(&conn->wbuf), remain);
     // EINTR: if a signal occurred while the system call was in progress;
   } while (rv < 0 && errno == EINTR);
 
@@ -423,13 +1370,22 @@ static bool flushBuffer(Conn *conn) {
     return false;
   }
 
-  conn->wbuf_sent += (size_t)rv;
-  assert(conn->wbuf_sent <= conn->wbuf_size);
-  if (conn->wbuf_sent == conn->wbuf_size) {
+  BufConsume(&conn->wbuf, (size_t)rv);
+  local_data->stats.net_output_bytes += (uint64_t)rv;
+  if (BufSize(&conn->wbuf) == 0) {
     // The response is fully sent, set the state back
     conn->state = STATE_REQ;
-    conn->wbuf_sent = 0;
-    conn->wbuf_size = 0;
+    // The requests left in rbuf by a batch that reached k_wbuf_high_water,
+    // the client may be waiting for their responses before sending more
+    if (batchRequests(conn)) {
+      return !aofDeferReplies();
+    }
+    // Shrink the buffers back to a small footprint while the connection idles
+    BufShrink(&conn->wbuf, k_idle_buf_cap);
+    BufShrink(&conn->rbuf, k_idle_buf_cap);
+    if (conn->out.capacity() > k_idle_buf_cap) {
+      std::string().swap(conn->out);
+    }
     return false;
   }
 
@@ -437,35 +1393,593 @@ static bool flushBuffer(Conn *conn) {
   return true;
 }
 
-static void doGet(std::vector<std::string> &cmd, std::string &out);
-static void doSet(std::vector<std::string> &cmd, std::string &out);
-static void doDel(std::vector<std::string> &cmd, std::string &out);
-static void doKeys(std::vector<std::string> &cmd, std::string &out);
-static bool cmdIs(std::string &word, const char *cmd);
-static void outErr(std::string &out, int32_t error_code,
-                   const std::string &msg);
-static void parseRequest(std::vector<std::string> &cmd, std::string &out) {
-  if (cmd.size() == 1 && cmdIs(cmd[0], "keys")) {
-    doKeys(cmd, out);
-  } else if (cmd.size() == 2 && cmdIs(cmd[0], "get")) {
-    doGet(cmd, out);
-  } else if (cmd.size() == 3 && cmdIs(cmd[0], "set")) {
-    doSet(cmd, out);
-  } else if (cmd.size() == 2 && cmdIs(cmd[0], "del")) {
-    doDel(cmd, out);
-  } else {
-    // Unknown Command
-    outErr(out, ERR_UNKNOWN, "Unknown Command");
+static void doGet(std::vector<std::string_view> &cmd, std::string &out);
+static void doSet(std::vector<std::string_view> &cmd, std::string &out);
+static void doDel(std::vector<std::string_view> &cmd, std::string &out);
+static void doMGet(std::vector<std::string_view> &cmd, std::string &out);
+static void doMSet(std::vector<std::string_view> &cmd, std::string &out);
+static void doMDel(std::vector<std::string_view> &cmd, std::string &out);
+static void doKeys(std::vector<std::string_view> &cmd, std::string &out);
+static void doScan(std::vector<std::string_view> &cmd, std::string &out);
+static void doExpire(std::vector<std::string_view> &cmd, std::string &out);
+static void doTTL(std::vector<std::string_view> &cmd, std::string &out);
+static void doPersist(std::vector<std::string_view> &cmd, std::string &out);
+static void doZAdd(std::vector<std::string_view> &cmd, std::string &out);
+static void doZRem(std::vector<std::string_view> &cmd, std::string &out);
+static void doZScore(std::vector<std::string_view> &cmd, std::string &out);
+static void doZRangeByScore(std::vector<std::string_view> &cmd,
+                            std::string &out);
+static void doZRank(std::vector<std::string_view> &cmd, std::string &out);
+static void doZRange(std::vector<std::string_view> &cmd, std::string &out);
+static void doZCount(std::vector<std::string_view> &cmd, std::string &out);
+static void doSave(std::vector<std::string_view> &cmd, std::string &out);
+static void doBgSave(std::vector<std::string_view> &cmd, std::string &out);
+static void doBgRewriteAof(std::vector<std::string_view> &cmd,
+                           std::string &out);
+static void doInfo(std::vector<std::string_view> &cmd, std::string &out);
+static void doSlowlog(std::vector<std::string_view> &cmd, std::string &out);
+static void doIncr(std::vector<std::string_view> &cmd, std::string &out);
+static void doIncrByFloat(std::vector<std::string_view> &cmd,
+                          std::string &out);
+
+// Command flags
+enum {
+  CMD_READ = 1 << 0,  // reads the keyspace
+  CMD_WRITE = 1 << 1, // may modify the keyspace
+  // Runs on every shard, the array replies are concatenated
+  CMD_ALL_SHARDS = 1 << 2,
+  // Runs on the shard encoded in the cursor argument (at first_key)
+  CMD_CURSOR_SHARD = 1 << 3,
+};
+
+struct Command {
+  std::string_view name; // lowercase
+  void (*handler)(std::vector<std::string_view> &cmd, std::string &out);
+  // Number of arguments including the command name, -N means at least N
+  int32_t arity;
+  uint32_t flags;
+  // Position of the key that picks the owning shard, 0 if there is none
+  uint32_t first_key;
+  // Multi-key commands: the distance between two keys after first_key, e.g.
+  // 2 for the key-value pairs of MSET. 0 for the other commands.
+  uint32_t key_step = 0;
+};
+
+// The command registry, every command is registered here. The position in
+// this table is also the command's slot in local_data->stats.cmds.
+static constexpr Command k_commands[] = {
+    {"get", &doGet, 2, CMD_READ, 1},
+    {"set", &doSet, 3, CMD_WRITE, 1},
+    {"del", &doDel, 2, CMD_WRITE, 1},
+    {"mget", &doMGet, -2, CMD_READ, 1, 1},
+    {"mset", &doMSet, -3, CMD_WRITE, 1, 2},
+    {"mdel", &doMDel, -2, CMD_WRITE, 1, 1},
+    {"keys", &doKeys, 1, CMD_READ | CMD_ALL_SHARDS, 0},
+    {"scan", &doScan, -2, CMD_READ | CMD_CURSOR_SHARD, 1},
+    {"expire", &doExpire, 3, CMD_WRITE, 1},
+    {"pexpire", &doExpire, 3, CMD_WRITE, 1},
+    {"expireat", &doExpire, 3, CMD_WRITE, 1},
+    {"pexpireat", &doExpire, 3, CMD_WRITE, 1},
+    {"ttl", &doTTL, 2, CMD_READ, 1},
+    {"pttl", &doTTL, 2, CMD_READ, 1},
+    {"persist", &doPersist, 2, CMD_WRITE, 1},
+    {"zadd", &doZAdd, -4, CMD_WRITE, 1},
+    {"zrem", &doZRem, -3, CMD_WRITE, 1},
+    {"zscore", &doZScore, 3, CMD_READ, 1},
+    {"zrangebyscore", &doZRangeByScore, -4, CMD_READ, 1},
+    {"zrank", &doZRank, 3, CMD_READ, 1},
+    {"zrevrank", &doZRank, 3, CMD_READ, 1},
+    {"zrange", &doZRange, -4, CMD_READ, 1},
+    {"zcount", &doZCount, 4, CMD_READ, 1},
+    {"save", &doSave, 1, CMD_READ, 0},
+    {"bgsave", &doBgSave, 1, CMD_READ, 0},
+    {"bgrewriteaof", &doBgRewriteAof, 1, CMD_READ, 0},
+    {"info", &doInfo, -1, CMD_READ, 0},
+    {"slowlog", &doSlowlog, -2, CMD_READ, 0},
+    {"incr", &doIncr, 2, CMD_WRITE, 1},
+    {"decr", &doIncr, 2, CMD_WRITE, 1},
+    {"incrby", &doIncr, 3, CMD_WRITE, 1},
+    {"decrby", &doIncr, 3, CMD_WRITE, 1},
+    {"incrbyfloat", &doIncrByFloat, 3, CMD_WRITE, 1},
+};
+const size_t k_num_commands = sizeof(k_commands) / sizeof(k_commands[0]);
+static_assert(k_num_commands <= k_max_commands, "too many commands");
+
+// Open addressing index over k_commands, built at compile time.
+// Kept at most half full so a lookup probes about one slot no matter how many
+// commands are registered.
+const size_t k_cmd_index_size = 128;
+static_assert(k_num_commands * 2 <= k_cmd_index_size,
+              "k_cmd_index_size is too small for k_commands");
+
+// Case-folded FNV-1a, so "GET", "get" and "Get" land in the same slot
+static constexpr uint32_t cmdNameHash(std::string_view name) {
+  uint32_t h = 0x811C9DC5;
+  for (char c : name) {
+    uint8_t lower = (c >= 'A' && c <= 'Z') ? (uint8_t)(c + ('a' - 'A')) : c;
+    h = (h ^ lower) * 0x01000193;
   }
+  return h;
 }
 
-// Read arguments
-static int32_t parseHelper(const uint8_t *data, size_t req_len,
-                           std::vector<std::string> &cmd) {
-  if (req_len < 4) {
-    return -1;
+struct CommandIndex {
+  int16_t slots[k_cmd_index_size]; // index into k_commands, -1 if empty
+};
+
+static constexpr CommandIndex buildCommandIndex() {
+  CommandIndex index = {};
+  for (size_t i = 0; i < k_cmd_index_size; i++) {
+    index.slots[i] = -1;
   }
-  uint32_t n = 0;
+  for (size_t i = 0; i < k_num_commands; i++) {
+    size_t pos = cmdNameHash(k_commands[i].name) & (k_cmd_index_size - 1);
+    while (index.slots[pos] >= 0) {
+      pos = (pos + 1) & (k_cmd_index_size - 1);
+    }
+    index.slots[pos] = (int16_t)i;
+  }
+  return index;
+}
+
+static constexpr CommandIndex k_cmd_index = buildCommandIndex();
+
+static const Command *lookupCommand(std::string_view name) {
+  size_t pos = cmdNameHash(name) & (k_cmd_index_size - 1);
+  for (int16_t i; (i = k_cmd_index.slots[pos]) >= 0;
+       pos = (pos + 1) & (k_cmd_index_size - 1)) {
+    const Command *cmd = &k_commands[i];
+    if (cmd->name.size() == name.size() &&
+        strncasecmp(cmd->name.data(), name.data(), name.size()) == 0) {
+      return cmd;
+    }
+  }
+  return NULL;
+}
+
+static bool cmdArityOK(const Command *c, size_t nargs) {
+  return c->arity >= 0 ? nargs == (size_t)c->arity
+                       : nargs >= (size_t)-c->arity;
+}
+
+static void outErr(std::string &out, int32_t error_code,
+                   const std::string &msg);
+static bool shardRunAll(Conn *conn, const Command *c,
+                        std::vector<std::string_view> &cmd, std::string &out);
+static Shard *keyOwner(std::string_view key);
+static Shard *cursorOwner(std::string_view cursor);
+static bool shardForward(Conn *conn, Shard *owner, const Command *c,
+                         std::vector<std::string_view> &cmd);
+static bool shardRunKeys(Conn *conn, const Command *c,
+                         std::vector<std::string_view> &cmd, std::string &out);
+static bool shardRunInfo(Conn *conn, const Command *c,
+                         std::vector<std::string_view> &cmd, std::string &out);
+static void aofFeed(const Command *c, std::vector<std::string_view> &cmd,
+                    const std::string &out);
+// Returns false if the command went to other shards, the connection is then
+// parked until connResume()
+static bool execCommand(Conn *conn, const Command *c,
+                        std::vector<std::string_view> &cmd, std::string &out) {
+  if (global_data.nthreads == 1) {
+    c->handler(cmd, out);
+    if ((c->flags & CMD_WRITE) && global_data.aof.fd >= 0) {
+      aofFeed(c, cmd, out);
+    }
+    return true;
+  }
+  if (c->flags & CMD_ALL_SHARDS) {
+    return shardRunAll(conn, c, cmd, out);
+  }
+  if (c->handler == &doInfo) {
+    return shardRunInfo(conn, c, cmd, out);
+  }
+  if (c->key_step) {
+    return shardRunKeys(conn, c, cmd, out);
+  }
+  Shard *owner = local_data;
+  if (c->flags & CMD_CURSOR_SHARD) {
+    owner = cursorOwner(cmd[c->first_key]);
+  } else if (c->first_key) {
+    owner = keyOwner(cmd[c->first_key]);
+  }
+  if (owner != local_data) {
+    return shardForward(conn, owner, c, cmd);
+  }
+  c->handler(cmd, out);
+  return true;
+}
+
+// The counters of a command that just ran, ns is the time it took
+static void statsRecord(const Command *c, uint64_t ns) {
+  ShardStats &stats = local_data->stats;
+  CommandStats &cs = stats.cmds[c - k_commands];
+  cs.calls++;
+  cs.ns += ns;
+  size_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  cs.latency[bucket < k_latency_buckets ? bucket : k_latency_buckets - 1]++;
+  stats.commands++;
+  HistRecord(&stats.latency, ns);
+}
+
+// Add a command to the slow log, overwriting the oldest entry when it is full
+static void slowlogRecord(int client_fd, std::vector<std::string_view> &cmd,
+                          uint64_t duration_us) {
+  std::lock_guard<std::mutex> lock(global_data.slowlog_mu);
+  std::vector<SlowlogEntry> &log = global_data.slowlog;
+  if (global_data.slowlog_max_len == 0) {
+    return;
+  }
+  if (log.size() < global_data.slowlog_max_len) {
+    log.resize(global_data.slowlog_max_len);
+  }
+  uint64_t id = global_data.slowlog_next_id++;
+  SlowlogEntry &ent = log[id % log.size()];
+  ent.id = id;
+  ent.time = (int64_t)::time(NULL);
+  ent.duration_us = duration_us;
+  ent.client_fd = client_fd;
+  // Like Redis, the last kept argument says how much was left out
+  size_t nargs = std::min(cmd.size(), k_slowlog_max_args);
+  ent.args.resize(nargs);
+  for (size_t i = 0; i < nargs; i++) {
+    std::string &arg = ent.args[i];
+    if (i + 1 == k_slowlog_max_args && cmd.size() > k_slowlog_max_args) {
+      arg = "... (" + std::to_string(cmd.size() - i) + " more arguments)";
+    } else if (cmd[i].size() > k_slowlog_max_arg_len) {
+      arg.assign(cmd[i].data(), k_slowlog_max_arg_len);
+      arg += "... (" + std::to_string(cmd[i].size() - k_slowlog_max_arg_len) +
+             " more bytes)";
+    } else {
+      arg.assign(cmd[i].data(), cmd[i].size());
+    }
+  }
+}
+
+static uint64_t getMonotonicNsec();
+static void commandDone(int client_fd, const Command *c,
+                        std::vector<std::string_view> &cmd, uint64_t start_ns);
+// False if the connection is parked, see execCommand()
+static bool parseRequest(Conn *conn, std::vector<std::string_view> &cmd,
+                         std::string &out) {
+  const Command *c = cmd.empty() ? NULL : lookupCommand(cmd[0]);
+  if (!c) {
+    // Unknown Command
+    outErr(out, ERR_UNKNOWN, "Unknown Command");
+    return true;
+  }
+  if (!cmdArityOK(c, cmd.size())) {
+    outErr(out, ERR_ARG, "wrong number of arguments");
+    return true;
+  }
+  uint64_t start_ns = getMonotonicNsec();
+  if (!execCommand(conn, c, cmd, out)) {
+    conn->pending->start_ns = start_ns;
+    return false;
+  }
+  commandDone(conn->fd, c, cmd, start_ns);
+  return true;
+}
+
+// The statistics of a command that just completed. A forwarded command
+// counts the time until its last reply is back.
+static void commandDone(int client_fd, const Command *c,
+                        std::vector<std::string_view> &cmd,
+                        uint64_t start_ns) {
+  uint64_t ns = getMonotonicNsec() - start_ns;
+  statsRecord(c, ns);
+  // The same clock reads as the stats, nothing more is done unless it is slow
+  int64_t slower_than_us = global_data.slowlog_slower_than_us;
+  if (slower_than_us >= 0 && ns / 1000 >= (uint64_t)slower_than_us) {
+    slowlogRecord(client_fd, cmd, ns / 1000);
+  }
+}
+
+// Keys are spread over the shards by strHash. The hash is mixed before
+// picking the shard, so the keys of one shard still use all the bucket bits
+// of its hashMap.
+static Shard *hashOwner(uint64_t hash_value) {
+  uint64_t h = (hash_value * 0x9E3779B97F4A7C15ull) >> 32;
+  return global_data.shards[h % global_data.nthreads];
+}
+
+static Shard *keyOwner(std::string_view key) {
+  return hashOwner(strHash((const uint8_t *)key.data(), key.size()));
+}
+
+// A SCAN cursor is the position in the keyspace of one shard, with the shard
+// in the bits above k_cursor_shard_shift. The shards are scanned one after
+// the other.
+const uint32_t k_cursor_shard_shift = 48;
+
+static bool str2int(std::string_view s, int64_t &out);
+static Shard *cursorOwner(std::string_view cursor) {
+  int64_t val = 0;
+  if (!str2int(cursor, val) || val < 0) {
+    // doScan() reports the error
+    return local_data;
+  }
+  uint64_t id = (uint64_t)val >> k_cursor_shard_shift;
+  return id < global_data.nthreads ? global_data.shards[id] : local_data;
+}
+
+static void shardPost(Shard *owner, Forward *f);
+// Run the commands other shards forwarded to this one and send them back, and
+// collect the connections whose forwarded commands are all done
+static void shardRunInbox(Shard *shard) {
+  std::vector<Forward *> todo;
+  {
+    std::lock_guard<std::mutex> lock(shard->inbox_mu);
+    todo.swap(shard->inbox);
+  }
+  for (Forward *f : todo) {
+    if (!f->done) {
+      f->c->handler(*f->cmd, *f->out);
+      f->done = true;
+      // The sender owns f again from here
+      shardPost(f->from, f);
+    } else if (--f->pending->waiting == 0) {
+      shard->resumed.push_back(f->pending->conn);
+    }
+  }
+}
+
+// Called by the event loop when the wake up pipe is readable
+static void shardWakeUp(Shard *shard) {
+  char tmp[64];
+  while (read(shard->wake_fds[0], tmp, sizeof(tmp)) > 0) {
+  }
+  shardRunInbox(shard);
+}
+
+static void shardPost(Shard *owner, Forward *f) {
+  bool was_empty = false;
+  {
+    std::lock_guard<std::mutex> lock(owner->inbox_mu);
+    was_empty = owner->inbox.empty();
+    owner->inbox.push_back(f);
+  }
+  if (was_empty) {
+    // A full pipe already has a pending wake up, the error can be ignored
+    char c = 0;
+    (void)!write(owner->wake_fds[1], &c, 1);
+  }
+}
+
+// Start a command that goes to other shards. finish() builds the reply from
+// p->parts once they are all back.
+static Pending *pendingBegin(Conn *conn, const Command *c,
+                             void (*finish)(Pending *p,
+                                            std::vector<std::string_view> &cmd,
+                                            std::string &out)) {
+  if (!conn->pending) {
+    conn->pending = new Pending();
+  }
+  Pending *p = conn->pending;
+  size_t n = global_data.nthreads;
+  p->conn = conn;
+  p->c = c;
+  p->waiting = 0;
+  p->finish = finish;
+  // The buffers are kept from one command to the next
+  p->forwards.clear();
+  p->forwards.resize(n);
+  p->parts.resize(n);
+  p->subs.resize(n);
+  p->positions.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    p->parts[i].clear();
+    p->subs[i].clear();
+    p->positions[i].clear();
+  }
+  return p;
+}
+
+// Run c on shard i, the reply goes to p->parts[i]
+static void pendingPost(Pending *p, size_t i, const Command *c,
+                        std::vector<std::string_view> *cmd) {
+  Forward &f = p->forwards[i];
+  f.c = c;
+  f.cmd = cmd;
+  f.out = &p->parts[i];
+  f.from = local_data;
+  f.pending = p;
+  p->waiting++;
+  shardPost(global_data.shards[i], &f);
+}
+
+// The reply of the one shard the command went to
+static void finishForward(Pending *p, std::vector<std::string_view> &cmd,
+                          std::string &out) {
+  (void)cmd;
+  for (size_t i = 0; i < p->forwards.size(); i++) {
+    if (p->forwards[i].c) {
+      out.swap(p->parts[i]);
+    }
+  }
+}
+
+// Execute a command on the shard that owns its key
+static bool shardForward(Conn *conn, Shard *owner, const Command *c,
+                         std::vector<std::string_view> &cmd) {
+  Pending *p = pendingBegin(conn, c, &finishForward);
+  pendingPost(p, owner->id, c, &cmd);
+  return false;
+}
+
+// Concatenate the array replies of every shard
+static void outArr(std::string &out, uint32_t n);
+static void finishAll(Pending *p, std::vector<std::string_view> &cmd,
+                      std::string &out) {
+  (void)cmd;
+  uint32_t total = 0;
+  for (const std::string &part : p->parts) {
+    // Every part is a SER_ARR header followed by its elements
+    assert(part.size() >= 5 && part[0] == SER_ARR);
+    uint32_t len = 0;
+    memcpy(&len, &part[1], 4);
+    total += len;
+  }
+  outArr(out, total);
+  for (const std::string &part : p->parts) {
+    out.append(part, 5, std::string::npos);
+  }
+}
+
+// Execute a command on every shard, see finishAll()
+static bool shardRunAll(Conn *conn, const Command *c,
+                        std::vector<std::string_view> &cmd, std::string &out) {
+  (void)out;
+  Pending *p = pendingBegin(conn, c, &finishAll);
+  for (size_t i = 0; i < global_data.nthreads; i++) {
+    if (global_data.shards[i] != local_data) {
+      pendingPost(p, i, c, &cmd);
+    }
+  }
+  c->handler(cmd, p->parts[local_data->id]);
+  return false;
+}
+
+// Size of one serialized value that is not an array
+static size_t serValueSize(const std::string &buf, size_t pos) {
+  uint32_t len = 0;
+  switch (buf[pos]) {
+  case SER_NIL:
+    return 1;
+  case SER_ERR:
+    memcpy(&len, &buf[pos + 5], 4);
+    return 1 + 4 + 4 + len;
+  case SER_STR:
+    memcpy(&len, &buf[pos + 1], 4);
+    return 1 + 4 + len;
+  case SER_INT:
+  case SER_DBL:
+    return 1 + 8;
+  default:
+    assert(!"unexpected value in a multi-key reply");
+    return 0;
+  }
+}
+
+// Merge the replies of a multi-key command in the order of the keys. An array
+// reply is reordered, integer replies are added up (the counts of MDEL), any
+// other reply is the same on every shard. The shards do not write together:
+// when one of them fails (e.g. MSET over maxmemory) the others keep their
+// part, and the error says how many keys were written.
+static void outInt(std::string &out, int64_t val);
+static void finishKeys(Pending *p, std::vector<std::string_view> &cmd,
+                       std::string &out) {
+  (void)cmd;
+  size_t n = global_data.nthreads;
+  size_t nkeys = 0, applied = 0;
+  const std::string *reply = NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (p->subs[i].empty()) {
+      continue;
+    }
+    nkeys += p->positions[i].size();
+    if (p->parts[i][0] != SER_ERR) {
+      applied += p->positions[i].size();
+    }
+    if (!reply || p->parts[i][0] == SER_ERR) {
+      reply = &p->parts[i];
+    }
+  }
+  if (!reply) {
+    // Not reached, shardRunKeys() runs a command without keys by itself
+    return outErr(out, ERR_ARG, "wrong number of arguments");
+  }
+
+  if ((*reply)[0] == SER_ERR && applied > 0) {
+    int32_t code = 0;
+    uint32_t len = 0;
+    memcpy(&code, &(*reply)[1], 4);
+    memcpy(&len, &(*reply)[5], 4);
+    std::string msg = reply->substr(9, len);
+    msg += ", " + std::to_string(applied) + " of " + std::to_string(nkeys) +
+           " keys were written";
+    outErr(out, code, msg);
+  } else if ((*reply)[0] == SER_ARR) {
+    std::vector<std::string_view> values(nkeys);
+    for (size_t i = 0; i < n; i++) {
+      size_t pos = 5;
+      for (uint32_t k : p->positions[i]) {
+        size_t size = serValueSize(p->parts[i], pos);
+        values[k] = std::string_view(&p->parts[i][pos], size);
+        pos += size;
+      }
+    }
+    outArr(out, (uint32_t)nkeys);
+    for (std::string_view val : values) {
+      out.append(val.data(), val.size());
+    }
+  } else if ((*reply)[0] == SER_INT) {
+    int64_t total = 0;
+    for (const std::string &part : p->parts) {
+      int64_t val = 0;
+      if (!part.empty()) {
+        memcpy(&val, &part[1], 8);
+      }
+      total += val;
+    }
+    outInt(out, total);
+  } else {
+    out.append(*reply);
+  }
+}
+
+// Execute a multi-key command: the keys are split by owner and each shard
+// runs the command on its own keys, see finishKeys()
+static bool shardRunKeys(Conn *conn, const Command *c,
+                         std::vector<std::string_view> &cmd, std::string &out) {
+  size_t first = c->first_key;
+  size_t step = c->key_step;
+  if (cmd.size() <= first || (cmd.size() - first) % step != 0) {
+    // The handler reports the error
+    c->handler(cmd, out);
+    return true;
+  }
+  Pending *p = pendingBegin(conn, c, &finishKeys);
+  size_t n = global_data.nthreads;
+  size_t nkeys = (cmd.size() - first) / step;
+  size_t nowners = 0;
+  Shard *owner = NULL;
+  for (size_t k = 0; k < nkeys; k++) {
+    size_t arg = first + k * step;
+    Shard *shard = keyOwner(cmd[arg]);
+    std::vector<std::string_view> &sub = p->subs[shard->id];
+    if (sub.empty()) {
+      sub.assign(cmd.begin(), cmd.begin() + first);
+      nowners++;
+      owner = shard;
+    }
+    sub.insert(sub.end(), cmd.begin() + arg, cmd.begin() + arg + step);
+    p->positions[shard->id].push_back((uint32_t)k);
+  }
+  if (nowners == 1) {
+    if (owner == local_data) {
+      c->handler(cmd, out);
+      return true;
+    }
+    return shardForward(conn, owner, c, cmd);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (!p->subs[i].empty() && global_data.shards[i] != local_data) {
+      pendingPost(p, i, c, &p->subs[i]);
+    }
+  }
+  if (!p->subs[local_data->id].empty()) {
+    c->handler(p->subs[local_data->id], p->parts[local_data->id]);
+  }
+  return false;
+}
+
+// Read arguments
+static int32_t parseHelper(const uint8_t *data, size_t req_len,
+                           std::vector<std::string_view> &cmd) {
+  if (req_len < 4) {
+    return -1;
+  }
+  uint32_t n = 0;
   memcpy(&n, &data[0], 4);
   if (n > k_max_msg) {
     return -1;
@@ -480,7 +1994,7 @@ static int32_t parseHelper(const uint8_t *data, size_t req_len,
     if (pos + 4 + sz > req_len) {
       return -1;
     }
-    cmd.push_back(std::string((char *)&data[pos + 4], sz));
+    cmd.push_back(std::string_view((const char *)&data[pos + 4], sz));
     pos += (4 + sz);
   }
 
@@ -491,10 +2005,6 @@ static int32_t parseHelper(const uint8_t *data, size_t req_len,
   return 0;
 }
 
-static bool cmdIs(std::string &word, const char *cmd) {
-  return strcasecmp(word.c_str(), cmd) == 0;
-}
-
 static void keyScan(hashTable *HTable, void (*f)(hashTableNode *, void *),
                     void *arg) {
   if (HTable->size == 0) {
@@ -509,86 +2019,2438 @@ static void keyScan(hashTable *HTable, void (*f)(hashTableNode *, void *),
   }
 }
 
-static void outStr(std::string &out, const std::string &val);
+static uint64_t getMonotonicMsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static bool entryExpired(Entry *ent, uint64_t now_ms) {
+  return ent->heap_idx != (size_t)-1 &&
+         local_data->heap[ent->heap_idx].val <= now_ms;
+}
+
+// Set or remove (ttl_ms < 0) the expiration time of a key, O(log n)
+static void entrySetTTL(Entry *ent, int64_t ttl_ms) {
+  std::vector<HeapItem> &heap = local_data->heap;
+  if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+    // Fill the hole with the last item
+    size_t pos = ent->heap_idx;
+    heap[pos] = heap.back();
+    heap.pop_back();
+    if (pos < heap.size()) {
+      HeapUpdate(heap.data(), pos, heap.size());
+    }
+    ent->heap_idx = -1;
+  } else if (ttl_ms >= 0) {
+    size_t pos = ent->heap_idx;
+    if (pos == (size_t)-1) {
+      HeapItem item;
+      item.ref = &ent->heap_idx;
+      heap.push_back(item);
+      pos = heap.size() - 1;
+    }
+    heap[pos].val = getMonotonicMsec() + (uint64_t)ttl_ms;
+    HeapUpdate(heap.data(), pos, heap.size());
+  }
+}
+
+// Free an entry that is already removed from the hash map
+static void entryDel(Entry *ent) {
+  local_data->used_memory -= EntryMemory(ent);
+  entrySetTTL(ent, -1);
+  if (ent->type == T_ZSET) {
+    ZSetDispose(ent->zset);
+    delete ent->zset;
+  }
+  EntryFree(&local_data->slab, ent);
+}
+
+// Create a key, the caller has checked that it does not exist. val is the
+// value of a T_STR key.
+static Entry *entryNew(std::string_view name, uint32_t type,
+                       std::string_view val) {
+  Entry *ent = EntryNew(&local_data->slab, name, type, val);
+  ent->HTNode.hash_value = strHash((uint8_t *)name.data(), name.size());
+  if (type == T_ZSET) {
+    ent->zset = new ZSet();
+  }
+  ent->lru = local_data->lru_clock;
+  ent->lfu = k_lfu_init_val;
+  local_data->used_memory += EntryMemory(ent);
+  keyspaceInsert(&ent->HTNode);
+  return ent;
+}
+
+// The LFU counter after the decay since the last access
+static uint8_t lfuDecayed(const Entry *ent, uint32_t now) {
+  uint32_t periods = ((now - ent->lru) & k_lru_clock_max) / k_lfu_decay_s;
+  return periods < ent->lfu ? (uint8_t)(ent->lfu - periods) : 0;
+}
+
+// Record an access for the eviction policy. The LFU counter is logarithmic
+// like Redis': the higher it is, the less likely an access increments it.
+static void entryTouch(Entry *ent) {
+  uint32_t now = local_data->lru_clock;
+  if (global_data.maxmemory_policy == EVICT_LFU) {
+    uint8_t counter = lfuDecayed(ent, now);
+    if (counter < 255) {
+      double base = counter > k_lfu_init_val ? counter - k_lfu_init_val : 0;
+      double r = (double)(wyRand(&local_data->rand_state) >> 11) / (1ull << 53);
+      if (r * (base * k_lfu_log_factor + 1) < 1) {
+        counter++;
+      }
+    }
+    ent->lfu = counter;
+  }
+  ent->lru = now;
+}
+
+// How good a key is to evict, the larger the better
+static uint64_t evictIdle(const Entry *ent) {
+  uint32_t now = local_data->lru_clock;
+  if (global_data.maxmemory_policy == EVICT_LFU) {
+    return 255 - lfuDecayed(ent, now);
+  }
+  return (now - ent->lru) & k_lru_clock_max;
+}
+
+// Add a few sampled keys to the eviction pool, which keeps the best
+// k_evict_pool_size candidates seen so far. Like Redis, the pool makes a small
+// sample nearly as good as a large one, since the good candidates of the
+// previous samples are not forgotten.
+static void evictPoolPopulate() {
+  std::vector<EvictCandidate> &pool = local_data->evict_pool;
+  hashTableNode *nodes[k_evict_pool_size];
+  size_t n = keyspaceSample(nodes, global_data.maxmemory_samples);
+  for (size_t i = 0; i < n; i++) {
+    Entry *ent = container_of(nodes[i], Entry, HTNode);
+    uint64_t idle = evictIdle(ent);
+    if (pool.size() == k_evict_pool_size && idle <= pool[0].idle) {
+      continue;
+    }
+    // The key may already be in the pool from an earlier sample
+    std::string_view key = EntryKey(ent);
+    bool known = false;
+    for (const EvictCandidate &cand : pool) {
+      known = known || cand.key == key;
+    }
+    if (known) {
+      continue;
+    }
+    size_t pos = 0;
+    while (pos < pool.size() && pool[pos].idle < idle) {
+      pos++;
+    }
+    if (pool.size() == k_evict_pool_size) {
+      // Drop the worst one to make room
+      pool.erase(pool.begin());
+      pos--;
+    }
+    EvictCandidate cand;
+    cand.idle = idle;
+    cand.key.assign(key.data(), key.size());
+    pool.insert(pool.begin() + pos, std::move(cand));
+  }
+}
+
+// Evict one key of the current shard, false if there is none. A sample may
+// find nothing in a sparse table, so like Redis' dictGetRandomKey() it is
+// retried until a key is found.
+static bool evictOne() {
+  hashTableNode *node = NULL;
+  std::vector<EvictCandidate> &pool = local_data->evict_pool;
+  while (!node && keyspaceSize() > 0) {
+    if (global_data.maxmemory_policy == EVICT_RANDOM) {
+      if (keyspaceSample(&node, 1) == 1) {
+        node = keyspacePop(node, &hashNodeSame);
+      }
+      continue;
+    }
+    evictPoolPopulate();
+    if (pool.empty()) {
+      continue;
+    }
+    // The best candidate, unless it was deleted since it was sampled
+    LookupKey key;
+    key.key = pool.back().key;
+    key.HTNode.hash_value =
+        strHash((const uint8_t *)key.key.data(), key.key.size());
+    node = keyspacePop(&key.HTNode, &entryEQ);
+    pool.pop_back();
+  }
+  if (!node) {
+    return false;
+  }
+  Entry *ent = container_of(node, Entry, HTNode);
+  // Logged before the write that needed the room, so a replay ends up with
+  // the same keys
+  if (global_data.aof.fd >= 0) {
+    std::string_view args[] = {"del", EntryKey(ent)};
+    AOFEncode(global_data.aof.buf, args, 2);
+  }
+  entryDel(ent);
+  local_data->stats.evicted_keys++;
+  return true;
+}
+
+// Called by the writes that may use more memory, before they look up their
+// keys. Evicts keys until the shard is within its share of maxmemory, and
+// returns false (with an error in out) if it cannot. Like Redis, a write
+// that starts under the limit is allowed to end over it.
+static bool memoryMakeRoom(std::string &out) {
+  if (global_data.maxmemory == 0 || global_data.aof_loading) {
+    return true;
+  }
+  size_t limit = global_data.maxmemory / global_data.nthreads;
+  while (local_data->used_memory > limit) {
+    if (global_data.maxmemory_policy == EVICT_NONE || !evictOne()) {
+      outErr(out, ERR_OOM,
+             "command not allowed when used memory > 'maxmemory'");
+      return false;
+    }
+  }
+  return true;
+}
+// Find a key, expired keys are removed on access
+static Entry *entryLookup(std::string_view name) {
+  LookupKey key;
+  key.key = name;
+  key.HTNode.hash_value = strHash((uint8_t *)name.data(), name.size());
+  hashTableNode *node = keyspaceLookup(&key.HTNode, &entryEQ);
+  if (!node) {
+    return NULL;
+  }
+  Entry *ent = container_of(node, Entry, HTNode);
+  if (entryExpired(ent, getMonotonicMsec())) {
+    keyspacePop(&key.HTNode, &entryEQ);
+    entryDel(ent);
+    return NULL;
+  }
+  entryTouch(ent);
+  return ent;
+}
+
+// Upper bound on the time spent removing expired keys per event loop
+// iteration, a mass expiry is spread over several iterations instead of
+// causing a latency spike
+const uint64_t k_expire_budget_us = 1000;
+
+// Poll timeout: wake up in time for the nearest expiration
+static int32_t nextTimerMs() {
+  const int32_t k_idle_timeout_ms = 1000;
+  std::vector<HeapItem> &heap = local_data->heap;
+  if (heap.empty()) {
+    return k_idle_timeout_ms;
+  }
+  uint64_t now_ms = getMonotonicMsec();
+  if (heap[0].val <= now_ms) {
+    return 0;
+  }
+  uint64_t wait_ms = heap[0].val - now_ms;
+  return wait_ms < (uint64_t)k_idle_timeout_ms ? (int32_t)wait_ms
+                                               : k_idle_timeout_ms;
+}
+
+static uint64_t getMonotonicUsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t getMonotonicNsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// Active expiration, called by the event loop after handling the IO events
+static void processTimers() {
+  std::vector<HeapItem> &heap = local_data->heap;
+  uint64_t start_us = getMonotonicUsec();
+  uint64_t now_ms = start_us / 1000;
+  size_t nworks = 0;
+  while (!heap.empty() && heap[0].val <= now_ms) {
+    Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+    hashTableNode *node = keyspacePop(&ent->HTNode, &hashNodeSame);
+    assert(node == &ent->HTNode);
+    entryDel(ent);
+    // Reading the clock is not free, check the budget every few keys
+    if ((++nworks & 0x1f) == 0 &&
+        getMonotonicUsec() - start_us >= k_expire_budget_us) {
+      break;
+    }
+  }
+}
+
+// Time given to an idle resize step, and the nodes moved between two reads of
+// the clock
+const uint64_t k_rehash_budget_us = 1000;
+const size_t k_rehash_work = 1024;
+
+// Progressive resizing only moves a few nodes per operation, so after a burst
+// of inserts or deletes the keyspace could stay split over two tables, and
+// every lookup probe both, until the traffic comes back. Called by the event
+// loop when it has nothing else to do. Returns true if the resize is not done.
+static bool processRehash() {
+  uint64_t start_us = getMonotonicUsec();
+  while (keyspaceRehash(k_rehash_work)) {
+    if (getMonotonicUsec() - start_us >= k_rehash_budget_us) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Period of the commands per second sample
+const uint64_t k_ops_sample_ms = 1000;
+
+// Commands per second of the current shard, measured over the last
+// k_ops_sample_ms or more. Called by the event loop, which also refreshes the
+// LRU clock here, so an access does not read the time.
+static void statsSample() {
+  ShardStats &stats = local_data->stats;
+  uint64_t now_ms = getMonotonicMsec();
+  local_data->lru_clock = (uint32_t)(now_ms / 1000) & k_lru_clock_max;
+  uint64_t elapsed_ms = now_ms - stats.sample_ms;
+  if (elapsed_ms < k_ops_sample_ms) {
+    return;
+  }
+  if (stats.sample_ms != 0) {
+    stats.ops_per_sec =
+        (stats.commands - stats.sample_commands) * 1000 / elapsed_ms;
+  }
+  stats.sample_ms = now_ms;
+  stats.sample_commands = stats.commands;
+}
+
+static void outStr(std::string &out, std::string_view val);
 // void* pointer: means it can point to any type
 static void callbackScan(hashTableNode *HTNode, void *arg) {
   // (std::string *)arg: cast arg to type string *
   // *(std::string *)arg: dereferences the type pointer, now it points to the
   //                      actual string object
-  std::string &out = *(std::string *)arg;
-  outStr(out, container_of(HTNode, Entry, HTNode)->key);
+  KeysArg &keys = *(KeysArg *)arg;
+  Entry *ent = container_of(HTNode, Entry, HTNode);
+  // Expired keys that have not been removed yet are skipped
+  if (!entryExpired(ent, keys.now_ms)) {
+    outStr(*keys.out, EntryKey(ent));
+    keys.n++;
+  }
 }
 
-static void outArr(std::string &out, uint32_t n);
-static void keyScan(hashTable *HTable, void (*f)(hashTableNode *, void *),
-                    void *arg);
+static size_t outBeginArr(std::string &out);
+static void outEndArr(std::string &out, size_t ctx, uint32_t n);
 static void callbackScan(hashTableNode *HTNode, void *arg);
-static void doKeys(std::vector<std::string> &cmd, std::string &out) {
+static void doKeys(std::vector<std::string_view> &cmd, std::string &out) {
   (void)cmd;
-  outArr(out, (uint32_t)HMSize(&global_data.HMap));
-  keyScan(&global_data.HMap.current_HT, &callbackScan, &out);
-  keyScan(&global_data.HMap.previous_HT, &callbackScan, &out);
+  KeysArg keys;
+  keys.out = &out;
+  keys.now_ms = getMonotonicMsec();
+  size_t ctx = outBeginArr(out);
+  keyspaceForEach(&callbackScan, &keys);
+  outEndArr(out, ctx, keys.n);
 }
 
-static void outNil(std::string &out);
-static void outStr(std::string &out, const std::string &val);
-static void doGet(std::vector<std::string> &cmd, std::string &out) {
-  Entry key;
-  key.key = cmd[1];
-  key.HTNode.hash_value = strHash((uint8_t *)key.key.data(), key.key.size());
-  hashTableNode *node = HMLookup(&global_data.HMap, &key.HTNode, &entryEQ);
-  if (!node) {
-    return outNil(out);
+// Glob-style pattern matching: * ? [abc] [^a-z] and \ to escape
+static bool globMatch(std::string_view pattern, std::string_view str) {
+  size_t p = 0, s = 0;
+  // Where to resume after the last '*' if the rest does not match
+  size_t star_p = std::string_view::npos, star_s = 0;
+  while (s < str.size()) {
+    if (p < pattern.size()) {
+      char c = pattern[p];
+      if (c == '*') {
+        star_p = ++p;
+        star_s = s;
+        continue;
+      }
+      if (c == '?') {
+        p++;
+        s++;
+        continue;
+      }
+      if (c == '[') {
+        size_t q = p + 1;
+        bool negate = q < pattern.size() && pattern[q] == '^';
+        q += negate ? 1 : 0;
+        bool found = false;
+        // A ']' right after the '[' is a literal
+        size_t first = q;
+        while (q < pattern.size() && (q == first || pattern[q] != ']')) {
+          if (pattern[q] == '\\' && q + 1 < pattern.size()) {
+            q++;
+          }
+          char lo = pattern[q], hi = lo;
+          if (q + 2 < pattern.size() && pattern[q + 1] == '-' &&
+              pattern[q + 2] != ']') {
+            hi = pattern[q + 2];
+            q += 2;
+          }
+          if (lo > hi) {
+            std::swap(lo, hi);
+          }
+          found = found || (lo <= str[s] && str[s] <= hi);
+          q++;
+        }
+        if (q < pattern.size() && found != negate) {
+          // q is at the closing ']'
+          p = q + 1;
+          s++;
+          continue;
+        }
+      } else {
+        if (c == '\\' && p + 1 < pattern.size()) {
+          c = pattern[++p];
+        }
+        if (c == str[s]) {
+          p++;
+          s++;
+          continue;
+        }
+      }
+    }
+    // Mismatch, let the last '*' eat one more character
+    if (star_p == std::string_view::npos) {
+      return false;
+    }
+    p = star_p;
+    s = ++star_s;
+  }
+  while (p < pattern.size() && pattern[p] == '*') {
+    p++;
   }
-  const std::string &val = container_of(node, Entry, HTNode)->value;
-  outStr(out, val);
+  return p == pattern.size();
 }
 
-static void outNil(std::string &out);
-static void doSet(std::vector<std::string> &cmd, std::string &out) {
-  Entry key;
-  key.key = cmd[1];
-  key.HTNode.hash_value = strHash((uint8_t *)key.key.data(), key.key.size());
-  hashTableNode *node = HMLookup(&global_data.HMap, &key.HTNode, &entryEQ);
-  if (node) {
-    container_of(node, Entry, HTNode)->value = cmd[2];
-  } else {
-    Entry *new_entry = new Entry();
-    new_entry->key = key.key;
-    new_entry->HTNode.hash_value = key.HTNode.hash_value;
-    new_entry->value = cmd[2];
-    HMInsert(&global_data.HMap, &new_entry->HTNode);
+static bool globMatch(std::string_view pattern, std::string_view str);
+static void outStr(std::string &out, std::string_view val);
+static void callbackScanMatch(hashTableNode *HTNode, void *arg) {
+  KeysArg &keys = *(KeysArg *)arg;
+  Entry *ent = container_of(HTNode, Entry, HTNode);
+  if (!entryExpired(ent, keys.now_ms) &&
+      (keys.pattern.empty() || globMatch(keys.pattern, EntryKey(ent)))) {
+    outStr(*keys.out, EntryKey(ent));
+    keys.n++;
   }
-  return outNil(out);
 }
 
+// SCAN cursor [MATCH pattern] [COUNT count]
+// Replies [next cursor, [keys]], the scan is done when the cursor is 0 again.
+// COUNT is a hint of how many keys to return per call.
+static bool cmdIs(std::string_view word, const char *cmd);
+static void outArr(std::string &out, uint32_t n);
 static void outInt(std::string &out, int64_t val);
-static void doDel(std::vector<std::string> &cmd, std::string &out) {
-  Entry key;
-  key.key = cmd[1];
-  key.HTNode.hash_value = strHash((uint8_t *)key.key.data(), key.key.size());
-  hashTableNode *deleted_node = HMPop(&global_data.HMap, &key.HTNode, &entryEQ);
-  if (deleted_node) {
-    delete container_of(deleted_node, Entry, HTNode);
+static void doScan(std::vector<std::string_view> &cmd, std::string &out) {
+  int64_t cursor = 0;
+  if (!str2int(cmd[1], cursor) || cursor < 0 ||
+      ((uint64_t)cursor >> k_cursor_shard_shift) >= global_data.nthreads) {
+    return outErr(out, ERR_ARG, "invalid cursor");
   }
-  return outInt(out, deleted_node ? 1 : 0);
-}
+  KeysArg keys;
+  keys.out = &out;
+  keys.now_ms = getMonotonicMsec();
+  int64_t count = 10;
+  for (size_t i = 2; i < cmd.size(); i += 2) {
+    if (i + 1 >= cmd.size()) {
+      return outErr(out, ERR_ARG, "syntax error");
+    }
+    if (cmdIs(cmd[i], "match")) {
+      keys.pattern = cmd[i + 1];
+      // "*" matches everything, skip the matching
+      if (keys.pattern == "*") {
+        keys.pattern = std::string_view();
+      }
+    } else if (cmdIs(cmd[i], "count")) {
+      if (!str2int(cmd[i + 1], count) || count < 1) {
+        return outErr(out, ERR_ARG, "expect positive count");
+      }
+    } else {
+      return outErr(out, ERR_ARG, "syntax error");
+    }
+  }
+  assert(((uint64_t)cursor >> k_cursor_shard_shift) == local_data->id);
 
-static void outStr(std::string &out, const std::string &val) {
-  out.push_back(SER_STR);
-  uint32_t len = (uint32_t)val.size();
-  // To ensures that the length of the string is stored as a binary
-  // representation in the out string.
-  out.append((char *)&len, 4);
-  out.append(val);
-}
+  // The reply is [cursor, keys], the cursor is patched in when known
+  outArr(out, 2);
+  size_t cursor_pos = out.size();
+  outInt(out, 0);
+  size_t ctx = outBeginArr(out);
+  size_t pos = (uint64_t)cursor & ((1ull << k_cursor_shard_shift) - 1);
+  // Visits of empty buckets (or of keys that do not match) are bounded too
+  int64_t max_steps = count * 10;
+  do {
+    pos = keyspaceScan(pos, &callbackScanMatch, &keys);
+  } while (pos != 0 && --max_steps > 0 && keys.n < (uint64_t)count);
+  outEndArr(out, ctx, keys.n);
 
-static void outInt(std::string &out, int64_t val) {
-  out.push_back(SER_INT);
-  out.append((char *)&val, 8);
+  uint64_t next = pos | ((uint64_t)local_data->id << k_cursor_shard_shift);
+  if (pos == 0) {
+    // This shard is done, continue with the next one
+    uint64_t id = local_data->id + 1;
+    next = id < global_data.nthreads ? id << k_cursor_shard_shift : 0;
+  }
+  int64_t val = (int64_t)next;
+  memcpy(&out[cursor_pos + 1], &val, 8);
 }
 
-static void outErr(std::string &out, int32_t error_code,
+static void outNil(std::string &out);
+static void outStr(std::string &out, std::string_view val);
+static void doGet(std::vector<std::string_view> &cmd, std::string &out) {
+  Entry *ent = entryLookup(cmd[1]);
+  if (!ent) {
+    return outNil(out);
+  }
+  if (ent->type != T_STR) {
+    return outErr(out, ERR_TYPE, "expect string type");
+  }
+  char buf[k_entry_int_len];
+  outStr(out, EntryValue(ent, buf));
+}
+
+// Give an existing key a string value
+static void entrySetStr(Entry *ent, std::string_view val) {
+  local_data->used_memory -= EntryMemory(ent);
+  if (ent->type != T_STR) {
+    // Like Redis, SET overwrites a value of any type
+    ZSetDispose(ent->zset);
+    delete ent->zset;
+    ent->zset = NULL;
+    ent->type = T_STR;
+  }
+  EntrySetValue(ent, val);
+  local_data->used_memory += EntryMemory(ent);
+  // Like Redis, SET discards the TTL
+  entrySetTTL(ent, -1);
+}
+
+static void outNil(std::string &out);
+static void doSet(std::vector<std::string_view> &cmd, std::string &out) {
+  if (!memoryMakeRoom(out)) {
+    return;
+  }
+  // The only place request bytes are copied: storing a value or a new key
+  Entry *ent = entryLookup(cmd[1]);
+  if (!ent) {
+    entryNew(cmd[1], T_STR, cmd[2]);
+    return outNil(out);
+  }
+  entrySetStr(ent, cmd[2]);
+  return outNil(out);
+}
+
+static void outInt(std::string &out, int64_t val);
+static void doDel(std::vector<std::string_view> &cmd, std::string &out) {
+  LookupKey key;
+  key.key = cmd[1];
+  key.HTNode.hash_value = strHash((uint8_t *)key.key.data(), key.key.size());
+  hashTableNode *deleted_node = keyspacePop(&key.HTNode, &entryEQ);
+  bool deleted = false;
+  if (deleted_node) {
+    Entry *ent = container_of(deleted_node, Entry, HTNode);
+    // An expired key counts as already deleted
+    deleted = !entryExpired(ent, getMonotonicMsec());
+    entryDel(ent);
+  }
+  return outInt(out, deleted ? 1 : 0);
+}
+
+// Hash the keys of a multi-key command, found at cmd[1], cmd[1 + step], ...
+static void lookupKeys(std::vector<std::string_view> &cmd, size_t step,
+                       std::vector<LookupKey> &keys) {
+  keys.resize((cmd.size() - 1) / step);
+  for (size_t i = 0; i < keys.size(); i++) {
+    std::string_view name = cmd[1 + i * step];
+    keys[i].key = name;
+    keys[i].HTNode.hash_value = strHash((uint8_t *)name.data(), name.size());
+  }
+}
+
+// entryLookup() for all the keys at once with one batched lookup. The
+// expired ones are removed once every key has been looked up, so a key given
+// twice does not leave a dangling pointer.
+static void entryLookupBatch(std::vector<LookupKey> &keys,
+                             std::vector<Entry *> &ents) {
+  size_t n = keys.size();
+  std::vector<hashTableNode *> key_nodes(n);
+  std::vector<hashTableNode *> nodes(n);
+  for (size_t i = 0; i < n; i++) {
+    key_nodes[i] = &keys[i].HTNode;
+  }
+  keyspaceLookupBatch(key_nodes.data(), n, nodes.data(), &entryEQ);
+  ents.assign(n, NULL);
+  uint64_t now_ms = getMonotonicMsec();
+  bool expired = false;
+  for (size_t i = 0; i < n; i++) {
+    Entry *ent = nodes[i] ? container_of(nodes[i], Entry, HTNode) : NULL;
+    if (ent && entryExpired(ent, now_ms)) {
+      expired = true;
+      continue;
+    }
+    if (ent) {
+      entryTouch(ent);
+    }
+    ents[i] = ent;
+  }
+  for (size_t i = 0; expired && i < n; i++) {
+    if (nodes[i] && !ents[i]) {
+      if (hashTableNode *node = keyspacePop(&keys[i].HTNode, &entryEQ)) {
+        entryDel(container_of(node, Entry, HTNode));
+      }
+    }
+  }
+}
+
+// MGET key [key ...]: like GET for every key, a key that does not hold a
+// string is nil instead of an error, as in Redis
+static void outArr(std::string &out, uint32_t n);
+static void doMGet(std::vector<std::string_view> &cmd, std::string &out) {
+  std::vector<LookupKey> keys;
+  std::vector<Entry *> ents;
+  lookupKeys(cmd, 1, keys);
+  entryLookupBatch(keys, ents);
+  outArr(out, (uint32_t)ents.size());
+  for (Entry *ent : ents) {
+    if (ent && ent->type == T_STR) {
+      char buf[k_entry_int_len];
+      outStr(out, EntryValue(ent, buf));
+    } else {
+      outNil(out);
+    }
+  }
+}
+
+// MSET key value [key value ...]
+static void doMSet(std::vector<std::string_view> &cmd, std::string &out) {
+  if (cmd.size() % 2 != 1) {
+    return outErr(out, ERR_ARG, "wrong number of arguments");
+  }
+  if (!memoryMakeRoom(out)) {
+    return;
+  }
+  std::vector<LookupKey> keys;
+  std::vector<Entry *> ents;
+  lookupKeys(cmd, 2, keys);
+  entryLookupBatch(keys, ents);
+  for (size_t i = 0; i < ents.size(); i++) {
+    std::string_view name = cmd[1 + i * 2];
+    std::string_view val = cmd[2 + i * 2];
+    // A new key may have been created by an earlier pair
+    Entry *ent = ents[i] ? ents[i] : entryLookup(name);
+    if (!ent) {
+      entryNew(name, T_STR, val);
+    } else {
+      entrySetStr(ent, val);
+    }
+  }
+  return outNil(out);
+}
+
+// MDEL key [key ...]: the number of keys deleted
+static void doMDel(std::vector<std::string_view> &cmd, std::string &out) {
+  std::vector<LookupKey> keys;
+  std::vector<Entry *> ents;
+  lookupKeys(cmd, 1, keys);
+  entryLookupBatch(keys, ents);
+  int64_t deleted = 0;
+  for (size_t i = 0; i < ents.size(); i++) {
+    if (!ents[i]) {
+      continue;
+    }
+    // Popped by key, a key given twice is only found the first time
+    if (hashTableNode *node = keyspacePop(&keys[i].HTNode, &entryEQ)) {
+      entryDel(container_of(node, Entry, HTNode));
+      deleted++;
+    }
+  }
+  return outInt(out, deleted);
+}
+
+// The current value of the string key to increment, as an integer. A missing
+// key is 0. False with the error in out otherwise.
+static bool incrValue(Entry *ent, int64_t &val, std::string &out) {
+  val = 0;
+  if (!ent) {
+    return true;
+  }
+  if (ent->type != T_STR) {
+    outErr(out, ERR_TYPE, "expect string type");
+    return false;
+  }
+  if (ent->encoding == ENC_INT) {
+    val = ent->ival;
+    return true;
+  }
+  // Like Redis, only the canonical form is an integer: "007" is not
+  char buf[k_entry_int_len];
+  if (!EntryStrInt(EntryValue(ent, buf), &val)) {
+    outErr(out, ERR_ARG, "value is not an integer or out of range");
+    return false;
+  }
+  return true;
+}
+
+// INCR key, DECR key, INCRBY key delta, DECRBY key delta: done in place on
+// the int64_t of an ENC_INT value. The TTL is kept, unlike SET.
+static void doIncr(std::vector<std::string_view> &cmd, std::string &out) {
+  bool decr = cmd[0][0] == 'd' || cmd[0][0] == 'D';
+  int64_t delta = 1;
+  if (cmd.size() == 3 &&
+      (!str2int(cmd[2], delta) || (decr && delta == INT64_MIN))) {
+    return outErr(out, ERR_ARG, "value is not an integer or out of range");
+  }
+  delta = decr ? -delta : delta;
+  if (!memoryMakeRoom(out)) {
+    return;
+  }
+  Entry *ent = entryLookup(cmd[1]);
+  int64_t val = 0;
+  if (!incrValue(ent, val, out)) {
+    return;
+  }
+  if (__builtin_add_overflow(val, delta, &val)) {
+    return outErr(out, ERR_ARG, "increment or decrement would overflow");
+  }
+  if (!ent) {
+    ent = entryNew(cmd[1], T_STR, "");
+  }
+  local_data->used_memory -= EntryMemory(ent);
+  EntrySetInt(ent, val);
+  local_data->used_memory += EntryMemory(ent);
+  return outInt(out, val);
+}
+
+// INCRBYFLOAT key delta: the result is stored, and replied, as a string. One
+// that happens to be an integer ("3") is stored as ENC_INT like any other.
+static bool str2dbl(std::string_view s, double &out);
+static void doIncrByFloat(std::vector<std::string_view> &cmd,
+                          std::string &out) {
+  double delta = 0;
+  if (!str2dbl(cmd[2], delta) || !std::isfinite(delta)) {
+    return outErr(out, ERR_ARG, "value is not a valid float");
+  }
+  if (!memoryMakeRoom(out)) {
+    return;
+  }
+  Entry *ent = entryLookup(cmd[1]);
+  if (ent && ent->type != T_STR) {
+    return outErr(out, ERR_TYPE, "expect string type");
+  }
+  double val = 0;
+  if (ent) {
+    char buf[k_entry_int_len];
+    if (!str2dbl(EntryValue(ent, buf), val)) {
+      return outErr(out, ERR_ARG, "value is not a valid float");
+    }
+  }
+  val += delta;
+  if (!std::isfinite(val)) {
+    return outErr(out, ERR_ARG, "increment would produce NaN or Infinity");
+  }
+  // The shortest text that reads back as the same double, e.g. "10.6"
+  char text[32];
+  std::to_chars_result res = std::to_chars(text, text + sizeof(text), val);
+  std::string_view result(text, (size_t)(res.ptr - text));
+  if (!ent) {
+    ent = entryNew(cmd[1], T_STR, result);
+  } else {
+    local_data->used_memory -= EntryMemory(ent);
+    EntrySetValue(ent, result);
+    local_data->used_memory += EntryMemory(ent);
+  }
+  return outStr(out, result);
+}
+
+// Case-insensitive match of an option keyword
+static bool cmdIs(std::string_view word, const char *cmd) {
+  return word.size() == strlen(cmd) &&
+         strncasecmp(word.data(), cmd, word.size()) == 0;
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+  const char *end = s.data() + s.size();
+  std::from_chars_result res = std::from_chars(s.data(), end, out);
+  return !s.empty() && res.ec == std::errc() && res.ptr == end;
+}
+
+// Accepts what from_chars() does plus a leading '+' ("+inf"), rejects NaN
+static bool str2dbl(std::string_view s, double &out) {
+  if (!s.empty() && s[0] == '+') {
+    s.remove_prefix(1);
+  }
+  const char *end = s.data() + s.size();
+  std::from_chars_result res = std::from_chars(s.data(), end, out);
+  return !s.empty() && res.ec == std::errc() && res.ptr == end &&
+         !std::isnan(out);
+}
+
+static uint64_t getWallMsec();
+// The time argument of the EXPIRE family as a TTL in milliseconds, an
+// absolute time in the past gives 0
+static bool expireTTL(std::vector<std::string_view> &cmd, int64_t &ttl) {
+  if (!str2int(cmd[2], ttl)) {
+    return false;
+  }
+  bool seconds = cmd[0][0] == 'e' || cmd[0][0] == 'E'; // vs "pexpire..."
+  if (seconds) {
+    if (ttl > INT64_MAX / 1000 || ttl < INT64_MIN / 1000) {
+      return false;
+    }
+    ttl *= 1000;
+  }
+  if (cmd[0].size() >= 8) { // "expireat", "pexpireat": unix time
+    int64_t now = (int64_t)getWallMsec();
+    ttl = ttl > now ? ttl - now : 0;
+  }
+  return true;
+}
+
+// EXPIRE key seconds, PEXPIRE key milliseconds,
+// EXPIREAT key unix-seconds, PEXPIREAT key unix-milliseconds
+static void doExpire(std::vector<std::string_view> &cmd, std::string &out) {
+  int64_t ttl = 0;
+  if (!expireTTL(cmd, ttl)) {
+    return outErr(out, ERR_ARG, "invalid expire time");
+  }
+  Entry *ent = entryLookup(cmd[1]);
+  if (!ent) {
+    return outInt(out, 0);
+  }
+  if (ttl <= 0) {
+    // A TTL in the past deletes the key
+    keyspacePop(&ent->HTNode, &hashNodeSame);
+    entryDel(ent);
+  } else {
+    entrySetTTL(ent, ttl);
+  }
+  return outInt(out, 1);
+}
+
+// TTL key, PTTL key: -2 if the key does not exist, -1 if it has no TTL
+static void doTTL(std::vector<std::string_view> &cmd, std::string &out) {
+  Entry *ent = entryLookup(cmd[1]);
+  if (!ent) {
+    return outInt(out, -2);
+  }
+  if (ent->heap_idx == (size_t)-1) {
+    return outInt(out, -1);
+  }
+  uint64_t expire_at = local_data->heap[ent->heap_idx].val;
+  uint64_t now_ms = getMonotonicMsec();
+  int64_t ttl_ms = expire_at > now_ms ? (int64_t)(expire_at - now_ms) : 0;
+  bool seconds = cmd[0].size() == 3; // "ttl" vs "pttl"
+  return outInt(out, seconds ? (ttl_ms + 500) / 1000 : ttl_ms);
+}
+
+static void doPersist(std::vector<std::string_view> &cmd, std::string &out) {
+  Entry *ent = entryLookup(cmd[1]);
+  if (!ent || ent->heap_idx == (size_t)-1) {
+    return outInt(out, 0);
+  }
+  entrySetTTL(ent, -1);
+  return outInt(out, 1);
+}
+
+static void outDbl(std::string &out, double val);
+// Count the change of a sorted set's memory, before is its ZSetMemory() before
+// the change
+static void zsetAccount(ZSet *zset, size_t before) {
+  local_data->used_memory += ZSetMemory(zset);
+  local_data->used_memory -= before;
+}
+
+// Find a sorted set. Returns false (with an error in out) if the key holds
+// another type, *zset is NULL if the key does not exist.
+static bool zsetFind(std::string_view name, ZSet **zset, std::string &out) {
+  *zset = NULL;
+  Entry *ent = entryLookup(name);
+  if (!ent) {
+    return true;
+  }
+  if (ent->type != T_ZSET) {
+    outErr(out, ERR_TYPE, "expect zset");
+    return false;
+  }
+  *zset = ent->zset;
+  return true;
+}
+
+// ZADD key score name [score name ...]
+static void doZAdd(std::vector<std::string_view> &cmd, std::string &out) {
+  if (cmd.size() % 2 != 0) {
+    return outErr(out, ERR_ARG, "wrong number of arguments");
+  }
+  // Validate every score before touching the set
+  std::vector<double> scores(cmd.size() / 2 - 1);
+  for (size_t i = 0; i < scores.size(); i++) {
+    if (!str2dbl(cmd[2 + 2 * i], scores[i])) {
+      return outErr(out, ERR_ARG, "expect fp number");
+    }
+  }
+  if (!memoryMakeRoom(out)) {
+    return;
+  }
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  if (!zset) {
+    zset = entryNew(cmd[1], T_ZSET, "")->zset;
+  }
+  size_t before = ZSetMemory(zset);
+  int64_t added = 0;
+  for (size_t i = 0; i < scores.size(); i++) {
+    std::string_view name = cmd[3 + 2 * i];
+    added += ZSetInsert(zset, name.data(), name.size(), scores[i]) ? 1 : 0;
+  }
+  zsetAccount(zset, before);
+  return outInt(out, added);
+}
+
+// ZREM key name [name ...]
+static void zsetAccount(ZSet *zset, size_t before);
+static void doZRem(std::vector<std::string_view> &cmd, std::string &out) {
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  if (!zset) {
+    return outInt(out, 0);
+  }
+  size_t before = ZSetMemory(zset);
+  int64_t removed = 0;
+  for (size_t i = 2; i < cmd.size(); i++) {
+    ZNode *node = ZSetPop(zset, cmd[i].data(), cmd[i].size());
+    if (node) {
+      ZNodeDel(node);
+      removed++;
+    }
+  }
+  zsetAccount(zset, before);
+  if (!zset->tree) {
+    // Like Redis, an empty sorted set is removed
+    Entry *ent = entryLookup(cmd[1]);
+    keyspacePop(&ent->HTNode, &hashNodeSame);
+    entryDel(ent);
+  }
+  return outInt(out, removed);
+}
+
+// ZSCORE key name
+static void doZScore(std::vector<std::string_view> &cmd, std::string &out) {
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  ZNode *node = zset ? ZSetLookup(zset, cmd[2].data(), cmd[2].size()) : NULL;
+  return node ? outDbl(out, node->score) : outNil(out);
+}
+
+// A ZRANGEBYSCORE bound: a number, "-inf"/"+inf", "(" makes it exclusive
+static bool parseScoreBound(std::string_view s, double &val, bool &excl) {
+  excl = !s.empty() && s[0] == '(';
+  if (excl) {
+    s.remove_prefix(1);
+  }
+  return str2dbl(s, val);
+}
+
+// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+// The matching nodes are streamed from the tree in order and the walk stops
+// as soon as the limit is reached.
+static void doZRangeByScore(std::vector<std::string_view> &cmd,
+                            std::string &out) {
+  double min = 0, max = 0;
+  bool min_excl = false, max_excl = false;
+  if (!parseScoreBound(cmd[2], min, min_excl) ||
+      !parseScoreBound(cmd[3], max, max_excl)) {
+    return outErr(out, ERR_ARG, "min or max is not a float");
+  }
+  bool with_scores = false;
+  int64_t offset = 0, limit = -1;
+  for (size_t i = 4; i < cmd.size(); i++) {
+    if (cmdIs(cmd[i], "withscores")) {
+      with_scores = true;
+    } else if (cmdIs(cmd[i], "limit") && i + 2 < cmd.size()) {
+      if (!str2int(cmd[i + 1], offset) || !str2int(cmd[i + 2], limit)) {
+        return outErr(out, ERR_ARG, "expect int64");
+      }
+      i += 2;
+    } else {
+      return outErr(out, ERR_ARG, "syntax error");
+    }
+  }
+
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  size_t ctx = outBeginArr(out);
+  uint32_t n = 0;
+  ZNode *node = (zset && offset >= 0) ? ZSetSeek(zset, min, min_excl) : NULL;
+  // Deep pagination jumps over the skipped nodes in O(log n)
+  node = ZNodeOffset(node, offset);
+  for (; node && limit != 0; node = ZNodeNext(node), limit--) {
+    if (node->score > max || (max_excl && node->score == max)) {
+      break;
+    }
+    outStr(out, std::string_view(node->name, node->len));
+    n++;
+    if (with_scores) {
+      outDbl(out, node->score);
+      n++;
+    }
+  }
+  outEndArr(out, ctx, n);
+}
+
+// ZRANK key name, ZREVRANK key name
+static void doZRank(std::vector<std::string_view> &cmd, std::string &out) {
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  ZNode *node = zset ? ZSetLookup(zset, cmd[2].data(), cmd[2].size()) : NULL;
+  if (!node) {
+    return outNil(out);
+  }
+  int64_t rank = ZNodeRank(node);
+  bool reverse = cmd[0].size() == 8; // "zrevrank" vs "zrank"
+  return outInt(out, reverse ? (int64_t)ZSetSize(zset) - 1 - rank : rank);
+}
+
+// ZRANGE key start stop [WITHSCORES], negative indexes count from the end
+static void doZRange(std::vector<std::string_view> &cmd, std::string &out) {
+  int64_t start = 0, stop = 0;
+  if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+    return outErr(out, ERR_ARG, "expect int64");
+  }
+  bool with_scores = false;
+  if (cmd.size() == 5) {
+    if (!cmdIs(cmd[4], "withscores")) {
+      return outErr(out, ERR_ARG, "syntax error");
+    }
+    with_scores = true;
+  } else if (cmd.size() > 5) {
+    return outErr(out, ERR_ARG, "syntax error");
+  }
+
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  int64_t size = zset ? (int64_t)ZSetSize(zset) : 0;
+  start = start < 0 ? std::max<int64_t>(size + start, 0) : start;
+  stop = stop < 0 ? size + stop : std::min<int64_t>(stop, size - 1);
+
+  size_t ctx = outBeginArr(out);
+  uint32_t n = 0;
+  // Seek to the start by rank in O(log n), then walk the successors
+  ZNode *node = (start <= stop) ? ZSetAt(zset, start) : NULL;
+  for (int64_t i = start; node && i <= stop; i++, node = ZNodeNext(node)) {
+    outStr(out, std::string_view(node->name, node->len));
+    n++;
+    if (with_scores) {
+      outDbl(out, node->score);
+      n++;
+    }
+  }
+  outEndArr(out, ctx, n);
+}
+
+// ZCOUNT key min max, the difference of two ranks, O(log n)
+static void doZCount(std::vector<std::string_view> &cmd, std::string &out) {
+  double min = 0, max = 0;
+  bool min_excl = false, max_excl = false;
+  if (!parseScoreBound(cmd[2], min, min_excl) ||
+      !parseScoreBound(cmd[3], max, max_excl)) {
+    return outErr(out, ERR_ARG, "min or max is not a float");
+  }
+  ZSet *zset = NULL;
+  if (!zsetFind(cmd[1], &zset, out)) {
+    return;
+  }
+  if (!zset) {
+    return outInt(out, 0);
+  }
+  int64_t size = (int64_t)ZSetSize(zset);
+  ZNode *lo = ZSetSeek(zset, min, min_excl);
+  // The first node past the range
+  ZNode *hi = ZSetSeek(zset, max, !max_excl);
+  int64_t lo_rank = lo ? ZNodeRank(lo) : size;
+  int64_t hi_rank = hi ? ZNodeRank(hi) : size;
+  return outInt(out, hi_rank > lo_rank ? hi_rank - lo_rank : 0);
+}
+
+static uint64_t getWallMsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_REALTIME, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+struct RDBSaveArg {
+  RDBWriter *w = NULL;
+  uint64_t now_ms = 0;  // monotonic, for the TTL heap
+  uint64_t wall_ms = 0; // the file has absolute unix times
+  size_t nkeys = 0;
+};
+
+static void rdbSaveEntry(hashTableNode *HTNode, void *arg) {
+  RDBSaveArg &save = *(RDBSaveArg *)arg;
+  RDBWriter *w = save.w;
+  Entry *ent = container_of(HTNode, Entry, HTNode);
+  if (ent->heap_idx != (size_t)-1) {
+    uint64_t expire_ms = local_data->heap[ent->heap_idx].val;
+    if (expire_ms <= save.now_ms) {
+      return;
+    }
+    RDBWriteByte(w, RDB_OPCODE_EXPIRETIME_MS);
+    RDBWriteMillis(w, (int64_t)(save.wall_ms + (expire_ms - save.now_ms)));
+  }
+  if (ent->type == T_STR) {
+    RDBWriteByte(w, RDB_TYPE_STRING);
+    RDBWriteString(w, EntryKey(ent));
+    char buf[k_entry_int_len];
+    RDBWriteString(w, EntryValue(ent, buf));
+  } else {
+    RDBWriteByte(w, RDB_TYPE_ZSET_2);
+    RDBWriteString(w, EntryKey(ent));
+    RDBWriteLen(w, ZSetSize(ent->zset));
+    for (ZNode *node = ZSetAt(ent->zset, 0); node; node = ZNodeNext(node)) {
+      RDBWriteString(w, std::string_view(node->name, node->len));
+      RDBWriteDouble(w, node->score);
+    }
+  }
+  save.nkeys++;
+}
+
+// Write the keyspace to path. The file is written under a temporary name and
+// renamed when complete, so a crash never leaves a truncated snapshot.
+static uint64_t getMonotonicUsec();
+static bool rdbSave(const char *path) {
+  uint64_t start_us = getMonotonicUsec();
+  std::string tmp = std::string(path) + ".tmp-" + std::to_string(getpid());
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (!fp) {
+    HelperLibrary::MsgHelpers::error("Failed to open the snapshot file!");
+    return false;
+  }
+  std::vector<char> buf(1 << 20);
+  setvbuf(fp, buf.data(), _IOFBF, buf.size());
+
+  RDBWriter w;
+  w.fp = fp;
+  RDBSaveArg save;
+  save.w = &w;
+  save.now_ms = getMonotonicMsec();
+  save.wall_ms = getWallMsec();
+  RDBWriteHeader(&w);
+  RDBWriteAux(&w, "redis-bits", std::to_string(sizeof(void *) * 8));
+  RDBWriteAux(&w, "ctime", std::to_string(save.wall_ms / 1000));
+  RDBWriteAux(&w, "used-mem", std::to_string(local_data->slab.used));
+  RDBWriteByte(&w, RDB_OPCODE_SELECTDB);
+  RDBWriteLen(&w, 0);
+  RDBWriteByte(&w, RDB_OPCODE_RESIZEDB);
+  RDBWriteLen(&w, keyspaceSize());
+  RDBWriteLen(&w, local_data->heap.size());
+  keyspaceForEach(&rdbSaveEntry, &save);
+  RDBWriteEnd(&w);
+
+  bool ok = !w.failed && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    HelperLibrary::MsgHelpers::error("Failed to write the snapshot file!");
+    unlink(tmp.c_str());
+    return false;
+  }
+  double secs = (double)(getMonotonicUsec() - start_us) / 1e6;
+  double mb = (double)w.bytes / (1 << 20);
+  fprintf(stderr, "DB saved on disk: %zu keys, %.1f MB in %.3f s (%.1f MB/s)\n",
+          save.nkeys, mb, secs, secs > 0 ? mb / secs : 0.0);
+  return true;
+}
+
+// Snapshots only cover a single keyspace, and only one child process (BGSAVE
+// or BGREWRITEAOF) runs at a time
+static bool saveAllowed(std::string &out) {
+  if (global_data.nthreads > 1) {
+    outErr(out, ERR_UNKNOWN, "persistence is not supported with --threads");
+    return false;
+  }
+  if (global_data.bgsave_pid >= 0) {
+    outErr(out, ERR_UNKNOWN, "background save already in progress");
+    return false;
+  }
+  if (global_data.aof_rewrite_pid >= 0) {
+    outErr(out, ERR_UNKNOWN, "background AOF rewrite already in progress");
+    return false;
+  }
+  return true;
+}
+
+static void doSave(std::vector<std::string_view> &cmd, std::string &out) {
+  (void)cmd;
+  if (!saveAllowed(out)) {
+    return;
+  }
+  if (!rdbSave(global_data.rdb_path.c_str())) {
+    return outErr(out, ERR_UNKNOWN, "failed to save the snapshot");
+  }
+  return outNil(out);
+}
+
+// The child process writes a copy-on-write view of the keyspace while the
+// parent keeps serving. The cost for the parent is the fork() itself, which
+// copies the page tables, and the page copies of later writes.
+static void doBgSave(std::vector<std::string_view> &cmd, std::string &out) {
+  (void)cmd;
+  if (!saveAllowed(out)) {
+    return;
+  }
+  uint64_t start_us = getMonotonicUsec();
+  pid_t pid = fork();
+  if (pid < 0) {
+    return outErr(out, ERR_UNKNOWN, "fork() failed");
+  }
+  if (pid == 0) {
+    _exit(rdbSave(global_data.rdb_path.c_str()) ? 0 : 1);
+  }
+  fprintf(stderr, "Background saving started by pid %d, fork() took %llu us\n",
+          (int)pid, (unsigned long long)(getMonotonicUsec() - start_us));
+  global_data.bgsave_pid = pid;
+  return outStr(out, "Background saving started");
+}
+
+// Whether a child has exited (*ok: successfully), without blocking
+static bool childDone(pid_t pid, bool *ok) {
+  int status = 0;
+  pid_t rv = waitpid(pid, &status, WNOHANG);
+  if (rv == 0) {
+    return false;
+  }
+  *ok = rv > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  return true;
+}
+
+static void aofRewriteDone(pid_t pid, bool ok);
+// Reap the BGSAVE / BGREWRITEAOF child, called by the event loop
+static void childCheck() {
+  bool ok = false;
+  if (global_data.bgsave_pid >= 0 && childDone(global_data.bgsave_pid, &ok)) {
+    if (!ok) {
+      HelperLibrary::MsgHelpers::error("Background saving failed!");
+    } else {
+      fprintf(stderr, "Background saving terminated with success\n");
+    }
+    global_data.bgsave_pid = -1;
+  }
+  pid_t pid = global_data.aof_rewrite_pid;
+  if (pid >= 0 && childDone(pid, &ok)) {
+    global_data.aof_rewrite_pid = -1;
+    aofRewriteDone(pid, ok);
+  }
+}
+
+// Read a whole file into data. Returns 0, or -1 with errno set.
+static int32_t readFile(const char *path, std::string &data) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st = {};
+  int32_t rv = fstat(fd, &st);
+  if (rv == 0) {
+    data.resize((size_t)st.st_size);
+    rv = HelperLibrary::IOHelpers::readAll(fd, data.data(), data.size());
+  }
+  close(fd);
+  return rv;
+}
+
+// Run task(i, worker) for i in [0, n) on up to nthreads threads, the caller's
+// thread is worker 0. Each thread takes the next index when it is done.
+static void parallelFor(size_t n, uint32_t nthreads,
+                        const std::function<void(size_t, uint32_t)> &task) {
+  std::atomic<size_t> next{0};
+  auto run = [&](uint32_t worker) {
+    for (size_t i; (i = next.fetch_add(1)) < n;) {
+      task(i, worker);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t w = 1; w < nthreads && w < n; w++) {
+    threads.emplace_back(run, w);
+  }
+  run(0);
+  for (std::thread &t : threads) {
+    t.join();
+  }
+}
+
+// The snapshot is mapped and loaded in three steps:
+// 1. A scan steps over the records without decoding them, to count the keys
+//    and split the file into chunks at record boundaries.
+// 2. Threads decode the chunks into slabs of their own, and sort the entries
+//    by the shard and the range of hashMap buckets they belong to. Each chunk
+//    also computes the CRC of its bytes, they are combined afterwards.
+// 3. One thread per bucket range links the entries into the tables, which
+//    are sized from the scan, without the per-insert checks of HMInsert.
+
+// Smallest chunk worth a thread of its own
+const size_t k_load_chunk_min = 8 << 20;
+// Chunks per thread, so a thread done early can take over some of the work
+const size_t k_load_chunks_per_thread = 4;
+
+struct RDBLoadChunk {
+  size_t begin = 0, end = 0;         // whole records
+  size_t crc_begin = 0, crc_end = 0; // the checksummed bytes
+  uint64_t crc = 0;
+  bool ok = true;
+};
+
+struct RDBLoadTTL {
+  Entry *ent = NULL;
+  uint32_t shard = 0;
+  int64_t expire_at = 0; // unix ms
+};
+
+// What one thread decoded, for each shard
+struct RDBLoadWorker {
+  std::vector<Slab> slabs;
+  // [shard * nranges + range]: the entries of one bucket range of a shard
+  std::vector<std::vector<hashTableNode *>> parts;
+  std::vector<RDBLoadTTL> ttls;
+  std::vector<size_t> memory; // EntryMemory() of the entries, per shard
+  size_t nloaded = 0;
+  std::string key_buf, val_buf; // decoded integer and LZF strings
+};
+
+struct RDBLoad {
+  const uint8_t *data = NULL;
+  uint64_t wall_ms = 0;
+  uint32_t lru_clock = 0; // the last access of every loaded key
+  uint32_t nranges = 1; // bucket ranges per shard
+  std::vector<RDBLoadChunk> chunks;
+  std::vector<RDBLoadWorker> workers;
+};
+
+// Step 1: split [r->pos, EOF opcode) into chunks of about target bytes. A
+// chunk never starts between a key and the EXPIRETIME, FREQ or IDLE opcodes
+// in front of it.
+static bool rdbLoadScan(RDBReader *r, size_t target,
+                        std::vector<size_t> &bounds, size_t *nkeys) {
+  bounds.push_back(r->pos);
+  bool prefix = false;
+  while (true) {
+    size_t pos = r->pos;
+    if (!prefix && pos - bounds.back() >= target) {
+      bounds.push_back(pos);
+    }
+    uint8_t type = RDBReadByte(r);
+    if (r->failed) {
+      HelperLibrary::MsgHelpers::error("Unexpected end of the RDB file");
+      return false;
+    }
+    switch (type) {
+    case RDB_OPCODE_EOF:
+      bounds.push_back(pos);
+      return true;
+    case RDB_OPCODE_SELECTDB:
+      if (RDBReadLen(r) != 0) {
+        HelperLibrary::MsgHelpers::error("Only database 0 can be loaded");
+        return false;
+      }
+      break;
+    case RDB_OPCODE_RESIZEDB:
+      // The scan counts the keys itself
+      (void)RDBReadLen(r);
+      (void)RDBReadLen(r);
+      break;
+    case RDB_OPCODE_AUX:
+      RDBSkipString(r);
+      RDBSkipString(r);
+      break;
+    case RDB_OPCODE_EXPIRETIME_MS:
+      (void)RDBReadMillis(r);
+      prefix = true;
+      break;
+    case RDB_OPCODE_EXPIRETIME:
+      (void)RDBReadSeconds(r);
+      prefix = true;
+      break;
+    case RDB_OPCODE_FREQ:
+      // Eviction hints, not used
+      (void)RDBReadByte(r);
+      prefix = true;
+      break;
+    case RDB_OPCODE_IDLE:
+      (void)RDBReadLen(r);
+      prefix = true;
+      break;
+    default:
+      if (!RDBSkipEntry(r, type)) {
+        HelperLibrary::MsgHelpers::error(
+            "Unsupported value type in the snapshot");
+        return false;
+      }
+      prefix = false;
+      (*nkeys)++;
+    }
+  }
+}
+
+// Step 2: decode one key, its value type is already read. Like Redis, keys
+// that expired while the server was down are not loaded.
+static Shard *hashOwner(uint64_t hash_value);
+static bool rdbLoadEntry(RDBLoad *load, RDBLoadWorker *worker, RDBReader *r,
+                         uint8_t type, int64_t expire_at) {
+  if (expire_at >= 0 && (uint64_t)expire_at <= load->wall_ms) {
+    return RDBSkipEntry(r, type);
+  }
+  std::string_view key = RDBReadStringView(r, worker->key_buf);
+  std::string_view val;
+  std::vector<std::string> members;
+  std::vector<double> scores;
+  if (type == RDB_TYPE_STRING) {
+    val = RDBReadStringView(r, worker->val_buf);
+  } else if (type == RDB_TYPE_ZSET || type == RDB_TYPE_ZSET_2) {
+    uint64_t n = RDBReadLen(r);
+    for (uint64_t i = 0; i < n && !r->failed; i++) {
+      members.emplace_back();
+      RDBReadString(r, members.back());
+      scores.push_back(type == RDB_TYPE_ZSET_2 ? RDBReadDouble(r)
+                                               : RDBReadStrDouble(r));
+    }
+  } else {
+    // member, score, member, score, ...
+    std::vector<std::string> items;
+    std::string_view lp = RDBReadStringView(r, worker->val_buf);
+    if (r->failed || !RDBListpackParse(lp, items) || items.size() % 2 != 0) {
+      return false;
+    }
+    for (size_t i = 0; i < items.size(); i += 2) {
+      double score = 0;
+      if (!str2dbl(items[i + 1], score)) {
+        return false;
+      }
+      members.push_back(std::move(items[i]));
+      scores.push_back(score);
+    }
+  }
+  if (r->failed) {
+    return false;
+  }
+  if (type != RDB_TYPE_STRING && members.empty()) {
+    return true;
+  }
+
+  uint64_t hash_value = strHash((const uint8_t *)key.data(), key.size());
+  Shard *shard = hashOwner(hash_value);
+  uint32_t s = shard->id;
+  Entry *ent = EntryNew(&worker->slabs[s], key,
+                        type == RDB_TYPE_STRING ? T_STR : T_ZSET, val);
+  ent->HTNode.hash_value = hash_value;
+  if (type != RDB_TYPE_STRING) {
+    ent->zset = new ZSet();
+    for (size_t i = 0; i < members.size(); i++) {
+      ZSetInsert(ent->zset, members[i].data(), members[i].size(), scores[i]);
+    }
+  }
+  ent->lru = load->lru_clock;
+  ent->lfu = k_lfu_init_val;
+  worker->memory[s] += EntryMemory(ent);
+  size_t range = 0;
+  if (load->nranges > 1) {
+    size_t per_range = HMBuckets(&shard->HMap) / load->nranges;
+    range = HMBucket(&shard->HMap, hash_value) / per_range;
+  }
+  worker->parts[s * load->nranges + range].push_back(&ent->HTNode);
+  if (expire_at >= 0) {
+    RDBLoadTTL ttl;
+    ttl.ent = ent;
+    ttl.shard = s;
+    ttl.expire_at = expire_at;
+    worker->ttls.push_back(ttl);
+  }
+  worker->nloaded++;
+  return true;
+}
+
+// Step 2: decode the records of a chunk and checksum its bytes
+static void rdbLoadChunk(RDBLoad *load, RDBLoadChunk *chunk,
+                         RDBLoadWorker *worker) {
+  const uint8_t *data = load->data;
+  RDBReader r;
+  r.data = data;
+  r.size = chunk->end;
+  r.pos = chunk->begin;
+  uint64_t crc = CRC64(0, data + chunk->crc_begin,
+                       chunk->begin - chunk->crc_begin);
+  int64_t expire_at = -1;
+  while (chunk->ok && r.pos < chunk->end) {
+    size_t pos = r.pos;
+    uint8_t type = RDBReadByte(&r);
+    switch (type) {
+    case RDB_OPCODE_SELECTDB:
+      (void)RDBReadLen(&r);
+      break;
+    case RDB_OPCODE_RESIZEDB:
+      (void)RDBReadLen(&r);
+      (void)RDBReadLen(&r);
+      break;
+    case RDB_OPCODE_AUX:
+      RDBSkipString(&r);
+      RDBSkipString(&r);
+      break;
+    case RDB_OPCODE_EXPIRETIME_MS:
+      expire_at = RDBReadMillis(&r);
+      break;
+    case RDB_OPCODE_EXPIRETIME:
+      expire_at = RDBReadSeconds(&r) * 1000;
+      break;
+    case RDB_OPCODE_FREQ:
+      (void)RDBReadByte(&r);
+      break;
+    case RDB_OPCODE_IDLE:
+      (void)RDBReadLen(&r);
+      break;
+    default:
+      chunk->ok = rdbLoadEntry(load, worker, &r, type, expire_at);
+      expire_at = -1;
+    }
+    chunk->ok = chunk->ok && !r.failed;
+    // The record is still in the cache
+    crc = CRC64(crc, data + pos, r.pos - pos);
+  }
+  chunk->crc = CRC64(crc, data + chunk->end, chunk->crc_end - chunk->end);
+}
+
+static bool entrySameKey(hashTableNode *node, hashTableNode *other) {
+  return EntryKey(container_of(node, Entry, HTNode)) ==
+         EntryKey(container_of(other, Entry, HTNode));
+}
+
+// Step 3: link one bucket range of a shard, false on a duplicate key
+static bool rdbLoadLink(RDBLoad *load, uint32_t s, uint32_t range) {
+  Shard *shard = global_data.shards[s];
+  for (RDBLoadWorker &worker : load->workers) {
+    std::vector<hashTableNode *> &nodes =
+        worker.parts[s * load->nranges + range];
+    if (global_data.engine == ENGINE_CHAIN) {
+      if (HMBulkLink(&shard->HMap, nodes.data(), nodes.size(),
+                     &entrySameKey)) {
+        return false;
+      }
+      continue;
+    }
+    // The swiss table probes across groups, so there is a single range
+    for (hashTableNode *node : nodes) {
+      if (SMLookup(&shard->SMap, node, &entrySameKey)) {
+        return false;
+      }
+      SMInsert(&shard->SMap, node);
+    }
+  }
+  return true;
+}
+
+static bool rdbLoadMapped(const uint8_t *data, size_t size) {
+  uint64_t start_us = getMonotonicUsec();
+  RDBReader r;
+  r.data = data;
+  r.size = size;
+  if (!RDBReadHeader(&r)) {
+    HelperLibrary::MsgHelpers::error("Not a valid RDB file");
+    return false;
+  }
+  size_t nthreads = global_data.load_threads;
+  if (nthreads == 0) {
+    nthreads = std::min<size_t>(
+        std::max(1u, std::thread::hardware_concurrency()),
+        std::max<size_t>(1, size / k_load_chunk_min));
+  }
+  size_t target = (size - r.pos) / (nthreads * k_load_chunks_per_thread) + 1;
+  std::vector<size_t> bounds;
+  size_t nkeys = 0;
+  if (!rdbLoadScan(&r, target, bounds, &nkeys)) {
+    return false;
+  }
+  size_t eof_pos = bounds.back();
+  uint64_t scan_us = getMonotonicUsec();
+
+  // Size the tables once, then cut each shard's buckets into ranges that
+  // can be linked independently
+  size_t nshards = global_data.nthreads;
+  RDBLoad load;
+  load.data = data;
+  load.wall_ms = getWallMsec();
+  load.lru_clock = (uint32_t)(getMonotonicMsec() / 1000) & k_lru_clock_max;
+  for (Shard *shard : global_data.shards) {
+    local_data = shard;
+    keyspaceReserve(nkeys / nshards);
+  }
+  local_data = NULL;
+  if (global_data.engine == ENGINE_CHAIN) {
+    size_t min_buckets = SIZE_MAX;
+    for (Shard *shard : global_data.shards) {
+      min_buckets = std::min(min_buckets, HMBuckets(&shard->HMap));
+    }
+    while (load.nranges * nshards < nthreads &&
+           load.nranges * 2 <= min_buckets) {
+      load.nranges *= 2;
+    }
+  }
+  load.chunks.resize(bounds.size() - 1);
+  for (size_t i = 0; i < load.chunks.size(); i++) {
+    RDBLoadChunk &chunk = load.chunks[i];
+    chunk.begin = bounds[i];
+    chunk.end = bounds[i + 1];
+    // The checksum also covers the header and the EOF opcode
+    chunk.crc_begin = i == 0 ? 0 : chunk.begin;
+    chunk.crc_end = i + 1 == load.chunks.size() ? eof_pos + 1 : chunk.end;
+  }
+  load.workers.resize(nthreads);
+  for (RDBLoadWorker &worker : load.workers) {
+    worker.slabs.resize(nshards);
+    worker.memory.resize(nshards);
+    worker.parts.resize(nshards * load.nranges);
+  }
+
+  parallelFor(load.chunks.size(), nthreads, [&](size_t i, uint32_t w) {
+    rdbLoadChunk(&load, &load.chunks[i], &load.workers[w]);
+  });
+  uint64_t crc = 0;
+  for (RDBLoadChunk &chunk : load.chunks) {
+    if (!chunk.ok) {
+      HelperLibrary::MsgHelpers::error("Failed to load a key");
+      return false;
+    }
+    crc = CRC64Combine(crc, chunk.crc, chunk.crc_end - chunk.crc_begin);
+  }
+  r.pos = eof_pos + 1;
+  if (!RDBReadEnd(&r, crc)) {
+    HelperLibrary::MsgHelpers::error("Wrong RDB checksum");
+    return false;
+  }
+  uint64_t parse_us = getMonotonicUsec();
+
+  std::vector<uint8_t> linked(nshards * load.nranges);
+  parallelFor(linked.size(), nthreads, [&](size_t i, uint32_t w) {
+    (void)w;
+    linked[i] = rdbLoadLink(&load, i / load.nranges, i % load.nranges);
+  });
+  if (std::count(linked.begin(), linked.end(), 0) > 0) {
+    HelperLibrary::MsgHelpers::error("Duplicate key in the snapshot");
+    return false;
+  }
+  size_t nloaded = 0;
+  for (RDBLoadWorker &worker : load.workers) {
+    nloaded += worker.nloaded;
+    for (size_t s = 0; s < nshards; s++) {
+      Shard *shard = global_data.shards[s];
+      if (global_data.engine == ENGINE_CHAIN) {
+        size_t n = 0;
+        for (size_t i = 0; i < load.nranges; i++) {
+          n += worker.parts[s * load.nranges + i].size();
+        }
+        HMBulkAdd(&shard->HMap, n);
+      }
+      SlabMerge(&shard->slab, &worker.slabs[s]);
+      shard->used_memory += worker.memory[s];
+    }
+    for (RDBLoadTTL &ttl : worker.ttls) {
+      local_data = global_data.shards[ttl.shard];
+      entrySetTTL(ttl.ent, ttl.expire_at - (int64_t)load.wall_ms);
+    }
+  }
+  local_data = NULL;
+  uint64_t end_us = getMonotonicUsec();
+
+  double secs = (double)(end_us - start_us) / 1e6;
+  double mb = (double)size / (1 << 20);
+  fprintf(stderr,
+          "DB loaded from disk: %zu keys, %.1f MB in %.3f s (%.1f MB/s), "
+          "%zu threads: scan %.3f s, parse %.3f s, link %.3f s\n",
+          nloaded, mb, secs, secs > 0 ? mb / secs : 0.0, nthreads,
+          (double)(scan_us - start_us) / 1e6,
+          (double)(parse_us - scan_us) / 1e6,
+          (double)(end_us - parse_us) / 1e6);
+  return true;
+}
+
+// Load the snapshot at startup, a missing file is an empty keyspace
+static bool rdbLoad(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT;
+  }
+  struct stat st = {};
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    HelperLibrary::MsgHelpers::error("Not a valid RDB file");
+    return false;
+  }
+  // Read the whole file ahead while the scan runs
+  size_t size = (size_t)st.st_size;
+  (void)madvise(map, size, MADV_WILLNEED);
+  bool ok = rdbLoadMapped((const uint8_t *)map, size);
+  munmap(map, size);
+  return ok;
+}
+
+// With appendfsync always, the replies wait in wbuf until the end of the
+// event loop iteration, where aofFlush() writes and fsyncs the log once for
+// every connection. The loop sends them in the next iteration.
+static bool aofDeferReplies() {
+  return global_data.aof.fsync_policy == AOF_FSYNC_ALWAYS &&
+         !global_data.aof.buf.empty();
+}
+
+// Log a write command that succeeded. Expiration times are logged as
+// absolute unix times (PEXPIREAT), so replaying the log later does not
+// extend the TTLs.
+static void aofFeed(const Command *c, std::vector<std::string_view> &cmd,
+                    const std::string &out) {
+  if (out.empty() || out[0] == SER_ERR) {
+    return;
+  }
+  std::string &buf = global_data.aof.buf;
+  if (c->handler != &doExpire) {
+    return AOFEncode(buf, cmd.data(), cmd.size());
+  }
+  int64_t ttl = 0, found = 0;
+  memcpy(&found, &out[1], 8);
+  if (!found || !expireTTL(cmd, ttl)) {
+    return;
+  }
+  if (ttl <= 0) {
+    std::string_view args[] = {"del", cmd[1]};
+    return AOFEncode(buf, args, 2);
+  }
+  std::string at = std::to_string(getWallMsec() + (uint64_t)ttl);
+  std::string_view args[] = {"pexpireat", cmd[1], at};
+  AOFEncode(buf, args, 3);
+}
+
+// Called at the end of every event loop iteration
+static void aofFlush() {
+  AOF &aof = global_data.aof;
+  if (aof.fd < 0) {
+    return;
+  }
+  bool had_error = aof.write_error;
+  if (AOFFlush(&aof)) {
+    return;
+  }
+  if (aof.fsync_policy == AOF_FSYNC_ALWAYS) {
+    // The replies of the logged commands must not be sent
+    HelperLibrary::MsgHelpers::die("Failed to write the append-only file!");
+  }
+  if (!had_error) {
+    HelperLibrary::MsgHelpers::error(
+        "Failed to write the append-only file, will try again!");
+  }
+}
+
+// Members of a sorted set per ZADD in a rewritten log
+const size_t k_aof_rewrite_items = 64;
+
+struct AOFRewriteArg {
+  int fd = -1;
+  std::string buf;
+  uint64_t now_ms = 0;  // monotonic, for the TTL heap
+  uint64_t wall_ms = 0; // PEXPIREAT takes absolute unix times
+  size_t nkeys = 0;
+  size_t bytes = 0;
+  bool failed = false;
+};
+
+// Write out and reuse the buffer once it is this large
+const size_t k_aof_rewrite_buf = 1 << 20;
+
+static void aofRewriteEntry(hashTableNode *HTNode, void *arg) {
+  AOFRewriteArg &rw = *(AOFRewriteArg *)arg;
+  Entry *ent = container_of(HTNode, Entry, HTNode);
+  uint64_t expire_ms = 0;
+  if (ent->heap_idx != (size_t)-1) {
+    expire_ms = local_data->heap[ent->heap_idx].val;
+    if (expire_ms <= rw.now_ms) {
+      return;
+    }
+  }
+  std::string_view key = EntryKey(ent);
+  if (ent->type == T_STR) {
+    char buf[k_entry_int_len];
+    std::string_view args[] = {"set", key, EntryValue(ent, buf)};
+    AOFEncode(rw.buf, args, 3);
+  } else {
+    // ZADD key score name [score name ...], in chunks so a large set does not
+    // make a huge request
+    std::vector<std::string_view> args;
+    std::vector<std::string> scores(k_aof_rewrite_items);
+    ZNode *node = ZSetAt(ent->zset, 0);
+    while (node) {
+      args.assign({"zadd", key});
+      for (size_t i = 0; node && i < k_aof_rewrite_items; i++) {
+        char num[32];
+        int len = snprintf(num, sizeof(num), "%.17g", node->score);
+        scores[i].assign(num, (size_t)len);
+        args.push_back(scores[i]);
+        args.push_back(std::string_view(node->name, node->len));
+        node = ZNodeNext(node);
+      }
+      AOFEncode(rw.buf, args.data(), args.size());
+    }
+  }
+  if (expire_ms) {
+    std::string at = std::to_string(rw.wall_ms + (expire_ms - rw.now_ms));
+    std::string_view args[] = {"pexpireat", key, at};
+    AOFEncode(rw.buf, args, 3);
+  }
+  rw.nkeys++;
+  if (rw.buf.size() >= k_aof_rewrite_buf && !rw.failed) {
+    rw.failed = HelperLibrary::IOHelpers::writeAll(rw.fd, rw.buf.data(),
+                                                   rw.buf.size()) != 0;
+    rw.bytes += rw.buf.size();
+    rw.buf.clear();
+  }
+}
+
+// Write the shortest log that rebuilds the keyspace: one command per key
+// (and one per TTL), instead of its whole history
+static bool aofRewriteFile(const char *path) {
+  uint64_t start_us = getMonotonicUsec();
+  AOFRewriteArg rw;
+  rw.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (rw.fd < 0) {
+    HelperLibrary::MsgHelpers::error("Failed to open the rewritten AOF!");
+    return false;
+  }
+  rw.now_ms = getMonotonicMsec();
+  rw.wall_ms = getWallMsec();
+  keyspaceForEach(&aofRewriteEntry, &rw);
+  bool ok = !rw.failed && HelperLibrary::IOHelpers::writeAll(
+                              rw.fd, rw.buf.data(), rw.buf.size()) == 0;
+  rw.bytes += rw.buf.size();
+  ok = fsync(rw.fd) == 0 && ok;
+  ok = close(rw.fd) == 0 && ok;
+  if (!ok) {
+    HelperLibrary::MsgHelpers::error("Failed to write the rewritten AOF!");
+    return false;
+  }
+  double secs = (double)(getMonotonicUsec() - start_us) / 1e6;
+  double mb = (double)rw.bytes / (1 << 20);
+  fprintf(stderr, "AOF rewritten: %zu keys, %.1f MB in %.3f s (%.1f MB/s)\n",
+          rw.nkeys, mb, secs, secs > 0 ? mb / secs : 0.0);
+  return true;
+}
+
+static std::string aofRewritePath(pid_t pid) {
+  return global_data.aof_path + ".rewrite-" + std::to_string(pid);
+}
+
+// The child rewrites the log from a copy-on-write view of the keyspace. The
+// parent keeps appending to the old log, and also keeps what it writes in
+// aof.rewrite_buf for the end of the new one.
+static void doBgRewriteAof(std::vector<std::string_view> &cmd,
+                           std::string &out) {
+  (void)cmd;
+  if (!saveAllowed(out)) {
+    return;
+  }
+  AOF &aof = global_data.aof;
+  // Everything before the fork is in the child's keyspace, so it must not
+  // end up in rewrite_buf as well
+  if (aof.fd >= 0 && !AOFFlush(&aof)) {
+    return outErr(out, ERR_UNKNOWN, "failed to write the append-only file");
+  }
+  uint64_t start_us = getMonotonicUsec();
+  pid_t pid = fork();
+  if (pid < 0) {
+    return outErr(out, ERR_UNKNOWN, "fork() failed");
+  }
+  if (pid == 0) {
+    _exit(aofRewriteFile(aofRewritePath(getpid()).c_str()) ? 0 : 1);
+  }
+  fprintf(stderr,
+          "Background AOF rewrite started by pid %d, fork() took %llu us\n",
+          (int)pid, (unsigned long long)(getMonotonicUsec() - start_us));
+  global_data.aof_rewrite_pid = pid;
+  aof.rewriting = aof.fd >= 0;
+  aof.rewrite_buf.clear();
+  return outStr(out, "Background append only file rewriting started");
+}
+
+// Append the writes made during the rewrite to the new log, then replace the
+// old log with it. This write is done by the event loop, so it is as long as
+// the traffic received while the child was running.
+static void aofRewriteDone(pid_t pid, bool ok) {
+  AOF &aof = global_data.aof;
+  std::string tmp = aofRewritePath(pid);
+  int fd = -1;
+  if (ok) {
+    // The rest of this iteration's writes go to rewrite_buf first
+    if (aof.fd >= 0) {
+      (void)AOFFlush(&aof);
+    }
+    fd = open(tmp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    ok = fd >= 0 &&
+         HelperLibrary::IOHelpers::writeAll(fd, aof.rewrite_buf.data(),
+                                            aof.rewrite_buf.size()) == 0 &&
+         fdatasync(fd) == 0 &&
+         rename(tmp.c_str(), global_data.aof_path.c_str()) == 0;
+  }
+  if (!ok) {
+    HelperLibrary::MsgHelpers::error("Background AOF rewrite failed!");
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(tmp.c_str());
+  } else {
+    fprintf(stderr,
+            "Background AOF rewrite terminated with success, %zu bytes "
+            "written during the rewrite\n",
+            aof.rewrite_buf.size());
+    if (aof.fd >= 0) {
+      AOFSwitch(&aof, fd);
+    } else {
+      close(fd);
+    }
+  }
+  aof.rewriting = false;
+  std::string().swap(aof.rewrite_buf);
+}
+
+// Replay the log at startup. A record cut short by a crash while it was
+// appended is dropped, like Redis does by default.
+static bool aofLoad(const char *path) {
+  uint64_t start_us = getMonotonicUsec();
+  std::string data;
+  if (readFile(path, data) != 0) {
+    return false;
+  }
+  local_data = global_data.shards[0];
+  global_data.aof_loading = true;
+  const uint8_t *p = (const uint8_t *)data.data();
+  size_t pos = 0, ncmds = 0;
+  std::vector<std::string_view> cmd;
+  std::string out;
+  while (data.size() - pos >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, &p[pos], 4);
+    // Only the last record can be cut short by a crash, a length that no
+    // writer produces means the file is corrupt.
+    if (len <= k_max_msg && 4 + (size_t)len > data.size() - pos) {
+      break;
+    }
+    cmd.clear();
+    const Command *c = NULL;
+    if (len <= k_max_msg && parseHelper(&p[pos + 4], len, cmd) == 0 &&
+        !cmd.empty()) {
+      c = lookupCommand(cmd[0]);
+    }
+    if (!c || !(c->flags & CMD_WRITE) || !cmdArityOK(c, cmd.size())) {
+      HelperLibrary::MsgHelpers::error("Bad command in the append-only file");
+      global_data.aof_loading = false;
+      local_data = NULL;
+      return false;
+    }
+    out.clear();
+    c->handler(cmd, out);
+    pos += 4 + len;
+    ncmds++;
+  }
+  global_data.aof_loading = false;
+  local_data = NULL;
+  if (pos < data.size()) {
+    fprintf(stderr, "AOF ends with a truncated command, dropping %zu bytes\n",
+            data.size() - pos);
+    if (truncate(path, (off_t)pos) != 0) {
+      return false;
+    }
+  }
+  double secs = (double)(getMonotonicUsec() - start_us) / 1e6;
+  double mb = (double)data.size() / (1 << 20);
+  fprintf(stderr,
+          "AOF loaded: %zu commands, %.1f MB in %.3f s (%.1f MB/s)\n", ncmds,
+          mb, secs, secs > 0 ? mb / secs : 0.0);
+  return true;
+}
+
+// Load the log, or create it from the snapshot when AOF is turned on for the
+// first time, then open it for appending
+static bool aofStart() {
+  const char *path = global_data.aof_path.c_str();
+  struct stat st = {};
+  if (stat(path, &st) == 0) {
+    if (!aofLoad(path)) {
+      return false;
+    }
+  } else {
+    if (errno != ENOENT || !rdbLoad(global_data.rdb_path.c_str())) {
+      return false;
+    }
+    std::string tmp = aofRewritePath(getpid());
+    local_data = global_data.shards[0];
+    bool ok = aofRewriteFile(tmp.c_str()) && rename(tmp.c_str(), path) == 0;
+    local_data = NULL;
+    if (!ok) {
+      return false;
+    }
+  }
+  return AOFOpen(&global_data.aof, path, global_data.aof_fsync);
+}
+
+// What INFO needs from one shard, copied by the shard's own thread
+struct ShardInfo {
+  ShardStats stats;
+  size_t keys = 0;
+  size_t expires = 0;
+  // The keyspace table, and the previous one while it is being resized
+  size_t table_slots = 0;
+  size_t table_keys = 0;
+  size_t rehash_slots = 0;
+  size_t rehash_keys = 0;
+  size_t resizing_pos = 0;
+  size_t slab_used = 0;
+  size_t slab_reserved = 0;
+  size_t used_memory = 0;
+  size_t conn_pool = 0;
+};
+
+// Not registered in k_commands: forwarded to every shard by INFO, the reply is
+// the raw bytes of the shard's ShardInfo
+static void infoSnapshot(std::vector<std::string_view> &cmd, std::string &out) {
+  (void)cmd;
+  statsSample();
+  ShardInfo info;
+  info.stats = local_data->stats;
+  info.keys = keyspaceSize();
+  info.expires = local_data->heap.size();
+  if (global_data.engine == ENGINE_SWISS) {
+    const swissMap &SMap = local_data->SMap;
+    info.table_slots =
+        SMap.current_ST.ctrl ? (SMap.current_ST.mask + 1) * 16 : 0;
+    info.table_keys = SMap.current_ST.size;
+    info.rehash_slots =
+        SMap.previous_ST.ctrl ? (SMap.previous_ST.mask + 1) * 16 : 0;
+    info.rehash_keys = SMap.previous_ST.size;
+    info.resizing_pos = SMap.resizing_pos;
+  } else {
+    const hashMap &HMap = local_data->HMap;
+    info.table_slots = HMap.current_HT.table ? HMap.current_HT.mask + 1 : 0;
+    info.table_keys = HMap.current_HT.size;
+    info.rehash_slots = HMap.previous_HT.table ? HMap.previous_HT.mask + 1 : 0;
+    info.rehash_keys = HMap.previous_HT.size;
+    info.resizing_pos = HMap.resizing_pos;
+  }
+  info.slab_used = local_data->slab.used;
+  info.slab_reserved = local_data->slab.reserved;
+  info.used_memory = local_data->used_memory;
+  info.conn_pool = local_data->conn_pool.size();
+  out.assign((const char *)&info, sizeof(info));
+}
+
+static constexpr Command k_info_snapshot = {"", &infoSnapshot, 0, 0, 0};
+
+// The snapshots of the shards, one per part
+static void infoDecode(const std::vector<std::string> &parts,
+                       std::vector<ShardInfo> &infos) {
+  infos.resize(parts.size());
+  for (size_t i = 0; i < parts.size(); i++) {
+    assert(parts[i].size() == sizeof(ShardInfo));
+    memcpy((void *)&infos[i], parts[i].data(), sizeof(ShardInfo));
+  }
+}
+
+static void statsMerge(ShardStats &dst, const ShardStats &src) {
+  dst.connections_received += src.connections_received;
+  dst.connected_clients += src.connected_clients;
+  dst.net_input_bytes += src.net_input_bytes;
+  dst.net_output_bytes += src.net_output_bytes;
+  dst.commands += src.commands;
+  dst.evicted_keys += src.evicted_keys;
+  dst.ops_per_sec += src.ops_per_sec;
+  HistMerge(&dst.latency, &src.latency);
+  for (size_t i = 0; i < k_num_commands; i++) {
+    dst.cmds[i].calls += src.cmds[i].calls;
+    dst.cmds[i].ns += src.cmds[i].ns;
+    for (size_t j = 0; j < k_latency_buckets; j++) {
+      dst.cmds[i].latency[j] += src.cmds[i].latency[j];
+    }
+  }
+}
+
+// The upper bound (ns) of the latency bucket that holds the quantile q
+static uint64_t cmdLatencyPercentile(const CommandStats &cs, double q) {
+  uint64_t rank = (uint64_t)(q * (double)cs.calls + 0.5);
+  rank = rank < 1 ? 1 : rank;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < k_latency_buckets; i++) {
+    seen += cs.latency[i];
+    if (seen >= rank) {
+      return 1ull << i;
+    }
+  }
+  return 1ull << (k_latency_buckets - 1);
+}
+
+static void infoAppend(std::string &text, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void infoAppend(std::string &text, const char *fmt, ...) {
+  char line[512];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (len > 0) {
+    text.append(line, std::min((size_t)len, sizeof(line) - 1));
+  }
+}
+
+// Resident set size from /proc, 0 if unknown
+static size_t processRSS() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) {
+    return 0;
+  }
+  unsigned long pages = 0, rss = 0;
+  int rv = fscanf(fp, "%lu %lu", &pages, &rss);
+  fclose(fp);
+  return rv == 2 ? rss * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+static const char *const k_info_sections[] = {
+    "server",   "clients",      "memory",       "persistence",
+    "stats",    "keyspace",     "commandstats", "latencystats",
+};
+
+static void infoServer(std::string &text) {
+  const char *loops[] = {"poll", "epoll", "epoll-et"};
+  infoAppend(text, "# Server\r\n");
+  infoAppend(text, "process_id:%d\r\n", (int)getpid());
+  infoAppend(text, "tcp_port:1234\r\n");
+  infoAppend(text, "uptime_in_seconds:%llu\r\n",
+             (unsigned long long)(getMonotonicMsec() - global_data.start_ms) /
+                 1000);
+  infoAppend(text, "event_loop:%s\r\n", loops[global_data.loop_mode]);
+  infoAppend(text, "engine:%s\r\n",
+             global_data.engine == ENGINE_SWISS ? "swiss" : "chain");
+  infoAppend(text, "threads:%u\r\n", global_data.nthreads);
+}
+
+static void infoClients(std::string &text, const std::vector<ShardInfo> &infos,
+                        const ShardStats &total) {
+  size_t pooled = 0;
+  for (const ShardInfo &info : infos) {
+    pooled += info.conn_pool;
+  }
+  infoAppend(text, "# Clients\r\n");
+  infoAppend(text, "connected_clients:%llu\r\n",
+             (unsigned long long)total.connected_clients);
+  infoAppend(text, "pooled_connections:%zu\r\n", pooled);
+}
+
+static void infoMemory(std::string &text, const std::vector<ShardInfo> &infos) {
+  const char *policies[] = {"noeviction", "allkeys-lru", "allkeys-lfu",
+                            "allkeys-random"};
+  size_t slab_used = 0, slab_reserved = 0, dataset = 0;
+  for (const ShardInfo &info : infos) {
+    slab_used += info.slab_used;
+    slab_reserved += info.slab_reserved;
+    dataset += info.used_memory;
+  }
+  infoAppend(text, "# Memory\r\n");
+#if HAVE_MALLINFO2
+  // Walks the malloc arenas, which is fine for an occasional INFO
+  struct mallinfo2 mi = mallinfo2();
+  infoAppend(text, "used_memory:%zu\r\n", mi.uordblks + mi.hblkhd);
+  infoAppend(text, "allocator_arena:%zu\r\n", mi.arena);
+  infoAppend(text, "allocator_free:%zu\r\n", mi.fordblks);
+  infoAppend(text, "allocator_mmap:%zu\r\n", mi.hblkhd);
+#endif
+  infoAppend(text, "used_memory_rss:%zu\r\n", processRSS());
+  infoAppend(text, "slab_used:%zu\r\n", slab_used);
+  infoAppend(text, "slab_reserved:%zu\r\n", slab_reserved);
+  infoAppend(text, "slab_fragmentation_ratio:%.2f\r\n",
+             slab_used ? (double)slab_reserved / (double)slab_used : 0.0);
+  // The memory counted against maxmemory
+  infoAppend(text, "used_memory_dataset:%zu\r\n", dataset);
+  infoAppend(text, "maxmemory:%zu\r\n", global_data.maxmemory);
+  infoAppend(text, "maxmemory_policy:%s\r\n",
+             policies[global_data.maxmemory_policy]);
+}
+
+static void infoPersistence(std::string &text) {
+  const AOF &aof = global_data.aof;
+  infoAppend(text, "# Persistence\r\n");
+  infoAppend(text, "rdb_bgsave_in_progress:%d\r\n",
+             global_data.bgsave_pid >= 0);
+  infoAppend(text, "aof_enabled:%d\r\n", aof.fd >= 0);
+  infoAppend(text, "aof_rewrite_in_progress:%d\r\n",
+             global_data.aof_rewrite_pid >= 0);
+  infoAppend(text, "aof_buffer_length:%zu\r\n", aof.buf.size());
+  infoAppend(text, "aof_last_write_status:%s\r\n",
+             aof.write_error ? "err" : "ok");
+}
+
+static void infoStats(std::string &text, const ShardStats &total) {
+  const Histogram &lat = total.latency;
+  infoAppend(text, "# Stats\r\n");
+  infoAppend(text, "total_connections_received:%llu\r\n",
+             (unsigned long long)total.connections_received);
+  infoAppend(text, "total_commands_processed:%llu\r\n",
+             (unsigned long long)total.commands);
+  infoAppend(text, "instantaneous_ops_per_sec:%llu\r\n",
+             (unsigned long long)total.ops_per_sec);
+  infoAppend(text, "evicted_keys:%llu\r\n",
+             (unsigned long long)total.evicted_keys);
+  infoAppend(text, "total_net_input_bytes:%llu\r\n",
+             (unsigned long long)total.net_input_bytes);
+  infoAppend(text, "total_net_output_bytes:%llu\r\n",
+             (unsigned long long)total.net_output_bytes);
+  infoAppend(text,
+             "latency_usec:mean=%.3f,p50=%.3f,p99=%.3f,p99.9=%.3f,"
+             "max=%.3f\r\n",
+             HistMean(&lat) / 1e3, (double)HistPercentile(&lat, 0.5) / 1e3,
+             (double)HistPercentile(&lat, 0.99) / 1e3,
+             (double)HistPercentile(&lat, 0.999) / 1e3, (double)lat.max / 1e3);
+}
+
+static void infoKeyspace(std::string &text,
+                         const std::vector<ShardInfo> &infos) {
+  size_t keys = 0, expires = 0;
+  for (const ShardInfo &info : infos) {
+    keys += info.keys;
+    expires += info.expires;
+  }
+  infoAppend(text, "# Keyspace\r\n");
+  infoAppend(text, "db0:keys=%zu,expires=%zu\r\n", keys, expires);
+  for (size_t i = 0; i < infos.size(); i++) {
+    const ShardInfo &info = infos[i];
+    infoAppend(text,
+               "shard%zu:keys=%zu,expires=%zu,table_slots=%zu,"
+               "table_keys=%zu,rehash_slots=%zu,rehash_keys=%zu,"
+               "resizing_pos=%zu\r\n",
+               i, info.keys, info.expires, info.table_slots, info.table_keys,
+               info.rehash_slots, info.rehash_keys, info.resizing_pos);
+  }
+}
+
+static void infoCommandStats(std::string &text, const ShardStats &total) {
+  infoAppend(text, "# Commandstats\r\n");
+  for (size_t i = 0; i < k_num_commands; i++) {
+    const CommandStats &cs = total.cmds[i];
+    if (cs.calls == 0) {
+      continue;
+    }
+    infoAppend(text, "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f\r\n",
+               k_commands[i].name.data(), (unsigned long long)cs.calls,
+               (unsigned long long)(cs.ns / 1000),
+               (double)cs.ns / 1e3 / (double)cs.calls);
+  }
+}
+
+static void infoLatencyStats(std::string &text, const ShardStats &total) {
+  infoAppend(text, "# Latencystats\r\n");
+  for (size_t i = 0; i < k_num_commands; i++) {
+    const CommandStats &cs = total.cmds[i];
+    if (cs.calls == 0) {
+      continue;
+    }
+    const char *name = k_commands[i].name.data();
+    infoAppend(text,
+               "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,"
+               "p99.9=%.3f\r\n",
+               name, (double)cmdLatencyPercentile(cs, 0.5) / 1e3,
+               (double)cmdLatencyPercentile(cs, 0.99) / 1e3,
+               (double)cmdLatencyPercentile(cs, 0.999) / 1e3);
+    // Only the non-empty buckets, keyed by their upper bound in ns
+    infoAppend(text, "latency_histogram_ns_%s:", name);
+    const char *sep = "";
+    for (size_t j = 0; j < k_latency_buckets; j++) {
+      if (cs.latency[j] == 0) {
+        continue;
+      }
+      if (j + 1 < k_latency_buckets) {
+        infoAppend(text, "%s%llu=%llu", sep, 1ull << j,
+                   (unsigned long long)cs.latency[j]);
+      } else {
+        infoAppend(text, "%sinf=%llu", sep, (unsigned long long)cs.latency[j]);
+      }
+      sep = ",";
+    }
+    infoAppend(text, "\r\n");
+  }
+}
+
+// INFO [section]: a text report, in "name:value" lines grouped by section.
+// Without a section (or with "all") every section is included.
+// The section asked for, false with an error in out if there is no such
+// section
+static bool infoSection(std::vector<std::string_view> &cmd,
+                        std::string &out) {
+  if (cmd.size() > 2) {
+    outErr(out, ERR_ARG, "syntax error");
+    return false;
+  }
+  std::string_view section = cmd.size() == 2 ? cmd[1] : "all";
+  bool found = cmdIs(section, "all") || cmdIs(section, "default");
+  for (const char *name : k_info_sections) {
+    found = found || cmdIs(section, name);
+  }
+  if (!found) {
+    outErr(out, ERR_ARG, "unknown INFO section");
+  }
+  return found;
+}
+
+static void infoReply(std::vector<std::string_view> &cmd,
+                      const std::vector<ShardInfo> &infos, std::string &out);
+static void doInfo(std::vector<std::string_view> &cmd, std::string &out) {
+  if (!infoSection(cmd, out)) {
+    return;
+  }
+  std::vector<std::string> parts(1);
+  infoSnapshot(cmd, parts[0]);
+  std::vector<ShardInfo> infos;
+  infoDecode(parts, infos);
+  infoReply(cmd, infos, out);
+}
+
+static void finishInfo(Pending *p, std::vector<std::string_view> &cmd,
+                       std::string &out) {
+  std::vector<ShardInfo> infos;
+  infoDecode(p->parts, infos);
+  infoReply(cmd, infos, out);
+}
+
+// INFO with several shards: a snapshot of every shard, taken by the shards
+// themselves so the counters never need to be atomic
+static bool shardRunInfo(Conn *conn, const Command *c,
+                         std::vector<std::string_view> &cmd, std::string &out) {
+  if (!infoSection(cmd, out)) {
+    return true;
+  }
+  Pending *p = pendingBegin(conn, c, &finishInfo);
+  for (size_t i = 0; i < global_data.nthreads; i++) {
+    if (global_data.shards[i] != local_data) {
+      pendingPost(p, i, &k_info_snapshot, &cmd);
+    }
+  }
+  infoSnapshot(cmd, p->parts[local_data->id]);
+  return false;
+}
+
+static void infoReply(std::vector<std::string_view> &cmd,
+                      const std::vector<ShardInfo> &infos, std::string &out) {
+  std::string_view section = cmd.size() == 2 ? cmd[1] : "all";
+  bool all = cmdIs(section, "all") || cmdIs(section, "default");
+  ShardStats total;
+  for (const ShardInfo &info : infos) {
+    statsMerge(total, info.stats);
+  }
+
+  std::string text;
+  auto want = [&](const char *name) {
+    if (!all && !cmdIs(section, name)) {
+      return false;
+    }
+    if (!text.empty()) {
+      text.append("\r\n");
+    }
+    return true;
+  };
+  if (want("server")) {
+    infoServer(text);
+  }
+  if (want("clients")) {
+    infoClients(text, infos, total);
+  }
+  if (want("memory")) {
+    infoMemory(text, infos);
+  }
+  if (want("persistence")) {
+    infoPersistence(text);
+  }
+  if (want("stats")) {
+    infoStats(text, total);
+  }
+  if (want("keyspace")) {
+    infoKeyspace(text, infos);
+  }
+  if (want("commandstats")) {
+    infoCommandStats(text, total);
+  }
+  if (want("latencystats")) {
+    infoLatencyStats(text, total);
+  }
+  return outStr(out, text);
+}
+
+// SLOWLOG GET [count]: the last count (default 10, -1 for all) slow commands,
+// newest first, as [id, unix time, us, [args], client fd].
+// SLOWLOG LEN: the number of entries. SLOWLOG RESET: empty the log.
+static void doSlowlog(std::vector<std::string_view> &cmd, std::string &out) {
+  std::lock_guard<std::mutex> lock(global_data.slowlog_mu);
+  const std::vector<SlowlogEntry> &log = global_data.slowlog;
+  uint64_t len = std::min<uint64_t>(
+      global_data.slowlog_next_id - global_data.slowlog_first_id, log.size());
+  if (cmdIs(cmd[1], "len") && cmd.size() == 2) {
+    return outInt(out, (int64_t)len);
+  }
+  if (cmdIs(cmd[1], "reset") && cmd.size() == 2) {
+    global_data.slowlog_first_id = global_data.slowlog_next_id;
+    return outNil(out);
+  }
+  if (!cmdIs(cmd[1], "get") || cmd.size() > 3) {
+    return outErr(out, ERR_ARG, "syntax error");
+  }
+  int64_t count = 10;
+  if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < -1)) {
+    return outErr(out, ERR_ARG, "expect count >= -1");
+  }
+  uint64_t n = count < 0 ? len : std::min<uint64_t>(len, (uint64_t)count);
+  outArr(out, (uint32_t)n);
+  for (uint64_t i = 0; i < n; i++) {
+    const SlowlogEntry &ent =
+        log[(global_data.slowlog_next_id - 1 - i) % log.size()];
+    outArr(out, 5);
+    outInt(out, (int64_t)ent.id);
+    outInt(out, ent.time);
+    outInt(out, (int64_t)ent.duration_us);
+    outArr(out, (uint32_t)ent.args.size());
+    for (const std::string &arg : ent.args) {
+      outStr(out, arg);
+    }
+    outInt(out, ent.client_fd);
+  }
+}
+
+static void outStr(std::string &out, std::string_view val) {
+  out.push_back(SER_STR);
+  uint32_t len = (uint32_t)val.size();
+  // To ensures that the length of the string is stored as a binary
+  // representation in the out string.
+  out.append((char *)&len, 4);
+  out.append(val.data(), val.size());
+}
+
+static void outInt(std::string &out, int64_t val) {
+  out.push_back(SER_INT);
+  out.append((char *)&val, 8);
+}
+
+static void outDbl(std::string &out, double val) {
+  out.push_back(SER_DBL);
+  out.append((char *)&val, 8);
+}
+
+static void outErr(std::string &out, int32_t error_code,
                    const std::string &msg) {
   out.push_back(SER_ERR);
   out.append((char *)&error_code, 4);
@@ -602,4 +4464,17 @@ static void outArr(std::string &out, uint32_t n) {
   out.append((char *)&n, 4);
 }
 
+// For arrays whose length is not known in advance, the length is patched by
+// outEndArr()
+static size_t outBeginArr(std::string &out) {
+  out.push_back(SER_ARR);
+  out.append("\0\0\0\0", 4);
+  return out.size() - 4;
+}
+
+static void outEndArr(std::string &out, size_t ctx, uint32_t n) {
+  assert(out[ctx - 1] == SER_ARR);
+  memcpy(&out[ctx], &n, 4);
+}
+
 static void outNil(std::string &out) { out.push_back(SER_NIL); }